@@ -13,6 +13,10 @@ endif()
 if (NOT DEFINED ARNOLD_ROOT)
 	# if the environment variable isn't set...
 	if (NOT DEFINED ENV{ARNOLD_ROOT})
+		if (NOT Arnold_FIND_REQUIRED)
+			message(STATUS "Arnold SDK not found, ARNOLD_ROOT is not set")
+			return()
+		endif()
 		message(FATAL_ERROR "Could not find Arnold SDK. Please set ARNOLD_ROOT to point to the root directory of the Arnold SDK. This is the directory containing bin, include etc. Either add a set() statement to a local.cmake file in the source directory, or define it as an environment variable prior to building.")
 	endif()
 	set(ARNOLD_ROOT $ENV{ARNOLD_ROOT})
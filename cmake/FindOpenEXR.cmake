@@ -0,0 +1,40 @@
+# FindOpenEXR.cmake
+# Sets OPENEXR_FOUND, OPENEXR_INCLUDE_DIRS and OPENEXR_LIBRARIES. Set OPENEXR_ROOT, in local.cmake
+# or the environment, to look in a particular installation first.
+SET(OPENEXR_FOUND FALSE)
+
+if (NOT DEFINED OPENEXR_ROOT AND DEFINED ENV{OPENEXR_ROOT})
+	set(OPENEXR_ROOT $ENV{OPENEXR_ROOT})
+endif()
+
+find_path(OPENEXR_INCLUDE_DIR
+	NAMES OpenEXR/ImfOutputFile.h
+	HINTS ${OPENEXR_ROOT}/include
+)
+
+# OpenEXR 3 has Imath separately, and OpenEXRCore instead of Half and Iex in IlmBase
+find_path(IMATH_INCLUDE_DIR
+	NAMES Imath/ImathBox.h OpenEXR/ImathBox.h
+	HINTS ${OPENEXR_ROOT}/include
+)
+
+foreach(OPENEXR_LIB OpenEXR IlmImf Imath Half Iex IlmThread OpenEXRCore)
+	find_library(OPENEXR_${OPENEXR_LIB}_LIBRARY
+		NAMES ${OPENEXR_LIB} ${OPENEXR_LIB}-3_1 ${OPENEXR_LIB}-2_5 ${OPENEXR_LIB}-2_4
+		HINTS ${OPENEXR_ROOT}/lib ${OPENEXR_ROOT}/lib64
+	)
+	if (OPENEXR_${OPENEXR_LIB}_LIBRARY)
+		list(APPEND OPENEXR_LIBRARIES ${OPENEXR_${OPENEXR_LIB}_LIBRARY})
+	endif()
+endforeach()
+
+if (OPENEXR_INCLUDE_DIR AND (OPENEXR_OpenEXR_LIBRARY OR OPENEXR_IlmImf_LIBRARY))
+	set(OPENEXR_FOUND TRUE)
+	set(OPENEXR_INCLUDE_DIRS ${OPENEXR_INCLUDE_DIR} ${OPENEXR_INCLUDE_DIR}/OpenEXR)
+	if (IMATH_INCLUDE_DIR)
+		list(APPEND OPENEXR_INCLUDE_DIRS ${IMATH_INCLUDE_DIR} ${IMATH_INCLUDE_DIR}/Imath)
+	endif()
+	message(STATUS "OpenEXR found in ${OPENEXR_INCLUDE_DIR}")
+else()
+	message(STATUS "OpenEXR not found, the cryptomatte_exr driver will not be built")
+endif()
@@ -1,7 +1,22 @@
+#include "exr.h"
+
 #include <OpenEXR/ImfHeader.h>
 #include <OpenEXR/ImfFrameBuffer.h>
 #include <OpenEXR/ImfOutputFile.h>
 #include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfCompression.h>
+#include <OpenEXR/ImfDeepFrameBuffer.h>
+#include <OpenEXR/ImfDeepScanLineOutputPart.h>
+#include <OpenEXR/ImfMultiPartOutputFile.h>
+#include <OpenEXR/ImfOutputPart.h>
+#include <OpenEXR/ImfPartType.h>
+#include <OpenEXR/ImfStandardAttributes.h>
+#include <OpenEXR/ImfStringAttribute.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <thread>
 
 void writeRGBEXR(const char* filename, const float* pixels, int w, int h)
 {
@@ -70,4 +85,191 @@ void writeFloatEXR(const char* filename, const float* pixels, int w, int h)
 
     writeRGBEXR(filename, px, w, h);
     delete[] px;
-}
\ No newline at end of file
+}
+
+static Imf::Compression exrCompression(const char* compression)
+{
+    if (strcmp(compression, "none") == 0)
+        return Imf::NO_COMPRESSION;
+    if (strcmp(compression, "zips") == 0)
+        return Imf::ZIPS_COMPRESSION;
+    if (strcmp(compression, "piz") == 0)
+        return Imf::PIZ_COMPRESSION;
+    return Imf::ZIP_COMPRESSION;
+}
+
+// the type of the channel in the file, and of the slice that reads the floats it's written from
+static Imf::PixelType exrFileType(EXRPixelType type)
+{
+    return type == EXR_UINT ? Imf::UINT : type == EXR_HALF ? Imf::HALF : Imf::FLOAT;
+}
+
+static Imf::PixelType exrSliceType(EXRPixelType type)
+{
+    return type == EXR_UINT ? Imf::UINT : Imf::FLOAT;
+}
+
+static int exrThreads(int threads)
+{
+    // Blocks in flight per file. They are compressed by OpenEXR's global pool, which belongs to
+    // the host (Arnold, Maya, Houdini...) and is left as it sized it.
+    if (threads <= 0)
+        threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    return threads;
+}
+
+static Imf::Header exrHeader(const EXRWindow& display_window, const EXRWindow& data_window,
+                             const std::vector<EXRAttribute>& attributes,
+                             Imf::Compression compression)
+{
+    const Imath::Box2i display(Imath::V2i(display_window.minx, display_window.miny),
+                               Imath::V2i(display_window.maxx, display_window.maxy));
+    const Imath::Box2i data(Imath::V2i(data_window.minx, data_window.miny),
+                            Imath::V2i(data_window.maxx, data_window.maxy));
+    Imf::Header header(display, data);
+    header.compression() = compression;
+    for (const EXRAttribute& attribute : attributes)
+    {
+        if (attribute.type == "STRING")
+            header.insert(attribute.name, Imf::StringAttribute(attribute.value));
+        else if (attribute.type == "INT")
+            header.insert(attribute.name, Imf::IntAttribute(atoi(attribute.value.c_str())));
+        else if (attribute.type == "FLOAT")
+            header.insert(attribute.name,
+                          Imf::FloatAttribute((float)atof(attribute.value.c_str())));
+    }
+    return header;
+}
+
+static void exrInsertChannels(const EXRWindow& data_window,
+                              const std::vector<EXRChannel>& channels, Imf::Header& header,
+                              Imf::FrameBuffer& fb)
+{
+    for (const EXRChannel& channel : channels)
+    {
+        header.channels().insert(channel.name, Imf::Channel(exrFileType(channel.type)));
+        // slices are addressed from pixel (0, 0), which may be outside the data window
+        char* origin = (char*)channel.pixels - data_window.minx * (ptrdiff_t)channel.xstride -
+                       data_window.miny * (ptrdiff_t)channel.ystride;
+        fb.insert(channel.name, Imf::Slice(exrSliceType(channel.type), origin, channel.xstride,
+                                           channel.ystride));
+    }
+}
+
+bool writeChannelsEXR(const char* filename, const EXRWindow& display_window,
+                      const EXRWindow& data_window, const std::vector<EXRChannel>& channels,
+                      const std::vector<EXRAttribute>& attributes, const char* compression,
+                      int threads, std::string& error)
+{
+    threads = exrThreads(threads);
+    try
+    {
+        Imf::Header header =
+            exrHeader(display_window, data_window, attributes, exrCompression(compression));
+        Imf::FrameBuffer fb;
+        exrInsertChannels(data_window, channels, header, fb);
+
+        Imf::OutputFile file(filename, header, threads);
+        file.setFrameBuffer(fb);
+        file.writePixels(data_window.maxy - data_window.miny + 1);
+    }
+    catch (const std::exception& e)
+    {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool writeMultiPartEXR(const char* filename, const EXRWindow& display_window,
+                       const EXRWindow& data_window, const std::vector<EXRPart>& parts,
+                       const char* compression, int threads, std::string& error)
+{
+    threads = exrThreads(threads);
+    try
+    {
+        std::vector<Imf::Header> headers;
+        std::vector<Imf::FrameBuffer> fbs(parts.size());
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            Imf::Header header = exrHeader(display_window, data_window, parts[i].attributes,
+                                           exrCompression(compression));
+            header.setName(parts[i].name);
+            header.setType(Imf::SCANLINEIMAGE);
+            exrInsertChannels(data_window, parts[i].channels, header, fbs[i]);
+            headers.push_back(header);
+        }
+
+        Imf::MultiPartOutputFile file(filename, headers.data(), (int)headers.size(), false,
+                                      threads);
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            Imf::OutputPart output(file, (int)i);
+            output.setFrameBuffer(fbs[i]);
+            output.writePixels(data_window.maxy - data_window.miny + 1);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool writeDeepEXR(const char* filename, const EXRWindow& display_window,
+                  const EXRWindow& data_window, const std::vector<EXRDeepPart>& parts,
+                  const char* compression, int threads, std::string& error)
+{
+    threads = exrThreads(threads);
+    Imf::Compression deep_compression = exrCompression(compression);
+    if (deep_compression == Imf::PIZ_COMPRESSION)
+        deep_compression = Imf::ZIP_COMPRESSION;
+    const int width = data_window.maxx - data_window.minx + 1;
+    try
+    {
+        std::vector<Imf::Header> headers;
+        for (const EXRDeepPart& part : parts)
+        {
+            Imf::Header header =
+                exrHeader(display_window, data_window, part.attributes, deep_compression);
+            header.setName(part.name);
+            header.setType(Imf::DEEPSCANLINE);
+            for (const EXRDeepChannel& channel : part.channels)
+                header.channels().insert(channel.name, Imf::Channel(exrFileType(channel.type)));
+            headers.push_back(header);
+        }
+
+        Imf::MultiPartOutputFile file(filename, headers.data(), (int)headers.size(), false,
+                                      threads);
+        for (size_t i = 0; i < parts.size(); i++)
+        {
+            const EXRDeepPart& part = parts[i];
+            Imf::DeepFrameBuffer fb;
+            // as in writeChannelsEXR, slices are addressed from pixel (0, 0)
+            const ptrdiff_t count_offset = data_window.minx + (ptrdiff_t)data_window.miny * width;
+            fb.insertSampleCountSlice(Imf::Slice(Imf::UINT,
+                                                 (char*)(part.counts - count_offset),
+                                                 sizeof(unsigned int),
+                                                 sizeof(unsigned int) * width));
+            for (const EXRDeepChannel& channel : part.channels)
+            {
+                char* origin = (char*)channel.samples -
+                               data_window.minx * (ptrdiff_t)channel.xstride -
+                               data_window.miny * (ptrdiff_t)channel.ystride;
+                fb.insert(channel.name,
+                          Imf::DeepSlice(exrSliceType(channel.type), origin, channel.xstride,
+                                         channel.ystride, channel.sample_stride));
+            }
+            Imf::DeepScanLineOutputPart output(file, (int)i);
+            output.setFrameBuffer(fb);
+            output.writePixels(data_window.maxy - data_window.miny + 1);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
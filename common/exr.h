@@ -1,5 +1,8 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
 void writeRGBEXR(const char* filename, const float* pixels, int w, int h);
 
 // pads a 1D lut to be a bit thicker for easier viewing
@@ -7,4 +10,87 @@ void writeThickRGBEXR(const char* filename, const float* pixels, int w, int h);
 
 void writeFloatEXR(const char* filename, const float* pixels, int w, int h);
 
-void writeThickFloatEXR(const char* filename, const float* pixels, int w);
\ No newline at end of file
+void writeThickFloatEXR(const char* filename, const float* pixels, int w);
+
+// How a channel is stored in the file. Pixels are floats in memory either way, EXR_UINT storing
+// their bits rather than their values.
+enum EXRPixelType
+{
+    EXR_FLOAT,
+    EXR_HALF,
+    EXR_UINT
+};
+
+// A float channel of an image, (x, y) of the data window being at
+// pixels + (x - minx) * xstride + (y - miny) * ystride bytes.
+struct EXRChannel
+{
+    std::string name;
+    const float* pixels;
+    size_t xstride;
+    size_t ystride;
+    EXRPixelType type = EXR_FLOAT;
+};
+
+// Header attributes, type being "STRING", "INT" or "FLOAT".
+struct EXRAttribute
+{
+    std::string type;
+    std::string name;
+    std::string value;
+};
+
+struct EXRWindow
+{
+    int minx, miny, maxx, maxy; // inclusive
+};
+
+// Writes the channels as a scanline EXR, with threads blocks in flight (0 for one per core),
+// compressed on the host's OpenEXR thread pool. compression is none, zip, zips or piz. Returns
+// false and sets error when the file could not be written.
+bool writeChannelsEXR(const char* filename, const EXRWindow& display_window,
+                      const EXRWindow& data_window, const std::vector<EXRChannel>& channels,
+                      const std::vector<EXRAttribute>& attributes, const char* compression,
+                      int threads, std::string& error);
+
+// A part of a multi-part EXR, with its own channels and header attributes.
+struct EXRPart
+{
+    std::string name;
+    std::vector<EXRChannel> channels;
+    std::vector<EXRAttribute> attributes;
+};
+
+// Writes the parts as a multi-part scanline EXR, as for writeChannelsEXR. Readers can then load
+// one part without decompressing the others.
+bool writeMultiPartEXR(const char* filename, const EXRWindow& display_window,
+                       const EXRWindow& data_window, const std::vector<EXRPart>& parts,
+                       const char* compression, int threads, std::string& error);
+
+// A float channel of a deep image. At samples + (x - minx) * xstride + (y - miny) * ystride
+// bytes is the pointer to the first sample of pixel (x, y), the others following sample_stride
+// bytes apart. With strides of 0, every pixel's samples are the same.
+struct EXRDeepChannel
+{
+    std::string name;
+    const float* const* samples;
+    size_t xstride;
+    size_t ystride;
+    size_t sample_stride;
+    EXRPixelType type = EXR_FLOAT;
+};
+
+// A part of a deep EXR, with its own number of samples per pixel.
+struct EXRDeepPart
+{
+    std::string name;
+    const unsigned int* counts; // per pixel of the data window, in rows
+    std::vector<EXRDeepChannel> channels;
+    std::vector<EXRAttribute> attributes;
+};
+
+// Writes the parts as a multi-part deep scanline EXR. As for writeMultiPartEXR, except that piz
+// falls back to zip, deep files can't use it.
+bool writeDeepEXR(const char* filename, const EXRWindow& display_window,
+                  const EXRWindow& data_window, const std::vector<EXRDeepPart>& parts,
+                  const char* compression, int threads, std::string& error);
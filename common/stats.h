@@ -1,16 +1,33 @@
 #pragma once
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <limits>
+#include <mutex>
 #include <string>
-#include <ai.h>
+#include <vector>
 
 
 // stats.h
+//
+// Range and Histogram collect samples on one thread. To collect them from many threads, keep
+// them in a ShardedStats, which gives every thread its own copy, and merge the copies at render
+// end. Both export JSON and CSV. Needs no renderer headers.
+
+#define STATS_CACHE_LINE 64
+
+// shards of a ShardedStats unless given, renderers pass their own thread limit
+#ifndef STATS_MAX_THREADS
+#define STATS_MAX_THREADS 256
+#endif
+
 struct Range
 {
 	Range(const std::string& nm, bool rod=false)
-	: name(nm), min(AI_INFINITE), max(-AI_INFINITE), total(0.0), n(0.0), reportOnDestruction(rod)
+	: name(nm), min(std::numeric_limits<double>::infinity()), max(-std::numeric_limits<double>::infinity()),
+	  total(0.0), n(0.0), reportOnDestruction(rod)
 	{}
 
 	~Range()
@@ -26,11 +43,52 @@ struct Range
 		n++;
 	}
 
+	// Adds the samples of another range, for example one per thread.
+	void merge(const Range& other)
+	{
+		min = std::min(other.min, min);
+		max = std::max(other.max, max);
+		total += other.total;
+		n += other.n;
+	}
+
+	void reset()
+	{
+		min = std::numeric_limits<double>::infinity();
+		max = -std::numeric_limits<double>::infinity();
+		total = 0.0;
+		n = 0.0;
+	}
+
+	double mean() const
+	{
+		return n ? total/n : 0.0;
+	}
+
 	void report(std::ostream& os)
 	{
 		os << "[" << name << "] " << "min: " << min << " max: " << max << " avg: " << total/n << std::endl;
 	}
 
+	// {"name": ..., "count": ..., "min": ..., "max": ..., "mean": ..., "total": ...}
+	void writeJSON(std::ostream& os) const
+	{
+		os << "{\"name\": \"" << name << "\", \"count\": " << n;
+		os << ", \"min\": " << (n ? min : 0.0) << ", \"max\": " << (n ? max : 0.0);
+		os << ", \"mean\": " << mean() << ", \"total\": " << total << "}";
+	}
+
+	static void writeCSVHeader(std::ostream& os)
+	{
+		os << "name,count,min,max,mean,total" << std::endl;
+	}
+
+	void writeCSV(std::ostream& os) const
+	{
+		os << name << "," << n << "," << (n ? min : 0.0) << "," << (n ? max : 0.0) << ",";
+		os << mean() << "," << total << std::endl;
+	}
+
 	std::string name;
 
 	double min;
@@ -49,9 +107,41 @@ struct Histogram
 		memset(bins, 0, sizeof(double)*nbins);
 	}
 
+	Histogram(const Histogram& other)
+	: name(other.name), min(other.min), max(other.max), total(other.total), bins(NULL), nbins(other.nbins),
+	  less(other.less), more(other.more), normalize(other.normalize), reportOnDestruction(other.reportOnDestruction)
+	{
+		bins = new double[nbins];
+		memcpy(bins, other.bins, sizeof(double)*nbins);
+	}
+
+	Histogram& operator=(const Histogram& other)
+	{
+		if (this != &other)
+		{
+			if (nbins != other.nbins)
+			{
+				delete[] bins;
+				bins = new double[other.nbins];
+			}
+			name = other.name;
+			min = other.min;
+			max = other.max;
+			total = other.total;
+			nbins = other.nbins;
+			memcpy(bins, other.bins, sizeof(double)*nbins);
+			less = other.less;
+			more = other.more;
+			normalize = other.normalize;
+			reportOnDestruction = other.reportOnDestruction;
+		}
+		return *this;
+	}
+
 	~Histogram()
 	{
 		if (reportOnDestruction) report(std::cerr);
+		delete[] bins;
 	}
 
 	void addSample(double x)
@@ -67,6 +157,50 @@ struct Histogram
 		total++;
 	}
 
+	// Adds the samples of another histogram of the same bins, for example one per thread.
+	void merge(const Histogram& other)
+	{
+		less += other.less;
+		more += other.more;
+		for (int i = 0; i < std::min(nbins, other.nbins); ++i)
+		{
+			bins[i] += other.bins[i];
+		}
+		total += other.total;
+	}
+
+	void reset()
+	{
+		memset(bins, 0, sizeof(double)*nbins);
+		less = 0.0;
+		more = 0.0;
+		total = 0.0;
+	}
+
+	double binWidth() const
+	{
+		return (max-min) / nbins;
+	}
+
+	// The value below which fraction p (0 to 1) of the samples are, interpolated within bins.
+	// Samples below min count as min, and samples at or above max as max.
+	double percentile(double p) const
+	{
+		if (total <= 0.0) return min;
+		double rank = std::min(std::max(p, 0.0), 1.0) * total;
+		if (rank <= less) return min;
+		rank -= less;
+		for (int i = 0; i < nbins; ++i)
+		{
+			if (rank <= bins[i] && bins[i] > 0.0)
+			{
+				return min + (i + rank/bins[i]) * binWidth();
+			}
+			rank -= bins[i];
+		}
+		return max;
+	}
+
 	void report(std::ostream& os)
 	{
 		if (normalize)
@@ -89,6 +223,37 @@ struct Histogram
 		os << std::endl;
 	}
 
+	// {"name": ..., "min": ..., "max": ..., "count": ..., "less": ..., "bins": [...], "more": ...,
+	// "p50": ..., "p90": ..., "p99": ...}, counts never normalized
+	void writeJSON(std::ostream& os) const
+	{
+		os << "{\"name\": \"" << name << "\", \"min\": " << min << ", \"max\": " << max;
+		os << ", \"count\": " << total << ", \"less\": " << less << ", \"bins\": [";
+		for (int i = 0; i < nbins; ++i)
+		{
+			os << (i ? ", " : "") << bins[i];
+		}
+		os << "], \"more\": " << more;
+		os << ", \"p50\": " << percentile(0.5) << ", \"p90\": " << percentile(0.9);
+		os << ", \"p99\": " << percentile(0.99) << "}";
+	}
+
+	static void writeCSVHeader(std::ostream& os)
+	{
+		os << "name,low,high,count" << std::endl;
+	}
+
+	// One row per bin, and for the samples below and above the bins, with -inf and inf bounds.
+	void writeCSV(std::ostream& os) const
+	{
+		os << name << ",-inf," << min << "," << less << std::endl;
+		for (int i = 0; i < nbins; ++i)
+		{
+			os << name << "," << min + i*binWidth() << "," << min + (i+1)*binWidth() << "," << bins[i] << std::endl;
+		}
+		os << name << "," << max << ",inf," << more << std::endl;
+	}
+
 	std::string name;
 	double min;
 	double max;
@@ -100,4 +265,125 @@ struct Histogram
 	double more;
 	bool normalize;
 	bool reportOnDestruction;
-};
\ No newline at end of file
+};
+
+// ShardedStats keeps a copy of its prototype that never reports on destruction, so neither do
+// the shards and merged() copied from it. Overloaded for the types that can report.
+inline void statsCopied(Range& range) { range.reportOnDestruction = false; }
+inline void statsCopied(Histogram& histogram) { histogram.reportOnDestruction = false; }
+template <typename T>
+inline void statsCopied(T&) {}
+
+// Dense index of the calling thread, from 0, for ShardedStats. Threads that exit give their
+// index back, so a pool of render threads keeps the same indices between renders.
+class StatsThreadIndex
+{
+public:
+	static int get()
+	{
+		static thread_local StatsThreadIndex index;
+		return index.value;
+	}
+
+private:
+	StatsThreadIndex()
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		std::vector<int>& free = freeIndices();
+		if (free.empty())
+		{
+			value = nextIndex()++;
+		}
+		else
+		{
+			value = free.back();
+			free.pop_back();
+		}
+	}
+
+	~StatsThreadIndex()
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		freeIndices().push_back(value);
+	}
+
+	static std::mutex& mutex() { static std::mutex m; return m; }
+	static std::vector<int>& freeIndices() { static std::vector<int> free; return free; }
+	static int& nextIndex() { static int next = 0; return next; }
+
+	int value;
+};
+
+// One T per thread, each on its own cache lines, so that threads count without locks, atomics
+// or false sharing. T needs a copy constructor, merge(const T&) and reset(), as Range and
+// Histogram have. Shards are copies of the prototype, made by their thread on first use.
+// merged() and reset() must only be called while no thread is counting, for example at render
+// end.
+template <typename T>
+class ShardedStats
+{
+public:
+	explicit ShardedStats(const T& proto, int maxThreads=STATS_MAX_THREADS)
+	: prototype(proto), shards(maxThreads, NULL)
+	{
+		statsCopied(prototype);
+	}
+
+	~ShardedStats()
+	{
+		for (size_t i = 0; i < shards.size(); ++i)
+		{
+			delete shards[i];
+		}
+	}
+
+	// The calling thread's shard, NULL for threads beyond maxThreads.
+	T* local()
+	{
+		const int index = StatsThreadIndex::get();
+		if (index >= (int)shards.size()) return NULL;
+		if (!shards[index]) shards[index] = new Shard(prototype);
+		return &shards[index]->value;
+	}
+
+	// The prototype with every shard merged into it.
+	T merged() const
+	{
+		T result(prototype);
+		forEach([&result](const T& shard) { result.merge(shard); });
+		return result;
+	}
+
+	template <typename F>
+	void forEach(F f) const
+	{
+		for (size_t i = 0; i < shards.size(); ++i)
+		{
+			if (shards[i]) f(shards[i]->value);
+		}
+	}
+
+	void reset()
+	{
+		for (size_t i = 0; i < shards.size(); ++i)
+		{
+			if (shards[i]) shards[i]->value.reset();
+		}
+	}
+
+private:
+	ShardedStats(const ShardedStats&);
+	ShardedStats& operator=(const ShardedStats&);
+
+	// Padded on both sides, as new only aligns to alignof(max_align_t) before C++17.
+	struct Shard
+	{
+		explicit Shard(const T& proto) : value(proto) { statsCopied(value); }
+		char paddingFront[STATS_CACHE_LINE];
+		T value;
+		char paddingBack[STATS_CACHE_LINE];
+	};
+
+	T prototype;
+	std::vector<Shard*> shards;
+};
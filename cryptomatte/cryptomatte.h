@@ -32,7 +32,10 @@ getting global
         CryptomatteData* data =
             reinterpret_cast<CryptomatteData*>(AiNodeGetLocalData(node));
 
-        // set cryptomatte depth (optional)
+        // set cryptomatte depth (optional). Preview channels are made from the ID AOV by
+        // the preview filter, with the filter type of the cryptomatte's output, or gaussian
+        // for types cryptomattes don't support. Their colors are the hash's bits, which
+        // differ from hash_name_rgb for the few hashes hash_to_float changes.
         data->set_option_channels(AiNodeGetInt(node, "cryptomatte_depth"),
                                 CRYPTO_PREVIEWINEXR_DEFAULT);
 
@@ -42,23 +45,49 @@ getting global
         // set option for sidecar manifest (optional)
         data->set_manifest_sidecar(sidecar);
 
-        AtArray* uc_aov_array = AiArray(
-            4, 1, AI_TYPE_STRING, AiNodeGetStr(node, "user_crypto_aov_0").c_str(),
-            AiNodeGetStr(node, "user_crypto_aov_1").c_str(),
-            AiNodeGetStr(node, "user_crypto_aov_2").c_str(),
-            AiNodeGetStr(node, "user_crypto_aov_3").c_str());
-        AtArray* uc_src_array = AiArray(
-            4, 1, AI_TYPE_STRING, AiNodeGetStr(node, "user_crypto_src_0").c_str(),
-            AiNodeGetStr(node, "user_crypto_src_1").c_str(),
-            AiNodeGetStr(node, "user_crypto_src_2").c_str(),
-            AiNodeGetStr(node, "user_crypto_src_3").c_str());
+        // compile embedded manifests on a background thread (optional). Drivers read them
+        // when they open, so this overlaps scene preparation only, not rendering.
+        data->set_option_async_manifests(async);
+
+        // reuse manifests from an on-disk cache (optional)
+        data->set_option_manifest_cache(cache_directory);
+
+        // only write rendered names to sidecar manifests (optional)
+        data->set_option_hit_only_manifests(hit_only);
+
+        // write sidecar manifests as JSON or binary (optional - see CryptoManifestFormat)
+        data->set_option_manifest_format(format);
+
+        // compress embedded manifests (optional - see CryptoManifestCompression)
+        data->set_option_manifest_compression(compression);
+
+        // channel types of cryptomatte_exr files (optional - see CryptoChannelLayout)
+        data->set_option_channel_layout(layout);
+
+        // report counters at render end, and write them to JSON (optional - see
+        // cryptomatte_stats.h)
+        data->set_option_performance_stats(stats, stats_json);
+
+        // write a timeline of setup, manifests and I/O at render end (optional - see
+        // cryptomatte_trace.h)
+        data->set_option_performance_trace(trace);
+
+        // hierarchy cryptomattes, <aov>_level1 to <aov>_level<levels> (optional)
+        data->set_option_hierarchy(aov_hierarchy, levels);
+
+        // any number of user cryptomattes, pairs of AOV names and source user data
+        AtArray* uc_aov_array = AiNodeGetArray(node, "user_crypto_aovs");
+        AtArray* uc_src_array = AiNodeGetArray(node, "user_crypto_srcs");
 
         // does all the setup work. User cryptomatte arrays are optional (can be
-        // nulls).
+        // nulls). Their user data is looked up once per object and thread, so
+        // the cost per sample barely grows with the number of user cryptomattes.
         // The three arguments are the names of the cryptomatte AOVs. If the
         // AOVs are active (connected to EXR drivers), this does all the
         // complicated setup work of creating multiple AOVs if necessary,
-        // writing metadata, etc.
+        // writing metadata, etc. Later calls only redo what changed since the
+        // previous one, and return immediately if nothing did. The user
+        // cryptomatte arrays are not kept.
         data->setup_all(AiNodeGetStr(node, "aov_crypto_asset"),
                         AiNodeGetStr(node, "aov_crypto_object"),
                         AiNodeGetStr(node, "aov_crypto_material"), uc_aov_array,
@@ -81,26 +110,36 @@ getting global
 
 */
 
-#include "MurmurHash3.h"
+#include "cryptomatte_core.h"
+#include "cryptomatte_stats.h"
+#include "cryptomatte_trace.h"
+#include "filters.h"
+#include "manifest_cache.h"
+#include "manifest_deflate.h"
+#include "output_spec.h"
 #include <ai.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #define NOMINMAX // lets you keep using std::min on windows
 
-using ManifestMap = std::map<std::string, float>;
-
-using StringVector = std::vector<std::string>;
-
 ///////////////////////////////////////////////
 //
 //      Constants
@@ -112,15 +151,35 @@ using StringVector = std::vector<std::string>;
 #define CRYPTO_STRIPOBJNS_DEFAULT true
 #define CRYPTO_STRIPMATNS_DEFAULT true
 #define CRYPTO_ICEPCLOUDVERB_DEFAULT 1
+#define CRYPTO_HIERARCHYLEVELS_DEFAULT 4
 #define CRYPTO_SIDECARMANIFESTS_DEFAULT false
 #define CRYPTO_PREVIEWINEXR_DEFAULT false
+#define CRYPTO_ASYNCMANIFESTS_DEFAULT false
+#define CRYPTO_HITONLYMANIFESTS_DEFAULT false
+#define CRYPTO_MANIFESTFORMAT_DEFAULT CRYPTO_MANIFEST_JSON
+#define CRYPTO_MANIFESTCOMPRESSION_DEFAULT CRYPTO_COMPRESSION_NONE
+#define CRYPTO_CHANNELLAYOUT_DEFAULT CRYPTO_CHANNELS_FLOAT
+#define CRYPTO_PERFORMANCESTATS_DEFAULT false
+#define CRYPTO_PERFORMANCETRACE_DEFAULT false
+
+// Sidecar manifest formats. Embedded manifests are always JSON.
+enum CryptoManifestFormat { CRYPTO_MANIFEST_JSON = 0, CRYPTO_MANIFEST_BINARY };
+static const char* manifestFormatEnumNames[] = {"json", "binary", nullptr};
+
+// Embedded manifest compression, see manifest_deflate.h. Deflate with plain also keeps the plain
+// manifest, for readers that don't know about compressed manifests.
+enum CryptoManifestCompression {
+    CRYPTO_COMPRESSION_NONE = 0,
+    CRYPTO_COMPRESSION_DEFLATE,
+    CRYPTO_COMPRESSION_DEFLATE_WITH_PLAIN
+};
+static const char* manifestCompressionEnumNames[] = {"none", "deflate", "deflate_with_plain",
+                                                     nullptr};
 
-// System values
-#define MAX_STRING_LENGTH 2048
-#define MAX_CRYPTOMATTE_DEPTH 99
-#define MAX_USER_CRYPTOMATTES 16
-
-extern uint8_t g_pointcloud_instance_verbosity;
+// How cryptomatte_exr stores rank channels. uint_half stores IDs as UINT channels of their hash
+// bits and coverage as HALF, a quarter smaller than full float. driver_exr only writes float.
+enum CryptoChannelLayout { CRYPTO_CHANNELS_FLOAT = 0, CRYPTO_CHANNELS_UINT_HALF };
+static const char* channelLayoutEnumNames[] = {"float", "uint_half", nullptr};
 
 // Internal
 #define CRYPTOMATTE_METADATA_SET_FLAG "already_has_crypto_metadata_"
@@ -134,307 +193,26 @@ extern const AtString CRYPTO_ASSET_OFFSET_UDATA;
 extern const AtString CRYPTO_OBJECT_OFFSET_UDATA;
 extern const AtString CRYPTO_MATERIAL_OFFSET_UDATA;
 
-extern AtCritSec g_critsec;
-
 // Some static AtStrings to cache
 const AtString aStr_shader("shader");
 const AtString aStr_list_aggregate("list_aggregate");
 
-// Name processing flags
-using CryptoNameFlag = uint8_t;
-
-// clang-format off
-#define CRYPTO_NAME_NONE          0x00
-#define CRYPTO_NAME_STRIP_NS      0x01 /* remove "namespace" */
-#define CRYPTO_NAME_MAYA          0x02 /* mtoa style */
-#define CRYPTO_NAME_PATHS         0x04 /* path based (starting with "/") */
-#define CRYPTO_NAME_OBJPATHPIPES  0x08 /* pipes are considered in paths (c4d) */
-#define CRYPTO_NAME_MATPATHPIPES  0x10 /* sitoa, old-c4d style */
-#define CRYPTO_NAME_LEGACY        0x20 /* sitoa, old-c4d style */
-#define CRYPTO_NAME_ALL           CryptoNameFlag(-1)
-// clang-format on
-
-///////////////////////////////////////////////
-//
-//      String processing
-//
-///////////////////////////////////////////////
-
-inline void safe_copy_to_buffer(char buffer[MAX_STRING_LENGTH], const char* c) {
-    if (c)
-        strncpy(buffer, c, std::min(strlen(c), (size_t)MAX_STRING_LENGTH - 1));
-    else
-        buffer[0] = '\0';
-}
-
-inline bool cstr_empty(const char* c) { return !c || c[0] == '\0'; }
-
-///////////////////////////////////////////////
-//
-//      Name processing
-//
-///////////////////////////////////////////////
-
-inline bool sitoa_pointcloud_instance_handling(const char* obj_full_name,
-                                               char obj_name_out[MAX_STRING_LENGTH]) {
-    if (g_pointcloud_instance_verbosity == 0 || !strstr(obj_full_name, ".SItoA.Instance.")) {
-        return false;
-    }
-    char obj_name[MAX_STRING_LENGTH];
-    safe_copy_to_buffer(obj_name, obj_full_name);
-
-    char* instance_start = strstr(obj_name, ".SItoA.Instance.");
-    if (!instance_start)
-        return false;
-
-    char* space = strstr(instance_start, " ");
-    if (!space)
-        return false;
-
-    char* instance_name = &space[1];
-    char* obj_suffix2 = strstr(instance_name, ".SItoA.");
-    if (!obj_suffix2)
-        return false;
-    obj_suffix2[0] = '\0'; // strip the suffix
-    size_t chars_to_copy = strlen(instance_name);
-    if (chars_to_copy >= MAX_STRING_LENGTH || chars_to_copy == 0) {
-        return false;
-    }
-    if (g_pointcloud_instance_verbosity == 2) {
-        char* frame_numbers = &instance_start[16]; // 16 chars in ".SItoA.Instance.", this gets us
-                                                   // to the first number
-        char* instance_ID = strstr(frame_numbers, ".");
-        if (!instance_ID)
-            return false;
-        char* instance_ID_end = strstr(instance_ID, " ");
-        if (!instance_ID_end)
-            return false;
-        instance_ID_end[0] = '\0';
-        size_t ID_len = strlen(instance_ID);
-        strncpy(&instance_name[chars_to_copy], instance_ID, ID_len);
-        chars_to_copy += ID_len;
-    }
-
-    strncpy(obj_name_out, instance_name, chars_to_copy);
-    return true;
-}
-
-inline void mtoa_strip_namespaces(const char* obj_full_name, char obj_name_out[MAX_STRING_LENGTH]) {
-    char* to = obj_name_out;
-    size_t len = 0;
-    size_t sublen = 0;
-    const char* from = obj_full_name;
-    const char* end = from + strlen(obj_full_name);
-    const char* found = strchr(from, '|');
-    const char* sep = nullptr;
-
-    while (found) {
-        sep = strchr(from, ':');
-        if (sep && sep < found) {
-            from = sep + 1;
-        }
-        sublen = found - from;
-        memmove(to, from, sublen);
-        to[sublen] = '|';
-
-        len += sublen + 1;
-        to += sublen + 1;
-        from = found + 1;
-
-        found = strchr(from, '|');
-    }
-
-    sep = strchr(from, ':');
-    if (sep && sep < end) {
-        from = sep + 1;
-    }
-    sublen = end - from;
-    memmove(to, from, sublen);
-    to[sublen] = '\0';
-}
-
-inline void get_clean_object_name(const char* obj_full_name, char obj_name_out[MAX_STRING_LENGTH],
-                                  char ns_name_out[MAX_STRING_LENGTH], CryptoNameFlag flags) {
-    if (flags == CRYPTO_NAME_NONE) {
-        memmove(obj_name_out, obj_full_name, strlen(obj_full_name));
-        strcpy(ns_name_out, "default");
-        return;
-    }
-
-    char ns_name[MAX_STRING_LENGTH] = "";
-    safe_copy_to_buffer(ns_name, obj_full_name);
-    bool obj_already_done = false;
-
-    const bool do_strip_ns = (flags & CRYPTO_NAME_STRIP_NS) != 0;
-    const bool do_maya = (flags & CRYPTO_NAME_MAYA) != 0;
-    const bool do_paths = (flags & CRYPTO_NAME_PATHS) != 0;
-    const bool do_path_pipe = (flags & CRYPTO_NAME_OBJPATHPIPES) != 0;
-    const bool do_legacy = (flags & CRYPTO_NAME_LEGACY) != 0;
-
-    const uint8_t mode_maya = 0;
-    const uint8_t mode_pathstyle = 1;
-    const uint8_t mode_si = 2;
-    const uint8_t mode_c4d = 3;
-
-    uint8_t mode = mode_maya;
-    if (ns_name[0] == '/') {
-        // Path-style: /obj/hierarchy|obj_cache_hierarchy
-        // For instance: /Null/Sphere
-        //               /Null/Cloner|Null/Sphere1
-        mode = mode_pathstyle;
-    } else if (do_legacy && strncmp(ns_name, "c4d|", 4) == 0) {
-        // C4DtoA prior 2.3: c4d|obj_hierarchy|...
-        mode = mode_c4d;
-        const char* nsp = ns_name + 4;
-        size_t len = strlen(nsp);
-        memmove(ns_name, nsp, len);
-        ns_name[len] = '\0';
-    } else if (do_legacy && strstr(ns_name, ".SItoA.")) {
-        // in Softimage mode
-        mode = mode_si;
-        char* sitoa_suffix = strstr(ns_name, ".SItoA.");
-        obj_already_done = sitoa_pointcloud_instance_handling(obj_full_name, obj_name_out);
-        sitoa_suffix[0] = '\0'; // cut off everything after the start of .SItoA
-    } else {
-        mode = mode_maya;
-    }
-
-    char* nsp_separator = nullptr;
-    if (mode == mode_c4d && do_legacy) {
-        nsp_separator = strrchr(ns_name, '|');
-    } else if (mode == mode_pathstyle && do_paths) {
-        char* lastPipe = do_path_pipe ? strrchr(ns_name, '|') : nullptr;
-        char* lastSlash = strrchr(ns_name, '/');
-        nsp_separator = lastSlash > lastPipe ? lastSlash : lastPipe;
-    } else if (mode == mode_si && do_legacy) {
-        nsp_separator = strchr(ns_name, '.');
-    } else if (mode == mode_maya && do_maya)
-        nsp_separator = strchr(ns_name, ':');
-
-    if (!obj_already_done) {
-        if (!nsp_separator || !do_strip_ns) { // use whole name
-            memmove(obj_name_out, ns_name, strlen(ns_name));
-        } else if (mode == mode_maya) { // maya
-            mtoa_strip_namespaces(ns_name, obj_name_out);
-        } else { // take everything right of sep
-            char* obj_name_start = nsp_separator + 1;
-            memmove(obj_name_out, obj_name_start, strlen(obj_name_start));
-        }
-    }
-
-    if (nsp_separator) {
-        nsp_separator[0] = '\0';
-        strcpy(ns_name_out, ns_name); // copy namespace
-    } else {
-        strcpy(ns_name_out, "default");
-    }
-}
-
-inline void get_clean_material_name(const char* mat_full_name, char mat_name_out[MAX_STRING_LENGTH],
-                                    CryptoNameFlag flags) {
-    safe_copy_to_buffer(mat_name_out, mat_full_name);
-    if (flags == CRYPTO_NAME_NONE)
-        return;
-
-    const bool do_strip_ns = (flags & CRYPTO_NAME_STRIP_NS) != 0;
-    const bool do_maya = (flags & CRYPTO_NAME_MAYA) != 0;
-    const bool do_paths = (flags & CRYPTO_NAME_PATHS) != 0;
-    const bool do_strip_pipes = (flags & CRYPTO_NAME_MATPATHPIPES) != 0;
-    const bool do_legacy = (flags & CRYPTO_NAME_LEGACY) != 0;
-
-    // Path Style Names /my/mat/name|root_node_name
-    if (do_paths && mat_name_out[0] == '/') {
-        char* mat_name = do_strip_pipes ? strtok(mat_name_out, "|") : nullptr;
-        mat_name = mat_name ? mat_name : mat_name_out;
-        if (do_strip_ns) {
-            char* ns_separator = strrchr(mat_name, '/');
-            if (ns_separator)
-                mat_name = ns_separator + 1;
-        }
-        if (mat_name != mat_name_out)
-            memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
-        return;
-    }
-
-    // C4DtoA prior 2.3: c4d|mat_name|root_node_name
-    if (do_legacy) {
-        if (strncmp(mat_name_out, "c4d|", 4) == 0) {
-            char* mat_name = strtok(mat_name_out + 4, "|");
-            if (mat_name)
-                memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
-            return;
-        }
-    }
-
-    // For maya, you get something simpler, like namespace:my_material_sg.
-    if (do_maya) {
-        char* ns_separator = strchr(mat_name_out, ':');
-        if (do_strip_ns && ns_separator) {
-            ns_separator[0] = '\0';
-            char* mat_name = ns_separator + 1;
-            memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
-            return;
-        }
-    }
-
-    // Softimage: Sources.Materials.myLibraryName.myMatName.Standard_Mattes.uBasic.SITOA.25000....
-    if (do_legacy) {
-        char* mat_postfix = strstr(mat_name_out, ".SItoA.");
-        if (mat_postfix) {
-            char* mat_name = mat_name_out;
-            mat_postfix[0] = '\0';
-
-            char* mat_shader_name = strrchr(mat_name, '.');
-            if (mat_shader_name)
-                mat_shader_name[0] = '\0';
-
-            char* standard_mattes = strstr(mat_name, ".Standard_Mattes");
-            if (standard_mattes)
-                standard_mattes[0] = '\0';
-
-            const char* prefix = "Sources.Materials.";
-            char* mat_prefix_separator = strstr(mat_name, prefix);
-            if (mat_prefix_separator)
-                mat_name = mat_prefix_separator + strlen(prefix);
-
-            char* nsp_separator = strchr(mat_name, '.');
-            if (do_strip_ns && nsp_separator) {
-                nsp_separator[0] = '\0';
-                mat_name = nsp_separator + 1;
-            }
-            if (mat_name != mat_name_out)
-                memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
-            return;
-        }
-    }
-}
-
-inline float hash_to_float(uint32_t hash) {
-    // if all exponent bits are 0 (subnormals, +zero, -zero) set exponent to 1
-    // if all exponent bits are 1 (NaNs, +inf, -inf) set exponent to 254
-    uint32_t exponent = hash >> 23 & 255; // extract exponent (8 bits)
-    if (exponent == 0 || exponent == 255)
-        hash ^= 1 << 23; // toggle bit
-    float f;
-    std::memcpy(&f, &hash, 4);
-    return f;
-}
 
 inline AtRGB hash_name_rgb(const char* name) {
-    // This puts the float ID into the red channel, and the human-readable
-    // versions into the G and B channels.
-    uint32_t m3hash = 0;
+    float rgb[3];
+    hash_name_rgb(name, rgb);
     AtRGB out_color;
-    MurmurHash3_x86_32(name, (uint32_t)strlen(name), 0, &m3hash);
-    out_color.r = hash_to_float(m3hash);
-    out_color.g = ((float)((m3hash << 8)) / (float)std::numeric_limits<uint32_t>::max());
-    out_color.b = ((float)((m3hash << 16)) / (float)std::numeric_limits<uint32_t>::max());
+    out_color.r = rgb[0];
+    out_color.g = rgb[1];
+    out_color.b = rgb[2];
     return out_color;
 }
 
 inline AtString get_user_data(const AtShaderGlobals* sg, const AtNode* node,
                               const AtString user_data_name, bool* cachable) {
     // returns the string if the parameter is usable, modifies cachable
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->user_data_lookups++;
     const AtUserParamEntry* pentry = AiNodeLookUpUserParameter(node, user_data_name);
     if (pentry) {
         if (AiUserParamGetType(pentry) == AI_TYPE_STRING &&
@@ -459,6 +237,8 @@ inline AtString get_user_data(const AtShaderGlobals* sg, const AtNode* node,
 inline int get_offset_user_data(const AtShaderGlobals* sg, const AtNode* node,
                                 const AtString user_data_name, bool* cachable) {
     // returns the string if the parameter is usable, modifies cachable
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->user_data_lookups++;
     const AtUserParamEntry* pentry = AiNodeLookUpUserParameter(node, user_data_name);
     if (pentry) {
         if (AiUserParamGetType(pentry) == AI_TYPE_INT &&
@@ -491,8 +271,10 @@ inline void offset_name(const AtShaderGlobals* sg, const AtNode* node, const int
 }
 
 inline bool get_object_names(const AtShaderGlobals* sg, const AtNode* node, CryptoNameFlag flags,
-                             char nsp_name_out[MAX_STRING_LENGTH],
+                             uint8_t pcloud_verbosity, char nsp_name_out[MAX_STRING_LENGTH],
                              char obj_name_out[MAX_STRING_LENGTH]) {
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->name_calls++;
     bool cachable = true;
 
     const AtString nsp_user_data = get_user_data(sg, node, CRYPTO_ASSET_UDATA, &cachable);
@@ -501,7 +283,8 @@ inline bool get_object_names(const AtShaderGlobals* sg, const AtNode* node, Cryp
     bool need_nsp_name = nsp_user_data.empty();
     bool need_obj_name = obj_user_data.empty();
     if (need_obj_name || need_nsp_name)
-        get_clean_object_name(AiNodeGetName(node), obj_name_out, nsp_name_out, flags);
+        get_clean_object_name(AiNodeGetName(node), obj_name_out, nsp_name_out, flags,
+                              pcloud_verbosity);
 
     offset_name(sg, node, get_offset_user_data(sg, node, CRYPTO_OBJECT_OFFSET_UDATA, &cachable),
                 obj_name_out);
@@ -520,6 +303,8 @@ inline bool get_object_names(const AtShaderGlobals* sg, const AtNode* node, Cryp
 
 inline bool get_material_name(const AtShaderGlobals* sg, const AtNode* node, const AtNode* shader,
                               CryptoNameFlag flags, char mat_name_out[MAX_STRING_LENGTH]) {
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->name_calls++;
     bool cachable = true;
     AtString mat_user_data = get_user_data(sg, node, CRYPTO_MATERIAL_UDATA, &cachable);
 
@@ -540,91 +325,90 @@ inline bool get_material_name(const AtShaderGlobals* sg, const AtNode* node, con
 //
 ///////////////////////////////////////////////
 
-inline void compute_metadata_ID(char id_buffer[8], AtString cryptomatte_name) {
-    AtRGB color_hash = hash_name_rgb(cryptomatte_name.c_str());
-    uint32_t float_bits;
-    std::memcpy(&float_bits, &color_hash.r, 4);
-    char hex_chars[9];
-    sprintf(hex_chars, "%08x", float_bits);
-    strncpy(id_buffer, hex_chars, 7);
-    id_buffer[7] = '\0';
-}
-
-inline void write_manifest_to_string(const ManifestMap& map, std::string& manf_string) {
-    ManifestMap::const_iterator map_it = map.begin();
-    const size_t map_entries = map.size();
-    const size_t max_entries = 100000;
-    size_t metadata_entries = map_entries;
-    if (map_entries > max_entries) {
-        AiMsgWarning("Cryptomatte: %lu entries in manifest, limiting to %lu", //
-                     map_entries, max_entries);
-        metadata_entries = max_entries;
-    }
-
-    manf_string.append("{");
-    std::string pair;
-    pair.reserve(MAX_STRING_LENGTH);
-    for (uint32_t i = 0; i < metadata_entries; i++) {
-        std::string name = map_it->first;
-        float hash_value = map_it->second;
-        ++map_it;
-
-        uint32_t float_bits;
-        std::memcpy(&float_bits, &hash_value, 4);
-        char hex_chars[9];
-        sprintf(hex_chars, "%08x", float_bits);
-
-        pair.clear();
-        pair.append("\"");
-        for (size_t j = 0; j < name.length(); j++) {
-            // append the name, char by char
-            const char c = name.at(j);
-            if (c == '"' || c == '\\' || c == '/')
-                pair += "\\";
-            pair += c;
-        }
-        pair.append("\":\"");
-        pair.append(hex_chars);
-        pair.append("\"");
-        if (i < map_entries - 1)
-            pair.append(",");
-        manf_string.append(pair);
-    }
-    manf_string.append("}");
-}
-
-inline void write_manifest_sidecar_file(const ManifestMap& map_md_asset,
+inline void write_manifest_sidecar_file(const std::string& encoded_manifest,
                                         StringVector manifest_paths) {
-    std::string encoded_manifest = "";
-    write_manifest_to_string(map_md_asset, encoded_manifest);
     for (const auto& manifest_path : manifest_paths) {
-        std::ofstream out(manifest_path.c_str());
+        if (manifest_path.empty())
+            continue;
+        std::ofstream out(manifest_path.c_str(), std::ios::out | std::ios::binary);
         AiMsgInfo("[Cryptomatte] writing file, %s", manifest_path.c_str());
-        out << encoded_manifest.c_str();
+        out.write(encoded_manifest.data(), encoded_manifest.size());
         out.close();
     }
 }
 
-inline bool check_driver(AtNode* driver) {
+inline bool is_exr_driver(const AtNode* driver) {
     return driver && AiNodeIs(driver, AtString("driver_exr"));
 }
 
+inline bool is_cryptomatte_exr_driver(const AtNode* driver) {
+    return driver && AiNodeIs(driver, AtString("cryptomatte_exr"));
+}
+
+// Drivers that can hold cryptomattes and their metadata.
+inline bool check_driver(AtNode* driver) {
+    return is_exr_driver(driver) || is_cryptomatte_exr_driver(driver);
+}
+
+inline const char* id_conversion(const AtNode* driver) {
+    // the "conversion" metadata, how IDs are stored. UINT ID channels hold the hash itself.
+    if (is_cryptomatte_exr_driver(driver) &&
+        AiNodeGetInt(driver, "channel_layout") == CRYPTO_CHANNELS_UINT_HALF)
+        return "none";
+    return "uint32_to_float32";
+}
+
+inline void get_original_filter(const std::string& filter_name, char filter_type[128],
+                                float& width) {
+    // The filter type (gaussian, box...) and width of the cryptomatte's own output, which the
+    // cryptomatte filters and the cryptomatte_exr driver use. A preview output's filter is a
+    // cryptomatte filter already. Types cryptomattes can't filter with, such as mitnet, catrom,
+    // sinc, variance or closest, become gaussian of the same width, with a warning.
+    AtNode* orig_filter = AiNodeLookUpByName(filter_name.c_str());
+    const AtNodeEntry* orig_filter_nodeEntry = AiNodeGetNodeEntry(orig_filter);
+    const char* orig_filter_type_name = AiNodeEntryGetName(orig_filter_nodeEntry);
+    if (AiNodeEntryLookUpParameter(orig_filter_nodeEntry, "width")) {
+        width = AiNodeGetFlt(orig_filter, "width");
+    }
+    if (strcmp(orig_filter_type_name, "cryptomatte_filter") == 0) {
+        const AtEnum filter_types =
+            AiParamGetEnum(AiNodeEntryLookUpParameter(orig_filter_nodeEntry, "filter"));
+        orig_filter_type_name =
+            AiEnumGetString(filter_types, AiNodeGetInt(orig_filter, "filter"));
+    }
+
+    memset(filter_type, 0, 128);
+    strncpy(filter_type, orig_filter_type_name, 127);
+    char* filter_strip_point = strstr(filter_type, "_filter");
+    if (filter_strip_point) {
+        filter_strip_point[0] = '\0';
+    }
+    if (!is_supported_filter(filter_type)) {
+        AiMsgWarning("Cryptomatte: filter %s is %s, which is not supported, using gaussian of "
+                     "the same width.",
+                     filter_name.c_str(), filter_type);
+        strcpy(filter_type, filterEnumNames[p_filter_gaussian]);
+    }
+}
+
+
 inline void write_metadata_to_driver(AtNode* driver, AtString cryptomatte_name,
-                                     const ManifestMap& map, std::string sidecar_manif_file) {
+                                     const std::string& manifest, std::string sidecar_manif_file,
+                                     const char* manif_format = nullptr,
+                                     const std::string& manifest_deflate = std::string()) {
+    // manifest is the already encoded manifest, see write_manifest_to_string, and may be empty
+    // when only manifest_deflate (see manifest_deflate.h) is written. manif_format names the
+    // format of non-JSON sidecar manifests.
+    CryptoTraceSpan span("write_metadata_to_driver");
     if (!check_driver(driver))
         return;
 
     AtArray* orig_md = AiNodeGetArray(driver, "custom_attributes");
     const uint32_t orig_num_entries = orig_md ? AiArrayGetNumElements(orig_md) : 0;
 
-    std::string metadata_hash, metadata_conv, metadata_name,
-        metadata_manf; // the new entries
-    AtArray* combined_md =
-        AiArrayAllocate(orig_num_entries + 4, 1, AI_TYPE_STRING); // Does not need destruction
-
     std::string prefix("STRING cryptomatte/");
     char metadata_id_buffer[8];
-    compute_metadata_ID(metadata_id_buffer, cryptomatte_name);
+    compute_metadata_ID(metadata_id_buffer, cryptomatte_name.c_str());
     prefix += std::string(metadata_id_buffer) + std::string("/");
 
     for (uint32_t i = 0; i < orig_num_entries; i++) {
@@ -636,23 +420,28 @@ inline void write_metadata_to_driver(AtNode* driver, AtString cryptomatte_name,
         }
     }
 
-    metadata_hash = prefix + std::string("hash MurmurHash3_32");
-    metadata_conv = prefix + std::string("conversion uint32_to_float32");
-    metadata_name = prefix + std::string("name ") + cryptomatte_name.c_str();
+    StringVector new_entries;
     if (sidecar_manif_file.length()) {
-        metadata_manf = prefix + std::string("manif_file ") + sidecar_manif_file;
+        new_entries.push_back(prefix + std::string("manif_file ") + sidecar_manif_file);
     } else {
-        metadata_manf = prefix + std::string("manifest ");
-        write_manifest_to_string(map, metadata_manf);
+        if (!manifest.empty() || manifest_deflate.empty())
+            new_entries.push_back(prefix + std::string("manifest ") + manifest);
+        if (!manifest_deflate.empty())
+            new_entries.push_back(prefix + std::string("manifest_deflate ") + manifest_deflate);
     }
-
+    new_entries.push_back(prefix + std::string("hash MurmurHash3_32"));
+    new_entries.push_back(prefix + std::string("conversion ") + id_conversion(driver));
+    new_entries.push_back(prefix + std::string("name ") + cryptomatte_name.c_str());
+    if (sidecar_manif_file.length() && manif_format)
+        new_entries.push_back(prefix + std::string("manif_format ") + manif_format);
+
+    AtArray* combined_md = AiArrayAllocate(orig_num_entries + (uint32_t)new_entries.size(), 1,
+                                           AI_TYPE_STRING); // Does not need destruction
     for (uint32_t i = 0; i < orig_num_entries; i++) {
         AiArraySetStr(combined_md, i, AiArrayGetStr(orig_md, i));
     }
-    AiArraySetStr(combined_md, orig_num_entries + 0, metadata_manf.c_str());
-    AiArraySetStr(combined_md, orig_num_entries + 1, metadata_hash.c_str());
-    AiArraySetStr(combined_md, orig_num_entries + 2, metadata_conv.c_str());
-    AiArraySetStr(combined_md, orig_num_entries + 3, metadata_name.c_str());
+    for (uint32_t i = 0; i < new_entries.size(); i++)
+        AiArraySetStr(combined_md, orig_num_entries + i, new_entries[i].c_str());
 
     AiNodeSetArray(driver, "custom_attributes", combined_md);
 }
@@ -670,14 +459,32 @@ inline void metadata_set_unneeded(AtNode* driver, const AtString aov_name) {
         AiNodeDeclare(driver, flag.c_str(), "constant BOOL");
 }
 
-inline void add_hash_to_map(const char* c_str, ManifestMap& md_map) {
-    if (cstr_empty(c_str))
+inline void remove_metadata_from_driver(AtNode* driver, AtString cryptomatte_name) {
+    // Removes the entries write_metadata_to_driver wrote for this cryptomatte, so they can be
+    // written again.
+    if (!check_driver(driver))
         return;
-    std::string name_string = std::string(c_str);
-    if (md_map.count(name_string) == 0) {
-        AtRGB hash = hash_name_rgb(c_str);
-        md_map[name_string] = hash.r;
+    AtArray* orig_md = AiNodeGetArray(driver, "custom_attributes");
+    const uint32_t orig_num_entries = orig_md ? AiArrayGetNumElements(orig_md) : 0;
+
+    std::string prefix("STRING cryptomatte/");
+    char metadata_id_buffer[8];
+    compute_metadata_ID(metadata_id_buffer, cryptomatte_name.c_str());
+    prefix += std::string(metadata_id_buffer) + std::string("/");
+
+    std::vector<AtString> kept;
+    for (uint32_t i = 0; i < orig_num_entries; i++) {
+        const AtString entry = AiArrayGetStr(orig_md, i);
+        if (strncmp(entry.c_str(), prefix.c_str(), prefix.length()) != 0)
+            kept.push_back(entry);
     }
+    if (kept.size() == orig_num_entries)
+        return;
+
+    AtArray* kept_md = AiArrayAllocate((uint32_t)kept.size(), 1, AI_TYPE_STRING);
+    for (uint32_t i = 0; i < kept.size(); i++)
+        AiArraySetStr(kept_md, i, kept[i]);
+    AiNodeSetArray(driver, "custom_attributes", kept_md);
 }
 
 inline AtString add_override_udata_to_manifest(const AtNode* node, const AtString override_udata,
@@ -745,14 +552,23 @@ inline void add_obj_to_manifest(const AtNode* node, char name[MAX_STRING_LENGTH]
 //
 ///////////////////////////////////////////////
 
-inline void write_array_of_AOVs(AtShaderGlobals* sg, const AtArray* names, float id) {
-    for (uint32_t i = 0; i < AiArrayGetNumElements(names); i++) {
-        AtString aovName = AiArrayGetStr(names, i);
-        if (aovName.empty())
-            return;
-        AiAOVSetFlt(sg, aovName, id);
-    }
-}
+// Which cryptomatte layer, manifest or piece of pending metadata something is about. User
+// cryptomattes are CRYPTO_MANIFEST_USER + their index.
+enum CryptoManifestSource {
+    CRYPTO_MANIFEST_ASSET = 0,
+    CRYPTO_MANIFEST_OBJECT,
+    CRYPTO_MANIFEST_MATERIAL,
+    CRYPTO_MANIFEST_USER,
+};
+
+struct CryptoLayer {
+    // One cryptomatte as sampled, packed by setup. Every rank filter of the cryptomatte reads
+    // its one ID AOV.
+    AtString id_aov;
+    AtString user_data; // source of user cryptomattes
+    uint16_t index;     // CryptoManifestSource, the cache slot of standard cryptomattes
+    uint8_t level;      // of hierarchy cryptomattes, 0 for others
+};
 
 ///////////////////////////////////////////////
 //
@@ -760,24 +576,155 @@ inline void write_array_of_AOVs(AtShaderGlobals* sg, const AtArray* names, float
 //
 ///////////////////////////////////////////////
 
-// clang-format off
-#define CACHE_LINE 64
-#if defined(_WIN32) || defined(_MSC_VER)
-#define CACHE_ALIGN __declspec(align(CACHE_LINE))
-#else
-#define CACHE_ALIGN __attribute__((aligned(CACHE_LINE)))
-#endif
-// clang-format on
-
 struct CACHE_ALIGN CryptomatteCache {
     AtNode* object = nullptr;
-    AtRGB nsp_hash_clr = AI_RGB_BLACK;
-    AtRGB obj_hash_clr = AI_RGB_BLACK;
     AtNode* shader_object = nullptr;
-    AtRGB mat_hash_clr = AI_RGB_BLACK;
+    AtNode* user_object = nullptr;
+    uint32_t object_generation = 0;
+    uint32_t shader_generation = 0;
+    uint32_t user_generation = 0;
+    float ids[CRYPTO_MANIFEST_USER] = {0.0f, 0.0f, 0.0f}; // by CryptoManifestSource
+};
+
+class ThreadCaches {
+    // One CryptomatteCache per render thread, each followed by the IDs of the user cryptomattes
+    // and padded to whole cache lines. Allocated by hand, as new only aligns to
+    // alignof(max_align_t) before C++17.
+public:
+    ThreadCaches() {}
+    ~ThreadCaches() { resize(0, 0); }
+
+    // Not thread safe, only to be called between renders.
+    void resize(size_t new_count, size_t new_user_slots) {
+        if (new_count == count && new_user_slots == user_slots)
+            return;
+        free(buffer);
+        buffer = nullptr;
+        blocks = nullptr;
+        count = 0;
+        user_slots = 0;
+        if (!new_count)
+            return;
+        const size_t size = sizeof(CryptomatteCache) + new_user_slots * sizeof(float);
+        const size_t new_block_size = (size + CACHE_LINE - 1) & ~size_t(CACHE_LINE - 1);
+        buffer = malloc(new_count * new_block_size + CACHE_LINE);
+        if (!buffer)
+            return;
+        const uintptr_t aligned = (reinterpret_cast<uintptr_t>(buffer) + CACHE_LINE - 1) &
+                                  ~uintptr_t(CACHE_LINE - 1);
+        blocks = reinterpret_cast<char*>(aligned);
+        block_size = new_block_size;
+        count = new_count;
+        user_slots = new_user_slots;
+        for (size_t i = 0; i < count; i++) {
+            new (get((uint16_t)i)) CryptomatteCache();
+            reset_user_ids((uint16_t)i);
+        }
+    }
+
+    size_t size() const { return count; }
+    size_t user_size() const { return user_slots; }
+
+    // Threads beyond those of the session get no cache.
+    CryptomatteCache* get(uint16_t tid) {
+        return tid < count ? reinterpret_cast<CryptomatteCache*>(blocks + tid * block_size)
+                           : nullptr;
+    }
+
+    // IDs of the user cryptomattes on the thread's user_object, NaN where not cached.
+    float* user_ids(uint16_t tid) { return reinterpret_cast<float*>(get(tid) + 1); }
+
+    void reset_user_ids(uint16_t tid) {
+        float* ids = user_ids(tid);
+        for (size_t i = 0; i < user_slots; i++)
+            ids[i] = std::numeric_limits<float>::quiet_NaN();
+    }
+
+private:
+    ThreadCaches(const ThreadCaches&);
+    ThreadCaches& operator=(const ThreadCaches&);
+
+    void* buffer = nullptr;
+    char* blocks = nullptr;
+    size_t block_size = 0;
+    size_t count = 0;
+    size_t user_slots = 0;
+};
+
+inline size_t session_thread_count() {
+    // options.threads is the thread count, or when not positive, the number of cores plus it
+    const int cores = (int)std::max(std::thread::hardware_concurrency(), 1u);
+    int threads = AiNodeGetInt(AiUniverseGetOptions(), "threads");
+    if (threads <= 0)
+        threads = cores + threads;
+    return (size_t)std::min(std::max(threads, 1), AI_MAX_THREADS);
+}
+
+///////////////////////////////////////////////
+//
+//      Observed IDs, for hit-only manifests
+//
+///////////////////////////////////////////////
+
+struct IdSet {
+    // Open addressing set of the bits of float IDs. Zero bits are never a valid ID (see
+    // hash_to_float), so zero marks empty slots and unhashed (black) values are ignored.
+    std::vector<uint32_t> slots;
+    size_t count = 0;
+
+    void insert(float id) {
+        uint32_t bits;
+        std::memcpy(&bits, &id, 4);
+        insert_bits(bits);
+    }
+
+    void insert_bits(uint32_t bits) {
+        if (bits == 0)
+            return;
+        if ((count + 1) * 2 > slots.size())
+            grow();
+        // IDs are hashes already, so the low bits index directly
+        const size_t mask = slots.size() - 1;
+        size_t i = bits & mask;
+        while (slots[i]) {
+            if (slots[i] == bits)
+                return;
+            i = (i + 1) & mask;
+        }
+        slots[i] = bits;
+        count++;
+    }
+
+    bool contains(uint32_t bits) const {
+        if (bits == 0 || slots.empty())
+            return false;
+        const size_t mask = slots.size() - 1;
+        size_t i = bits & mask;
+        while (slots[i]) {
+            if (slots[i] == bits)
+                return true;
+            i = (i + 1) & mask;
+        }
+        return false;
+    }
+
+    void merge(const IdSet& other) {
+        for (const uint32_t bits : other.slots)
+            insert_bits(bits);
+    }
+
+    void grow() {
+        std::vector<uint32_t> old_slots(std::max(slots.size() * 2, (size_t)64), 0);
+        old_slots.swap(slots);
+        count = 0;
+        for (const uint32_t bits : old_slots)
+            insert_bits(bits);
+    }
 };
 
-extern CryptomatteCache CRYPTOMATTE_CACHE[AI_MAX_THREADS];
+// One per thread, so recording IDs needs no locking. Sets are indexed by CryptoManifestSource,
+// followed by the user cryptomattes.
+using ObservedIds = std::vector<IdSet>;
 
 ///////////////////////////////////////////////
 //
@@ -785,11 +732,15 @@ extern CryptomatteCache CRYPTOMATTE_CACHE[AI_MAX_THREADS];
 //
 ///////////////////////////////////////////////
 
+// User cryptomattes, from user data sources, followed by the levels of the hierarchy
+// cryptomatte, which have no source. Both are CRYPTO_MANIFEST_USER + their index.
 struct UserCryptomattes {
     size_t count = 0;
-    std::vector<AtArray*> aov_arrays;
     std::vector<AtString> aovs;
     std::vector<AtString> sources;
+    std::vector<uint8_t> levels; // hierarchy level, 0 for user data cryptomattes
+    size_t first_level = 0;      // index of level 1
+    uint8_t num_levels = 0;
 
     UserCryptomattes() {}
 
@@ -808,43 +759,191 @@ struct UserCryptomattes {
                           aov.c_str(), src.c_str());
                 aovs.push_back(aov);
                 sources.push_back(src);
+                levels.push_back(0);
             }
         }
-        aov_arrays.resize(aovs.size());
-        for (auto& aov_array : aov_arrays)
-            aov_array = nullptr;
+        count = aovs.size();
+    }
 
+    void add_hierarchy(AtString aov, uint8_t hierarchy_levels) {
+        // One cryptomatte per level, <aov>_level1 being the top of the hierarchy.
+        first_level = count;
+        num_levels = aov.empty() ? 0 : std::min(hierarchy_levels, (uint8_t)MAX_HIERARCHY_LEVELS);
+        for (uint8_t level = 1; level <= num_levels; level++) {
+            const std::string level_aov = std::string(aov.c_str()) + "_level" +
+                                          std::to_string(level);
+            AiMsgInfo("Adding hierarchy Cryptomatte %lu: AOV: %s Level: %u", aovs.size(),
+                      level_aov.c_str(), level);
+            aovs.push_back(AtString(level_aov.c_str()));
+            sources.push_back(AtString());
+            levels.push_back(level);
+        }
         count = aovs.size();
     }
+};
+
+// Metadata for one cryptomatte, waiting to be written to its drivers.
+struct PendingMetadata {
+    AtString aov_name;
+    CryptoManifestSource source;
+    size_t user_index = 0;
+    std::vector<AtNode*> drivers;
+    StringVector manif_files; // per driver, sidecar file name or empty for embedded
+    std::string manifest;     // encoded manifest, empty until compiled
+    std::string manifest_deflate; // compressed manifest, when compressing
+};
+
+// Manifests kept between compiles, so that interactive updates only process the shapes whose
+// manifest inputs changed. Remembers the names each shape added to each layer (indexed by
+// CryptoManifestSource, then user cryptomattes), and how many shapes added each name. Setup
+// compiles from it, so do sidecar writes at render end, and the manifest driver's open, which
+// rewrites embedded manifests when shapes changed without a setup.
+struct ManifestStore {
+    struct Contribution {
+        uint64_t signature = 0; // of the shape's manifest inputs
+        uint32_t generation = 0;
+        std::vector<StringVector> names;
+    };
+
+    struct Layer {
+        bool tracked = false;
+        ManifestMap map;
+        std::unordered_map<std::string, uint32_t> refs;
+    };
+
+    std::unordered_map<const AtNode*, Contribution> nodes;
+    std::vector<Layer> layers;
+    uint64_t options_signature = 0;
+    uint32_t generation = 0;
+
+    void clear(size_t num_layers) {
+        nodes.clear();
+        layers = std::vector<Layer>(num_layers);
+    }
+
+    void add(Contribution& contribution, size_t layer, const ManifestMap& names) {
+        for (const auto& name_hash : names) {
+            contribution.names[layer].push_back(name_hash.first);
+            if (layers[layer].refs[name_hash.first]++ == 0)
+                layers[layer].map.insert(name_hash);
+        }
+    }
 
-    ~UserCryptomattes() {
-        for (auto& aov_array : aov_arrays) {
-            AiArrayDestroy(aov_array);
+    void remove(Contribution& contribution) {
+        for (size_t layer = 0; layer < contribution.names.size(); layer++) {
+            for (const auto& name : contribution.names[layer]) {
+                auto ref = layers[layer].refs.find(name);
+                if (ref != layers[layer].refs.end() && --ref->second == 0) {
+                    layers[layer].refs.erase(ref);
+                    layers[layer].map.erase(name);
+                }
+            }
+            contribution.names[layer].clear();
         }
     }
 };
 
+// What setup_all's outputs and metadata depend on, besides the options' outputs. Compared between
+// updates, so that IPR updates that change none of it do no work.
+struct CryptoSetupConfig {
+    AtString aovs[CRYPTO_MANIFEST_USER];
+    std::vector<AtString> user_aovs;
+    std::vector<AtString> user_sources;
+    AtString hierarchy_aov;
+    uint8_t hierarchy_levels = 0;
+    uint8_t depth = 0;
+    bool exr_preview_channels = false;
+    int channel_layout = 0;
+    bool sidecar_manifests = false;
+    bool async_manifests = false;
+    // only change the metadata
+    CryptoNameFlag obj_flags = 0;
+    CryptoNameFlag mat_flags = 0;
+    uint8_t pcloud_ice_verbosity = 0;
+    bool hit_only_manifests = false;
+    int manifest_format = 0;
+    int manifest_compression = 0;
+    std::string manifest_cache;
+    // of the drivers of the previous setup, which sidecar manifest paths are made from
+    std::vector<AtString> driver_filenames;
+
+    bool same_outputs(const CryptoSetupConfig& other) const {
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            if (aovs[i] != other.aovs[i])
+                return false;
+        // sidecar and async modes change what the manifest driver does with the metadata
+        return user_aovs == other.user_aovs && user_sources == other.user_sources &&
+               hierarchy_aov == other.hierarchy_aov &&
+               hierarchy_levels == other.hierarchy_levels && depth == other.depth &&
+               exr_preview_channels == other.exr_preview_channels &&
+               channel_layout == other.channel_layout &&
+               sidecar_manifests == other.sidecar_manifests &&
+               async_manifests == other.async_manifests;
+    }
+
+    bool same_metadata(const CryptoSetupConfig& other) const {
+        return obj_flags == other.obj_flags && mat_flags == other.mat_flags &&
+               pcloud_ice_verbosity == other.pcloud_ice_verbosity &&
+               hit_only_manifests == other.hit_only_manifests &&
+               manifest_format == other.manifest_format &&
+               manifest_compression == other.manifest_compression &&
+               manifest_cache == other.manifest_cache && driver_filenames == other.driver_filenames;
+    }
+};
+
+class CryptoSetupLock {
+    // Held while creating nodes, rewriting options.outputs and writing driver metadata. Shared
+    // by all cryptomatte shaders rather than one per shader, as they all edit the same universe:
+    // two shaders setting up at once would each rewrite options.outputs from what the other is
+    // changing, and write the same drivers' custom_attributes.
+public:
+    CryptoSetupLock() : guard(mutex()) {}
+
+private:
+    // A std::mutex, not an AtCritSec, as the static is destroyed at exit, after Arnold may
+    // have shut down.
+    static std::mutex& mutex() {
+        static std::mutex setup_mutex;
+        return setup_mutex;
+    }
+
+    std::lock_guard<std::mutex> guard;
+};
+
 struct CryptomatteData {
-    // Accessed during sampling, so hopefully in first cache line.
+    // Accessed during sampling, so hopefully in first cache line. The output cryptomattes, and
+    // whether any of them hashes object or material names.
+    std::vector<CryptoLayer> sample_layers;
+    bool sample_objects = false;
+    bool sample_materials = false;
+    bool sample_user_data = false;
+    bool sample_hierarchy = false;
+
     AtString aov_cryptoasset;
     AtString aov_cryptoobject;
     AtString aov_cryptomaterial;
-
-    AtArray* aov_array_cryptoasset = nullptr;
-    AtArray* aov_array_cryptoobject = nullptr;
-    AtArray* aov_array_cryptomaterial = nullptr;
     UserCryptomattes user_cryptomattes;
 
-    bool do_preview_channels = true;
-
     // User options.
     uint8_t option_depth;
     uint8_t option_aov_depth;
     bool option_exr_preview_channels;
+    int option_channel_layout;
     CryptoNameFlag option_obj_flags;
     CryptoNameFlag option_mat_flags;
     uint8_t option_pcloud_ice_verbosity;
+    AtString option_hierarchy_aov;
+    uint8_t option_hierarchy_levels;
     bool option_sidecar_manifests;
+    bool option_async_manifests;
+    bool option_hit_only_manifests;
+    int option_manifest_format;
+    int option_manifest_compression;
+    std::string option_manifest_cache;
+    bool option_performance_stats;
+    bool option_performance_stats_json;
+    bool option_performance_trace;
+    std::string option_performance_trace_path; // from CRYPTOMATTE_TRACE, else next to the image
 
     // Vector of paths for each of the cryptomattes. Vector because each
     // cryptomatte can write to multiple drivers (stereo, multi-camera)
@@ -854,35 +953,180 @@ struct CryptomatteData {
     // Nested vector of paths for each user cryptomatte.
     std::vector<StringVector> manifs_user_paths;
 
+    // Metadata queued by setup, and the thread compiling its manifests in
+    // async mode.
+    std::vector<PendingMetadata> pending_metadata;
+    void* metadata_thread = nullptr;
+    // From setup until the manifest driver opens. Renders without a setup before them, such as
+    // IPR updates of shapes only, have their embedded manifests refreshed on open instead.
+    bool metadata_from_setup = false;
+
+    // Per thread IDs written during the render, empty unless hit-only manifests are on.
+    std::vector<ObservedIds> observed_ids;
+
+    // The previous setup, for incremental updates. The outputs are as setup left them, and the
+    // drivers are those of each cryptomatte, standard ones indexed by CryptoManifestSource.
+    bool has_setup = false;
+    CryptoSetupConfig setup_config;
+    std::vector<AtString> setup_outputs;
+    std::vector<AtNode*> setup_drivers[CRYPTO_MANIFEST_USER];
+    std::vector<std::vector<AtNode*>> setup_user_drivers;
+
+    ManifestStore manifest_store;
+    // Set when the last manifests were read from the cache, bypassing manifest_store, so a
+    // refresh compares fingerprints rather than rebuilding the store from every shape.
+    bool manifests_from_cache = false;
+    ManifestFingerprint cached_fingerprint;
+
+    // Name caches of this shader, sized to the session's threads by setup. Entries from other
+    // generations are misses, bumping the generation is safe while rendering, unlike clearing.
+    ThreadCaches thread_caches;
+    std::atomic<uint32_t> cache_generation;
+
 public:
-    CryptomatteData() {
+    CryptomatteData()
+        : option_performance_stats(false), option_performance_trace(false), cache_generation(1) {
         set_option_channels(CRYPTO_DEPTH_DEFAULT, CRYPTO_PREVIEWINEXR_DEFAULT);
         set_option_namespace_stripping(CRYPTO_NAME_ALL, CRYPTO_NAME_ALL);
         set_option_ice_pcloud_verbosity(CRYPTO_ICEPCLOUDVERB_DEFAULT);
-        AiCritSecInit(&g_critsec);
+        set_option_hierarchy(AtString(), CRYPTO_HIERARCHYLEVELS_DEFAULT);
+        set_option_sidecar_manifests(CRYPTO_SIDECARMANIFESTS_DEFAULT);
+        set_option_async_manifests(CRYPTO_ASYNCMANIFESTS_DEFAULT);
+        set_option_manifest_cache("");
+        set_option_hit_only_manifests(CRYPTO_HITONLYMANIFESTS_DEFAULT);
+        set_option_manifest_format(CRYPTO_MANIFESTFORMAT_DEFAULT);
+        set_option_manifest_compression(CRYPTO_MANIFESTCOMPRESSION_DEFAULT);
+        set_option_channel_layout(CRYPTO_CHANNELLAYOUT_DEFAULT);
+        set_option_performance_stats(CRYPTO_PERFORMANCESTATS_DEFAULT, false);
+        set_option_performance_trace(CRYPTO_PERFORMANCETRACE_DEFAULT);
     }
 
     void setup_all(const AtString aov_cryptoasset_, const AtString aov_cryptoobject_,
                    const AtString aov_cryptomaterial_, AtArray* uc_aov_array,
                    AtArray* uc_src_array) {
+        // Compares against the previous setup, and only redoes what changed. Updates that
+        // change nothing, common in IPR sessions, return straight away.
+        CryptoStatsTimer timer(CRYPTO_STATS_SETUP);
+        CryptoTraceSpan span("setup_all");
+        thread_caches.resize(session_thread_count(), thread_caches.user_size());
+        const CryptoSetupConfig config = current_setup_config(
+            aov_cryptoasset_, aov_cryptoobject_, aov_cryptomaterial_, uc_aov_array, uc_src_array);
+        const bool same_outputs =
+            has_setup && config.same_outputs(setup_config) && outputs_unchanged_since_setup();
+        if (same_outputs && config.same_metadata(setup_config))
+            return;
+
+        // a previous update may still be compiling manifests
+        wait_for_metadata();
+        setup_config = config;
+
+        // cached names may be out of date with the naming options
+        invalidate_caches();
+
+        if (same_outputs) {
+            // filters and outputs are still in place, only the manifests differ
+            reset_observed_ids();
+            CryptoSetupLock lock;
+            build_standard_metadata(setup_drivers[CRYPTO_MANIFEST_ASSET],
+                                    setup_drivers[CRYPTO_MANIFEST_OBJECT],
+                                    setup_drivers[CRYPTO_MANIFEST_MATERIAL], true);
+            build_user_metadata(setup_user_drivers, true);
+            start_metadata();
+            return;
+        }
+
         aov_cryptoasset = aov_cryptoasset_;
         aov_cryptoobject = aov_cryptoobject_;
         aov_cryptomaterial = aov_cryptomaterial_;
 
-        destroy_arrays();
+        clear_sample_layers();
 
         user_cryptomattes = UserCryptomattes(uc_aov_array, uc_src_array);
+        user_cryptomattes.add_hierarchy(option_hierarchy_aov, option_hierarchy_levels);
+        thread_caches.resize(thread_caches.size(), user_cryptomattes.count);
+        reset_observed_ids();
+
+        {
+            CryptoSetupLock lock;
+            setup_cryptomatte_nodes(has_setup);
+        }
+
+        const AtArray* outputs = AiNodeGetArray(AiUniverseGetOptions(), "outputs");
+        setup_outputs.resize(outputs ? AiArrayGetNumElements(outputs) : 0);
+        for (uint32_t i = 0; i < setup_outputs.size(); i++)
+            setup_outputs[i] = AiArrayGetStr(outputs, i);
+        // the config had the previous setup's drivers
+        setup_config.driver_filenames = setup_driver_filenames();
+        has_setup = true;
+    }
+
+    CryptoSetupConfig current_setup_config(AtString aov_asset, AtString aov_object,
+                                           AtString aov_material, const AtArray* uc_aov_array,
+                                           const AtArray* uc_src_array) const {
+        CryptoSetupConfig config;
+        config.aovs[CRYPTO_MANIFEST_ASSET] = aov_asset;
+        config.aovs[CRYPTO_MANIFEST_OBJECT] = aov_object;
+        config.aovs[CRYPTO_MANIFEST_MATERIAL] = aov_material;
+        const uint32_t num_user = uc_aov_array && uc_src_array
+                                      ? std::min(AiArrayGetNumElements(uc_aov_array),
+                                                 AiArrayGetNumElements(uc_src_array))
+                                      : 0;
+        for (uint32_t i = 0; i < num_user; i++) {
+            config.user_aovs.push_back(AiArrayGetStr(uc_aov_array, i));
+            config.user_sources.push_back(AiArrayGetStr(uc_src_array, i));
+        }
+        config.hierarchy_aov = option_hierarchy_aov;
+        config.hierarchy_levels = option_hierarchy_levels;
+        config.depth = option_depth;
+        config.exr_preview_channels = option_exr_preview_channels;
+        config.channel_layout = option_channel_layout;
+        config.sidecar_manifests = option_sidecar_manifests;
+        config.async_manifests = option_async_manifests;
+        config.obj_flags = option_obj_flags;
+        config.mat_flags = option_mat_flags;
+        config.pcloud_ice_verbosity = option_pcloud_ice_verbosity;
+        config.hit_only_manifests = option_hit_only_manifests;
+        config.manifest_format = option_manifest_format;
+        config.manifest_compression = option_manifest_compression;
+        config.manifest_cache = option_manifest_cache;
+        config.driver_filenames = setup_driver_filenames();
+        return config;
+    }
 
-        AiCritSecEnter(&g_critsec);
-        setup_cryptomatte_nodes();
-        AiCritSecLeave(&g_critsec);
+    std::vector<AtString> setup_driver_filenames() const {
+        // IPR sessions can rename the images without changing the outputs
+        static const AtString filename("filename");
+        std::vector<AtString> filenames;
+        std::vector<const std::vector<AtNode*>*> driver_lists;
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            driver_lists.push_back(&setup_drivers[i]);
+        for (const auto& user_drivers : setup_user_drivers)
+            driver_lists.push_back(&user_drivers);
+        for (const auto* drivers : driver_lists)
+            for (const AtNode* driver : *drivers)
+                filenames.push_back(
+                    driver && AiNodeEntryLookUpParameter(AiNodeGetNodeEntry(driver), filename)
+                        ? AiNodeGetStr(driver, filename)
+                        : AtString());
+        return filenames;
+    }
+
+    bool outputs_unchanged_since_setup() const {
+        // AtStrings are unique, so comparing them is comparing pointers
+        const AtArray* outputs = AiNodeGetArray(AiUniverseGetOptions(), "outputs");
+        const uint32_t num_outputs = outputs ? AiArrayGetNumElements(outputs) : 0;
+        if (num_outputs != setup_outputs.size())
+            return false;
+        for (uint32_t i = 0; i < num_outputs; i++)
+            if (AiArrayGetStr(outputs, i) != setup_outputs[i])
+                return false;
+        return true;
     }
 
     void set_option_channels(int depth, bool exr_preview_channels) {
         depth = std::min(std::max(depth, 1), MAX_CRYPTOMATTE_DEPTH);
         option_depth = depth;
         option_exr_preview_channels = exr_preview_channels;
-        do_preview_channels = true;
         if (option_depth % 2 == 0)
             option_aov_depth = option_depth / 2;
         else
@@ -897,109 +1141,312 @@ public:
     void set_option_ice_pcloud_verbosity(int verbosity) {
         verbosity = std::min(std::max(verbosity, 0), 2);
         option_pcloud_ice_verbosity = verbosity;
-        g_pointcloud_instance_verbosity = option_pcloud_ice_verbosity; // to do: really remove this
+    }
+
+    void set_option_hierarchy(AtString aov, int levels) {
+        option_hierarchy_aov = aov;
+        option_hierarchy_levels = (uint8_t)std::min(std::max(levels, 0), MAX_HIERARCHY_LEVELS);
     }
 
     void set_option_sidecar_manifests(bool sidecar) { option_sidecar_manifests = sidecar; }
 
+    void set_option_async_manifests(bool async) { option_async_manifests = async; }
+
+    void set_option_hit_only_manifests(bool hit_only) { option_hit_only_manifests = hit_only; }
+
+    void set_option_manifest_format(int format) { option_manifest_format = format; }
+
+    void set_option_manifest_compression(int compression) {
+        option_manifest_compression = compression;
+    }
+
+    void set_option_channel_layout(int layout) { option_channel_layout = layout; }
+
+    void set_option_manifest_cache(const char* directory) {
+        option_manifest_cache = directory ? directory : "";
+    }
+
+    void set_option_performance_stats(bool stats, bool json) {
+        // stats and traces are process wide, on while any shader has them on
+        if (stats && !option_performance_stats)
+            CryptoStats::get().enable();
+        else if (!stats && option_performance_stats)
+            CryptoStats::get().disable();
+        option_performance_stats = stats;
+        option_performance_stats_json = stats && json;
+    }
+
+    void set_option_performance_trace(bool trace) {
+        // CRYPTOMATTE_TRACE turns tracing on regardless, and names the trace file
+        const char* trace_path = getenv("CRYPTOMATTE_TRACE");
+        option_performance_trace_path = trace_path ? trace_path : "";
+        trace = trace || !option_performance_trace_path.empty();
+        if (trace && !option_performance_trace)
+            CryptoTrace::get().enable();
+        else if (!trace && option_performance_trace)
+            CryptoTrace::get().disable();
+        option_performance_trace = trace;
+    }
+
     void do_cryptomattes(AtShaderGlobals* sg) {
-        if (sg->Rt & AI_RAY_CAMERA && sg->sc == AI_CONTEXT_SURFACE) {
-            do_standard_cryptomattes(sg);
-            do_user_cryptomattes(sg);
+        if (sample_layers.empty() || !(sg->Rt & AI_RAY_CAMERA && sg->sc == AI_CONTEXT_SURFACE))
+            return;
+
+        const uint32_t generation = cache_generation.load(std::memory_order_relaxed);
+        CryptomatteCache* cache = thread_caches.get(sg->tid);
+        float ids[CRYPTO_MANIFEST_USER] = {0.0f, 0.0f, 0.0f};
+        if (sample_objects)
+            hash_object_names(sg, cache, generation, ids);
+        if (sample_materials)
+            hash_material_name(sg, cache, generation, ids);
+
+        float* user_ids = nullptr;
+        if (cache && (sample_user_data || sample_hierarchy)) {
+            user_ids = thread_caches.user_ids(sg->tid);
+            if (cache->user_object != sg->Op || cache->user_generation != generation) {
+                cache->user_object = sg->Op;
+                cache->user_generation = generation;
+                thread_caches.reset_user_ids(sg->tid);
+            }
+        }
+
+        float uncached_level_ids[MAX_HIERARCHY_LEVELS];
+        const float* level_ids = nullptr;
+        if (sample_hierarchy)
+            level_ids = hash_hierarchy_levels(sg, user_ids, uncached_level_ids);
+
+        for (const CryptoLayer& layer : sample_layers) {
+            float id;
+            if (layer.index < CRYPTO_MANIFEST_USER)
+                id = ids[layer.index];
+            else if (layer.level)
+                id = level_ids[layer.level - 1];
+            else if (user_ids && !std::isnan(user_ids[layer.index - CRYPTO_MANIFEST_USER]))
+                id = cached_user_id(user_ids[layer.index - CRYPTO_MANIFEST_USER]);
+            else
+                id = hash_user_data(sg, layer, user_ids);
+            AiAOVSetFlt(sg, layer.id_aov, id);
         }
     }
 
     void write_sidecar_manifests() {
+        CryptoStatsTimer timer(CRYPTO_STATS_SIDECAR_WRITE);
+        CryptoTraceSpan span("write_sidecar_manifests");
         write_standard_sidecar_manifests();
         write_user_sidecar_manifests();
     }
 
-private:
-    void do_standard_cryptomattes(AtShaderGlobals* sg) {
-        if (!aov_array_cryptoasset && !aov_array_cryptoobject && !aov_array_cryptomaterial)
+    void close_metadata() {
+        // From the manifest driver's driver_close, at render end. Stats and the trace are process
+        // wide and emptied once reported, so only the last manifest driver of the render to close
+        // reports them, after every shader's sidecar manifests.
+        write_sidecar_manifests();
+        if (!close_manifest_driver())
             return;
+        report_stats();
+        write_trace();
+    }
 
-        AtRGB nsp_hash_clr, obj_hash_clr, mat_hash_clr;
-        hash_object_rgb(sg, nsp_hash_clr, obj_hash_clr, mat_hash_clr);
+    void wait_for_metadata() {
+        // Joins the manifest thread (if any), and writes queued metadata to the drivers.
+        // Must happen before the drivers open, as they read their metadata then, so the manifest
+        // driver calls this from its driver_open. Background manifests therefore only overlap
+        // the scene preparation between setup and the drivers opening, not the render: time to
+        // first pixel drops by the compile time at most, less the wait logged here.
+        if (metadata_thread) {
+            CryptoTraceSpan span("wait_for_metadata");
+            const auto wait_start = std::chrono::steady_clock::now();
+            join_metadata_thread();
+            const std::chrono::duration<double> waited =
+                std::chrono::steady_clock::now() - wait_start;
+            AiMsgInfo("Cryptomatte: waited %.3f s for background manifests", waited.count());
+        }
+        CryptoSetupLock lock;
+        write_pending_metadata();
+    }
 
-        if (aov_array_cryptoasset)
-            write_array_of_AOVs(sg, aov_array_cryptoasset, nsp_hash_clr.r);
-        if (aov_array_cryptoobject)
-            write_array_of_AOVs(sg, aov_array_cryptoobject, obj_hash_clr.r);
-        if (aov_array_cryptomaterial)
-            write_array_of_AOVs(sg, aov_array_cryptomaterial, mat_hash_clr.r);
+    void open_metadata() {
+        // From the manifest driver's driver_open, which is before the other drivers open and
+        // read their metadata. After setup, that waits for its metadata. Renders without a setup
+        // don't call node_update, so shapes added, renamed or removed since are found here.
+        open_manifest_drivers()++;
+        wait_for_metadata();
+        if (metadata_from_setup) {
+            metadata_from_setup = false;
+            return;
+        }
+        if (!observed_ids.empty()) {
+            // hit-only manifests are of this render's IDs only, which are recorded on misses
+            reset_observed_ids();
+            invalidate_caches();
+        }
+        refresh_embedded_metadata();
+    }
 
-        if (do_preview_channels) {
-            nsp_hash_clr.r = obj_hash_clr.r = mat_hash_clr.r = 0.0f;
+private:
+    void invalidate_caches() { cache_generation++; }
+
+    // Manifest drivers opened and not closed yet in the current render, of every shader.
+    static std::atomic<int>& open_manifest_drivers() {
+        static std::atomic<int> count(0);
+        return count;
+    }
 
-            AiAOVSetRGBA(sg, aov_cryptoasset, nsp_hash_clr);
-            AiAOVSetRGBA(sg, aov_cryptoobject, obj_hash_clr);
-            AiAOVSetRGBA(sg, aov_cryptomaterial, mat_hash_clr);
+    static bool close_manifest_driver() {
+        // True for the last manifest driver of the render to close. Closes without an open,
+        // from aborted renders, don't count.
+        std::atomic<int>& count = open_manifest_drivers();
+        int open = count.load();
+        while (open > 0 && !count.compare_exchange_weak(open, open - 1))
+            ;
+        return open <= 1;
+    }
+
+    void report_stats() const {
+        // Once per render, from close_metadata. Also when only another shader has stats on,
+        // then to the log only.
+        if (CryptoStats::get().enabled())
+            CryptoStats::get().report(option_performance_stats_json
+                                          ? image_sidecar_path(".cryptomatte_stats.json")
+                                          : "");
+    }
+
+    void write_trace() const {
+        // Once per render, from close_metadata, after the sidecar manifests.
+        if (CryptoTrace::get().enabled())
+            CryptoTrace::get().write(option_performance_trace_path.empty()
+                                         ? image_sidecar_path(".cryptomatte_trace.json")
+                                         : option_performance_trace_path);
+    }
+
+    std::string image_sidecar_path(const char* suffix) const {
+        // <image><suffix>, next to the first cryptomatte's image
+        std::vector<const AtNode*> drivers;
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            drivers.insert(drivers.end(), setup_drivers[i].begin(), setup_drivers[i].end());
+        for (const auto& user_drivers : setup_user_drivers)
+            drivers.insert(drivers.end(), user_drivers.begin(), user_drivers.end());
+        for (const AtNode* driver : drivers) {
+            if (!driver || !AiNodeEntryLookUpParameter(AiNodeGetNodeEntry(driver), "filename"))
+                continue;
+            std::string path = AiNodeGetStr(driver, "filename").c_str();
+            const size_t dot = path.rfind('.');
+            if (dot != std::string::npos && path.find_first_of("/\\", dot) == std::string::npos)
+                path.erase(dot);
+            return path + suffix;
         }
+        return std::string("cryptomatte") + suffix;
+    }
+
+    void observe_id(uint16_t tid, size_t layer, float id) {
+        if (!observed_ids.empty())
+            observed_ids[tid][layer].insert(id);
     }
 
-    void do_user_cryptomattes(AtShaderGlobals* sg) {
-        for (uint32_t i = 0; i < user_cryptomattes.count; i++) {
-            AtArray* aovArray = user_cryptomattes.aov_arrays[i];
-            if (aovArray) {
-                AtString aov_name = user_cryptomattes.aovs[i];
-                AtString src_data_name = user_cryptomattes.sources[i];
-                AtRGB hash = AI_RGB_BLACK;
-                AtString result;
+    static float cached_user_id(float id) {
+        if (CryptoThreadStats* stats = crypto_thread_stats())
+            stats->cache_hits++;
+        return id;
+    }
 
-                AiUDataGetStr(src_data_name, result);
-                if (!result.empty())
-                    hash = hash_name_rgb(result.c_str());
+    float hash_user_data(AtShaderGlobals* sg, const CryptoLayer& layer, float* user_ids) {
+        // Constant user data is the same for the whole object, and cached with it. Other user
+        // data (per face, or from instances) is looked up on every sample.
+        if (CryptoThreadStats* stats = crypto_thread_stats())
+            stats->cache_misses++;
+        bool cachable = true;
+        const AtString value = get_user_data(sg, sg->Op, layer.user_data, &cachable);
+        const float id = value.empty() ? 0.0f : hash_name_id(value.c_str());
+        observe_id(sg->tid, layer.index, id);
+        if (user_ids && cachable)
+            user_ids[layer.index - CRYPTO_MANIFEST_USER] = id;
+        return id;
+    }
 
-                write_array_of_AOVs(sg, aovArray, hash.r);
-                if (do_preview_channels) {
-                    hash.r = 0.0f;
-                    AiAOVSetRGBA(sg, aov_name, hash);
-                }
-            }
+    const float* hash_hierarchy_levels(AtShaderGlobals* sg, float* user_ids,
+                                       float uncached_ids[MAX_HIERARCHY_LEVELS]) {
+        // All levels come from one pass over the name, and are cached together.
+        const size_t first = user_cryptomattes.first_level;
+        CryptoThreadStats* stats = crypto_thread_stats();
+        if (user_ids && !std::isnan(user_ids[first])) {
+            if (stats)
+                stats->cache_hits++;
+            return user_ids + first;
+        }
+        if (stats) {
+            stats->cache_misses++;
+            stats->name_calls++;
         }
+        float* level_ids = user_ids ? user_ids + first : uncached_ids;
+        const char* name = AiNodeGetName(sg->Op);
+        size_t lengths[MAX_HIERARCHY_LEVELS];
+        get_hierarchy_levels(name, user_cryptomattes.num_levels, lengths);
+        for (uint8_t i = 0; i < user_cryptomattes.num_levels; i++) {
+            level_ids[i] = hash_name_id(name, lengths[i]);
+            observe_id(sg->tid, CRYPTO_MANIFEST_USER + first + i, level_ids[i]);
+        }
+        return level_ids;
     }
 
-    void hash_object_rgb(AtShaderGlobals* sg, AtRGB& nsp_hash_clr, AtRGB& obj_hash_clr,
-                         AtRGB& mat_hash_clr) {
-        if (CRYPTOMATTE_CACHE[sg->tid].object == sg->Op) {
-            nsp_hash_clr = CRYPTOMATTE_CACHE[sg->tid].nsp_hash_clr;
-            obj_hash_clr = CRYPTOMATTE_CACHE[sg->tid].obj_hash_clr;
-        } else {
-            char nsp_name[MAX_STRING_LENGTH] = "";
-            char obj_name[MAX_STRING_LENGTH] = "";
-            bool cachable = get_object_names(sg, sg->Op, option_obj_flags, nsp_name, obj_name);
-            nsp_hash_clr = hash_name_rgb(nsp_name);
-            obj_hash_clr = hash_name_rgb(obj_name);
-            if (cachable) {
-                // only values that will be valid for the whole node, sg->Op,
-                // are cachable.
-                // the source of manually overriden values is not known and may
-                // therefore not be cached.
-                CRYPTOMATTE_CACHE[sg->tid].object = sg->Op;
-                CRYPTOMATTE_CACHE[sg->tid].obj_hash_clr = obj_hash_clr;
-                CRYPTOMATTE_CACHE[sg->tid].nsp_hash_clr = nsp_hash_clr;
-            }
+    void hash_object_names(AtShaderGlobals* sg, CryptomatteCache* cache, uint32_t generation,
+                           float ids[CRYPTO_MANIFEST_USER]) {
+        CryptoThreadStats* stats = crypto_thread_stats();
+        if (cache && cache->object == sg->Op && cache->object_generation == generation) {
+            ids[CRYPTO_MANIFEST_ASSET] = cache->ids[CRYPTO_MANIFEST_ASSET];
+            ids[CRYPTO_MANIFEST_OBJECT] = cache->ids[CRYPTO_MANIFEST_OBJECT];
+            if (stats)
+                stats->cache_hits++;
+            return;
         }
+        if (stats)
+            stats->cache_misses++;
+        char nsp_name[MAX_STRING_LENGTH] = "";
+        char obj_name[MAX_STRING_LENGTH] = "";
+        bool cachable = get_object_names(sg, sg->Op, option_obj_flags, option_pcloud_ice_verbosity,
+                                         nsp_name, obj_name);
+        ids[CRYPTO_MANIFEST_ASSET] = hash_name_id(nsp_name);
+        ids[CRYPTO_MANIFEST_OBJECT] = hash_name_id(obj_name);
+        // cache hits were recorded when they were cached, by the same thread
+        observe_id(sg->tid, CRYPTO_MANIFEST_ASSET, ids[CRYPTO_MANIFEST_ASSET]);
+        observe_id(sg->tid, CRYPTO_MANIFEST_OBJECT, ids[CRYPTO_MANIFEST_OBJECT]);
+        if (cache && cachable) {
+            // only values that will be valid for the whole node, sg->Op,
+            // are cachable.
+            // the source of manually overriden values is not known and may
+            // therefore not be cached.
+            cache->object = sg->Op;
+            cache->object_generation = generation;
+            cache->ids[CRYPTO_MANIFEST_ASSET] = ids[CRYPTO_MANIFEST_ASSET];
+            cache->ids[CRYPTO_MANIFEST_OBJECT] = ids[CRYPTO_MANIFEST_OBJECT];
+        }
+    }
 
+    void hash_material_name(AtShaderGlobals* sg, CryptomatteCache* cache, uint32_t generation,
+                            float ids[CRYPTO_MANIFEST_USER]) {
+        CryptoThreadStats* stats = crypto_thread_stats();
+        if (cache && cache->shader_object == sg->Op && cache->shader_generation == generation) {
+            ids[CRYPTO_MANIFEST_MATERIAL] = cache->ids[CRYPTO_MANIFEST_MATERIAL];
+            if (stats)
+                stats->cache_hits++;
+            return;
+        }
+        if (stats)
+            stats->cache_misses++;
         AtNode* shader = AiShaderGlobalsGetShader(sg);
-        if (CRYPTOMATTE_CACHE[sg->tid].shader_object == sg->Op) {
-            mat_hash_clr = CRYPTOMATTE_CACHE[sg->tid].mat_hash_clr;
-        } else {
-            AtArray* shaders = AiNodeGetArray(sg->Op, aStr_shader);
-            bool cachable = shaders ? AiArrayGetNumElements(shaders) == 1 : false;
-
-            char mat_name[MAX_STRING_LENGTH] = "";
-            cachable =
-                get_material_name(sg, sg->Op, shader, option_mat_flags, mat_name) && cachable;
-            mat_hash_clr = hash_name_rgb(mat_name);
-
-            if (cachable) {
-                // only values that will be valid for the whole node, sg->Op,
-                // are cachable.
-                CRYPTOMATTE_CACHE[sg->tid].shader_object = sg->Op;
-                CRYPTOMATTE_CACHE[sg->tid].mat_hash_clr = mat_hash_clr;
-            }
+        AtArray* shaders = AiNodeGetArray(sg->Op, aStr_shader);
+        bool cachable = shaders ? AiArrayGetNumElements(shaders) == 1 : false;
+
+        char mat_name[MAX_STRING_LENGTH] = "";
+        cachable = get_material_name(sg, sg->Op, shader, option_mat_flags, mat_name) && cachable;
+        ids[CRYPTO_MANIFEST_MATERIAL] = hash_name_id(mat_name);
+        observe_id(sg->tid, CRYPTO_MANIFEST_MATERIAL, ids[CRYPTO_MANIFEST_MATERIAL]);
+
+        if (cache && cachable) {
+            // only values that will be valid for the whole node, sg->Op,
+            // are cachable.
+            cache->shader_object = sg->Op;
+            cache->shader_generation = generation;
+            cache->ids[CRYPTO_MANIFEST_MATERIAL] = ids[CRYPTO_MANIFEST_MATERIAL];
         }
     }
 
@@ -1007,7 +1454,8 @@ private:
     //      Building Cryptomatte Arnold Nodes
     ///////////////////////////////////////////////
 
-    void setup_cryptomatte_nodes() {
+    void setup_cryptomatte_nodes(bool rewrite_metadata) {
+        CryptoTraceSpan span("setup_cryptomatte_nodes");
         AtNode* renderOptions = AiUniverseGetOptions();
         const AtArray* outputs = AiNodeGetArray(renderOptions, "outputs");
         const uint32_t prev_output_num = AiArrayGetNumElements(outputs);
@@ -1020,104 +1468,136 @@ private:
         std::vector<std::vector<AtNode*>> tmp_uc_drivers_vv(user_cryptomattes.count);
 
         std::vector<AtNode*> driver_cryptoAsset_v, driver_cryptoObject_v, driver_cryptoMaterial_v;
-        StringVector new_outputs;
 
-        for (uint32_t i = 0; i < prev_output_num; i++) {
-            size_t output_string_chars = AiArrayGetStr(outputs, i).length();
-            char temp_string[MAX_STRING_LENGTH * 8];
-            memset(temp_string, 0, sizeof(temp_string));
-            strncpy(temp_string, AiArrayGetStr(outputs, i), output_string_chars);
+        const AtString manifest_driver_name("cryptomatte_manifest_driver");
 
-            char* c0 = strtok(temp_string, " ");
-            char* c1 = strtok(nullptr, " ");
-            char* c2 = strtok(nullptr, " ");
-            char* c3 = strtok(nullptr, " ");
-            char* c4 = strtok(nullptr, " ");
-            char* c5 = strtok(nullptr, " ");
+        // Cryptomatte outputs become preview outputs, or preview outputs from an earlier setup
+        // are dropped, depending on preview_in_exr. Rank outputs are added once.
+        StringVector prev_outputs(prev_output_num);
+        for (uint32_t i = 0; i < prev_output_num; i++)
+            prev_outputs[i] = AiArrayGetStr(outputs, i).c_str();
+        OutputRewrite rewrite(prev_outputs, manifest_driver_name.c_str());
 
-            bool short_output = (c4 == nullptr || strncmp(c4, "HALF", 4) == 0);
+        // the ID AOV of each cryptomatte, by CryptoManifestSource, empty if it's not output
+        std::vector<AtString> id_aovs(CRYPTO_MANIFEST_USER + user_cryptomattes.count);
 
-            char* camera_name = short_output ? nullptr : c0;
-            char* aov_name = short_output ? c0 : c1;
-            char* filter_name = short_output ? c2 : c3;
-            char* driver_name = short_output ? c3 : c4;
-            char* output_half = short_output ? c4 : c5;
+        // preview and cryptomatte_exr layer outputs stand in for the cryptomatte output they
+        // replaced
+        visit_outputs(rewrite, [&](size_t i, const OutputSpec& spec, bool is_preview,
+                                   bool is_layer) {
+            const char* aov_name = spec.aov.c_str();
 
-            AtNode* driver = AiNodeLookUpByName(driver_name);
+            AtNode* driver = AiNodeLookUpByName(spec.driver.c_str());
+            half_modifiable[i] = spec.half ? nullptr : driver;
 
-            const bool flagged_half = output_half && strncmp(output_half, "HALF", 4) == 0;
-            half_modifiable[i] = flagged_half ? nullptr : driver;
-
-            AtArray* cryptoAOVs = nullptr;
+            AtString* id_aov = nullptr;
 
             if (strcmp(aov_name, aov_cryptoasset.c_str()) == 0) {
-                aov_array_cryptoasset = AiArrayAllocate(option_aov_depth, 1, AI_TYPE_STRING);
-                cryptoAOVs = aov_array_cryptoasset;
+                id_aov = &id_aovs[CRYPTO_MANIFEST_ASSET];
                 driver_cryptoAsset_v.push_back(driver);
             } else if (strcmp(aov_name, aov_cryptoobject.c_str()) == 0) {
-                aov_array_cryptoobject = AiArrayAllocate(option_aov_depth, 1, AI_TYPE_STRING);
-                cryptoAOVs = aov_array_cryptoobject;
+                id_aov = &id_aovs[CRYPTO_MANIFEST_OBJECT];
                 driver_cryptoObject_v.push_back(driver);
             } else if (strcmp(aov_name, aov_cryptomaterial.c_str()) == 0) {
-                aov_array_cryptomaterial = AiArrayAllocate(option_aov_depth, 1, AI_TYPE_STRING);
-                cryptoAOVs = aov_array_cryptomaterial;
+                id_aov = &id_aovs[CRYPTO_MANIFEST_MATERIAL];
                 driver_cryptoMaterial_v.push_back(driver);
             } else if (user_cryptomattes.count != 0) {
                 for (size_t j = 0; j < user_cryptomattes.count; j++) {
                     const char* user_aov_name = user_cryptomattes.aovs[j].c_str();
                     if (strcmp(aov_name, user_aov_name) == 0) {
-                        // will be destroyed when cryptomatteData is
-                        cryptoAOVs = AiArrayAllocate(option_aov_depth, 1, AI_TYPE_STRING);
+                        id_aov = &id_aovs[CRYPTO_MANIFEST_USER + j];
                         tmp_uc_drivers_vv[j].push_back(driver);
-                        user_cryptomattes.aov_arrays[j] = cryptoAOVs;
                         break;
                     }
                 }
             }
 
-            if (cryptoAOVs) {
-                if (check_driver(driver) && AiNodeGetBool(driver, "half_precision"))
+            if (id_aov && is_cryptomatte_exr_driver(driver)) {
+                // the driver ranks and writes the whole cryptomatte from one output
+                setup_layer_driver(spec, driver);
+                *id_aov = AtString(id_aov_name(spec.aov).c_str());
+                if (!is_layer)
+                    rewrite.replace(i, create_layer_output(spec, driver));
+            } else if (id_aov) {
+                if (is_exr_driver(driver) && AiNodeGetBool(driver, "half_precision"))
                     half_modified.insert(driver);
-                for (uint32_t j = 0; j < option_aov_depth; j++)
-                    AiArraySetStr(cryptoAOVs, j, "");
-                create_AOV_array(aov_name, filter_name, camera_name, driver, cryptoAOVs,
-                                 &new_outputs);
+                const bool has_ranks = create_rank_outputs(spec, driver, rewrite);
+                // other drivers can't hold cryptomattes, but always show the preview
+                const bool preview = has_ranks ? option_exr_preview_channels : driver != nullptr;
+                if (has_ranks || preview)
+                    *id_aov = AtString(id_aov_name(spec.aov).c_str());
+                if (preview && !is_preview)
+                    rewrite.replace(i, create_preview_output(spec, driver));
+                else if (!preview && is_preview)
+                    rewrite.drop(i);
             }
-        }
-
-        if (new_outputs.size()) {
-            this->do_preview_channels = this->option_exr_preview_channels;
-
-            if (option_sidecar_manifests) {
-                AtString manifest_driver_name("cryptomatte_manifest_driver");
-                AtNode* manifest_driver = AiNodeLookUpByName(manifest_driver_name);
-                if (!manifest_driver) {
-                    manifest_driver = AiNode("cryptomatte_manifest_driver");
-                    AiNodeSetStr(manifest_driver, "name", manifest_driver_name);
-                }
-                AiNodeSetLocalData(manifest_driver, this);
-                new_outputs.push_back(manifest_driver_name.c_str());
+        });
+
+        // The manifest driver writes sidecars, stats and traces on close. On open it waits for
+        // asynchronously compiled manifests, or refreshes embedded ones (open_metadata). Its
+        // node may come from an exported scene, so it is given this setup's data even when the
+        // outputs are already in place.
+        const bool needs_manifest_driver =
+            std::any_of(id_aovs.begin(), id_aovs.end(), [](AtString aov) { return !aov.empty(); });
+        if (needs_manifest_driver) {
+            AtNode* manifest_driver = AiNodeLookUpByName(manifest_driver_name);
+            if (!manifest_driver) {
+                manifest_driver = AiNode("cryptomatte_manifest_driver");
+                AiNodeSetStr(manifest_driver, "name", manifest_driver_name);
             }
-            const uint32_t total_outputs = prev_output_num + (uint32_t)new_outputs.size();
+            AiNodeSetLocalData(manifest_driver, this);
+        }
+        // Its output goes first, so that it opens before the EXR drivers read their metadata.
+        // Scenes exported after an earlier setup may have it anywhere, so it is moved.
+        if (needs_manifest_driver)
+            rewrite.add_manifest_output();
+        for (uint32_t i = 0; i < prev_output_num; i++)
+            if (half_modified.count(half_modifiable[i]))
+                rewrite.set_half(i);
+
+        if (rewrite.changed()) {
+            const StringVector final_outputs_v = rewrite.outputs();
             // Does not need destruction
-            AtArray* final_outputs = AiArrayAllocate(total_outputs, 1, AI_TYPE_STRING);
-            // Add old outputs (with "HALF" appended where appropes)
-            for (uint32_t i = 0; i < prev_output_num; i++) {
-                AtString output = AiArrayGetStr(outputs, i);
-                if (half_modified.count(half_modifiable[i]))
-                    output = AtString((std::string(output) + " HALF").c_str());
-                AiArraySetStr(final_outputs, i, output);
-            }
-            // Add new outputs and add them
-            for (int i = 0; i < new_outputs.size(); i++)
-                AiArraySetStr(final_outputs, i + prev_output_num, new_outputs[i].c_str());
-
+            AtArray* final_outputs =
+                AiArrayAllocate((uint32_t)final_outputs_v.size(), 1, AI_TYPE_STRING);
+            for (uint32_t i = 0; i < final_outputs_v.size(); i++)
+                AiArraySetStr(final_outputs, i, final_outputs_v[i].c_str());
             AiNodeSetArray(renderOptions, "outputs", final_outputs);
         }
 
+        pack_sample_layers(id_aovs);
+
+        setup_drivers[CRYPTO_MANIFEST_ASSET] = driver_cryptoAsset_v;
+        setup_drivers[CRYPTO_MANIFEST_OBJECT] = driver_cryptoObject_v;
+        setup_drivers[CRYPTO_MANIFEST_MATERIAL] = driver_cryptoMaterial_v;
+        setup_user_drivers = tmp_uc_drivers_vv;
+
         build_standard_metadata(driver_cryptoAsset_v, driver_cryptoObject_v,
-                                driver_cryptoMaterial_v);
-        build_user_metadata(tmp_uc_drivers_vv);
+                                driver_cryptoMaterial_v, rewrite_metadata);
+        build_user_metadata(tmp_uc_drivers_vv, rewrite_metadata);
+        start_metadata();
+    }
+
+    void pack_sample_layers(const std::vector<AtString>& id_aovs) {
+        clear_sample_layers();
+        for (size_t i = 0; i < id_aovs.size(); i++) {
+            if (id_aovs[i].empty())
+                continue;
+            CryptoLayer layer;
+            layer.id_aov = id_aovs[i];
+            layer.index = (uint16_t)i;
+            layer.level = 0;
+            if (i >= CRYPTO_MANIFEST_USER) {
+                layer.user_data = user_cryptomattes.sources[i - CRYPTO_MANIFEST_USER];
+                layer.level = user_cryptomattes.levels[i - CRYPTO_MANIFEST_USER];
+            }
+            sample_layers.push_back(layer);
+            sample_user_data = sample_user_data || (i >= CRYPTO_MANIFEST_USER && !layer.level);
+            sample_hierarchy = sample_hierarchy || layer.level;
+        }
+        sample_objects = !id_aovs[CRYPTO_MANIFEST_ASSET].empty() ||
+                         !id_aovs[CRYPTO_MANIFEST_OBJECT].empty();
+        sample_materials = !id_aovs[CRYPTO_MANIFEST_MATERIAL].empty();
     }
 
     void setup_deferred_manifest(AtNode* driver, AtString token, std::string& path_out,
@@ -1130,7 +1610,7 @@ private:
             if (exr_found != std::string::npos)
                 filepath = filepath.substr(0, exr_found);
 
-            path_out = filepath + "." + token.c_str() + ".json";
+            path_out = filepath + "." + token.c_str() + manifest_extension();
             const size_t last_partition = path_out.find_last_of("/\\");
             if (last_partition == std::string::npos)
                 metadata_path_out += path_out;
@@ -1139,267 +1619,820 @@ private:
         }
     }
 
-    void write_standard_sidecar_manifests() {
-        const bool do_md_asset = manif_asset_paths.size() > 0;
-        const bool do_md_object = manif_object_paths.size() > 0;
-        const bool do_md_material = manif_material_paths.size() > 0;
+    bool binary_manifests() const {
+        return option_sidecar_manifests && option_manifest_format == CRYPTO_MANIFEST_BINARY;
+    }
 
-        if (!do_md_asset && !do_md_object && !do_md_material)
+    const char* manifest_extension() const {
+        return binary_manifests() ? CRYPTO_BINARY_MANIFEST_EXTENSION : ".json";
+    }
+
+    void encode_manifest(const ManifestMap& map, std::string& manf_string) const {
+        CryptoTraceSpan span(binary_manifests() ? "write_manifest_to_binary"
+                                                : "write_manifest_to_string");
+        if (binary_manifests()) {
+            write_manifest_to_binary(map, manf_string);
             return;
+        }
+        if (map.size() > CRYPTO_MAX_MANIFEST_ENTRIES)
+            AiMsgWarning("Cryptomatte: %lu entries in manifest, limiting to %lu", //
+                         (unsigned long)map.size(), (unsigned long)CRYPTO_MAX_MANIFEST_ENTRIES);
+        write_manifest_to_string(map, manf_string);
+    }
 
-        ManifestMap map_md_asset, map_md_object, map_md_material;
-        compile_standard_manifests(do_md_asset, do_md_object, do_md_material, map_md_asset,
-                                   map_md_object, map_md_material);
+    static bool has_sidecar_path(const StringVector& manifest_paths) {
+        for (const auto& manifest_path : manifest_paths)
+            if (!manifest_path.empty())
+                return true;
+        return false;
+    }
+
+    void write_standard_sidecar_manifests() {
+        bool do_md[CRYPTO_MANIFEST_USER];
+        // paths are empty for drivers without sidecars (async embedded manifests)
+        do_md[CRYPTO_MANIFEST_ASSET] = has_sidecar_path(manif_asset_paths);
+        do_md[CRYPTO_MANIFEST_OBJECT] = has_sidecar_path(manif_object_paths);
+        do_md[CRYPTO_MANIFEST_MATERIAL] = has_sidecar_path(manif_material_paths);
+
+        if (!do_md[CRYPTO_MANIFEST_ASSET] && !do_md[CRYPTO_MANIFEST_OBJECT] &&
+            !do_md[CRYPTO_MANIFEST_MATERIAL])
+            return;
 
-        if (do_md_asset)
-            write_manifest_sidecar_file(map_md_asset, manif_asset_paths);
-        if (do_md_object)
-            write_manifest_sidecar_file(map_md_object, manif_object_paths);
-        if (do_md_material)
-            write_manifest_sidecar_file(map_md_material, manif_material_paths);
+        std::string manifests[CRYPTO_MANIFEST_USER];
+        StringVector user_manifests;
+        get_manifests(do_md, std::vector<bool>(), manifests, user_manifests);
+
+        if (do_md[CRYPTO_MANIFEST_ASSET])
+            write_manifest_sidecar_file(manifests[CRYPTO_MANIFEST_ASSET], manif_asset_paths);
+        if (do_md[CRYPTO_MANIFEST_OBJECT])
+            write_manifest_sidecar_file(manifests[CRYPTO_MANIFEST_OBJECT], manif_object_paths);
+        if (do_md[CRYPTO_MANIFEST_MATERIAL])
+            write_manifest_sidecar_file(manifests[CRYPTO_MANIFEST_MATERIAL],
+                                        manif_material_paths);
+        // the paths are kept, as IPR renders that need no setup write the sidecars again
+    }
 
-        // reset sidecar writers
-        manif_asset_paths = StringVector();
-        manif_object_paths = StringVector();
-        manif_material_paths = StringVector();
+    void node_manifests(const AtNode* node, const std::vector<bool>& layers,
+                        std::vector<ManifestMap>& node_maps) const {
+        // The names one shape adds to each layer's manifest.
+        if (layers[CRYPTO_MANIFEST_ASSET] || layers[CRYPTO_MANIFEST_OBJECT]) {
+            char nsp_name[MAX_STRING_LENGTH] = "";
+            char obj_name[MAX_STRING_LENGTH] = "";
+            get_object_names(nullptr, node, option_obj_flags, option_pcloud_ice_verbosity,
+                             nsp_name, obj_name);
+            add_obj_to_manifest(node, nsp_name, CRYPTO_ASSET_UDATA, CRYPTO_ASSET_OFFSET_UDATA,
+                                node_maps[CRYPTO_MANIFEST_ASSET]);
+            add_obj_to_manifest(node, obj_name, CRYPTO_OBJECT_UDATA, CRYPTO_OBJECT_OFFSET_UDATA,
+                                node_maps[CRYPTO_MANIFEST_OBJECT]);
+        }
+        if (layers[CRYPTO_MANIFEST_MATERIAL]) {
+            // Process all shaders from the objects into the manifest.
+            // This includes cluster materials.
+            AtArray* shaders = AiNodeGetArray(node, "shader");
+            for (uint32_t i = 0; shaders && i < AiArrayGetNumElements(shaders); i++) {
+                char mat_name[MAX_STRING_LENGTH] = "";
+                AtNode* shader = static_cast<AtNode*>(AiArrayGetPtr(shaders, i));
+                if (!shader)
+                    continue;
+                get_material_name(nullptr, node, shader, option_mat_flags, mat_name);
+                add_obj_to_manifest(node, mat_name, CRYPTO_MATERIAL_UDATA,
+                                    CRYPTO_MATERIAL_OFFSET_UDATA,
+                                    node_maps[CRYPTO_MANIFEST_MATERIAL]);
+            }
+        }
+        for (uint32_t i = 0; i < user_cryptomattes.count; i++)
+            if (layers[CRYPTO_MANIFEST_USER + i] && !user_cryptomattes.levels[i])
+                add_override_udata_to_manifest(node, user_cryptomattes.sources[i],
+                                               node_maps[CRYPTO_MANIFEST_USER + i]);
+        if (user_cryptomattes.num_levels) {
+            // every level from one pass over the name
+            const char* name = AiNodeGetName(node);
+            size_t lengths[MAX_HIERARCHY_LEVELS];
+            get_hierarchy_levels(name, user_cryptomattes.num_levels, lengths);
+            for (uint8_t i = 0; i < user_cryptomattes.num_levels; i++) {
+                const size_t layer = CRYPTO_MANIFEST_USER + user_cryptomattes.first_level + i;
+                if (layers[layer])
+                    add_hash_to_map(std::string(name, lengths[i]).c_str(), node_maps[layer]);
+            }
+        }
     }
 
-    void compile_standard_manifests(bool do_md_asset, bool do_md_object, bool do_md_material,
-                                    ManifestMap& map_md_asset, ManifestMap& map_md_object,
-                                    ManifestMap& map_md_material) {
+    bool update_manifest_store(const std::vector<bool>& needed_layers) {
+        // Brings the manifests of the needed layers up to date. The shapes are walked to find
+        // added, removed and changed ones, but only those have their names processed. Returns
+        // whether any were.
+        const clock_t update_start_time = clock();
+        const size_t num_layers = CRYPTO_MANIFEST_USER + user_cryptomattes.count;
+        ManifestStore& store = manifest_store;
+
+        std::string options_data;
+        const uint8_t options[] = {option_obj_flags, option_mat_flags, option_pcloud_ice_verbosity};
+        options_data.append(reinterpret_cast<const char*>(options), sizeof(options));
+        for (const auto& src : user_cryptomattes.sources)
+            append_fingerprint_str(options_data, src.c_str());
+        options_data.push_back((char)user_cryptomattes.num_levels);
+        const uint64_t options_signature = manifest_input_signature(options_data);
+
+        bool untracked = store.layers.size() != num_layers;
+        for (size_t i = 0; !untracked && i < num_layers; i++)
+            untracked = needed_layers[i] && !store.layers[i].tracked;
+        if (options_signature != store.options_signature || untracked) {
+            // start over, tracking what was tracked before as well
+            std::vector<bool> tracked(num_layers, false);
+            for (size_t i = 0; i < num_layers; i++)
+                tracked[i] = needed_layers[i] ||
+                             (i < store.layers.size() && store.layers[i].tracked &&
+                              options_signature == store.options_signature);
+            store.clear(num_layers);
+            for (size_t i = 0; i < num_layers; i++)
+                store.layers[i].tracked = tracked[i];
+            store.options_signature = options_signature;
+        }
+
+        std::vector<bool> tracked(num_layers);
+        for (size_t i = 0; i < num_layers; i++)
+            tracked[i] = store.layers[i].tracked;
+        const std::vector<AtString> udata_names = manifest_udata_names();
+
+        const uint32_t generation = ++store.generation;
+        size_t num_shapes = 0, num_changed = 0, num_removed = 0;
+        std::string node_data;
+        std::vector<ManifestMap> node_maps(num_layers);
         AtNodeIterator* shape_iterator = AiUniverseGetNodeIterator(AI_NODE_SHAPE);
         while (!AiNodeIteratorFinished(shape_iterator)) {
             AtNode* node = AiNodeIteratorGetNext(shape_iterator);
-            if (!node || AiNodeIsDisabled(node))
+            if (!node || AiNodeIsDisabled(node) || AiNodeIs(node, aStr_list_aggregate))
                 continue;
+            num_shapes++;
 
-            // skip any list aggregate nodes
-            if (AiNodeIs(node, aStr_list_aggregate))
-                continue;
+            node_data.clear();
+            append_manifest_inputs(node_data, node, udata_names);
+            const uint64_t signature = manifest_input_signature(node_data);
 
-            char nsp_name[MAX_STRING_LENGTH] = "";
-            char obj_name[MAX_STRING_LENGTH] = "";
+            ManifestStore::Contribution& contribution = store.nodes[node];
+            contribution.generation = generation;
+            if (!contribution.names.empty() && contribution.signature == signature)
+                continue;
 
-            get_object_names(nullptr, node, option_obj_flags, nsp_name, obj_name);
+            num_changed++;
+            store.remove(contribution);
+            contribution.names.resize(num_layers);
+            contribution.signature = signature;
+            for (auto& node_map : node_maps)
+                node_map.clear();
+            node_manifests(node, tracked, node_maps);
+            for (size_t i = 0; i < num_layers; i++)
+                store.add(contribution, i, node_maps[i]);
+        }
+        AiNodeIteratorDestroy(shape_iterator);
 
-            if (do_md_asset || do_md_object) {
-                add_obj_to_manifest(node, nsp_name, CRYPTO_ASSET_UDATA, CRYPTO_ASSET_OFFSET_UDATA,
-                                    map_md_asset);
-                add_obj_to_manifest(node, obj_name, CRYPTO_OBJECT_UDATA, CRYPTO_OBJECT_OFFSET_UDATA,
-                                    map_md_object);
-            }
-            if (do_md_material) {
-                // Process all shaders from the objects into the manifest.
-                // This includes cluster materials.
-                AtArray* shaders = AiNodeGetArray(node, "shader");
-                if (!shaders)
-                    continue;
-                for (uint32_t i = 0; i < AiArrayGetNumElements(shaders); i++) {
-                    char mat_name[MAX_STRING_LENGTH] = "";
-                    AtNode* shader = static_cast<AtNode*>(AiArrayGetPtr(shaders, i));
-                    if (!shader)
-                        continue;
-                    get_material_name(nullptr, node, shader, option_mat_flags, mat_name);
-                    add_obj_to_manifest(node, mat_name, CRYPTO_MATERIAL_UDATA,
-                                        CRYPTO_MATERIAL_OFFSET_UDATA, map_md_material);
-                }
+        for (auto it = store.nodes.begin(); it != store.nodes.end();) {
+            if (it->second.generation == generation) {
+                ++it;
+                continue;
             }
+            store.remove(it->second);
+            it = store.nodes.erase(it);
+            num_removed++;
         }
-        AiNodeIteratorDestroy(shape_iterator);
+
+        // a changed shape may be cached under its old names
+        if (num_changed || num_removed)
+            invalidate_caches();
+
+        AiMsgInfo("Cryptomatte manifests updated, %lu of %lu shapes changed, %lu removed - %f "
+                  "seconds",
+                  num_changed, num_shapes, num_removed,
+                  float(clock() - update_start_time) / CLOCKS_PER_SEC);
+        return num_changed || num_removed;
     }
 
-    void write_user_sidecar_manifests() {
-        std::vector<bool> do_metadata;
-        do_metadata.resize(user_cryptomattes.count);
-        std::vector<ManifestMap> manf_maps;
-        manf_maps.resize(user_cryptomattes.count);
+    void refresh_embedded_metadata() {
+        // Rewrites embedded manifests whose shapes changed since they were written. Sidecar
+        // manifests are compiled at render end, so they are always current.
+        if (!has_setup || option_sidecar_manifests)
+            return;
+        CryptoTraceSpan span("refresh_embedded_metadata");
+        std::vector<bool> embedded(CRYPTO_MANIFEST_USER + user_cryptomattes.count, false);
+        bool any_embedded = false;
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            embedded[i] = !setup_drivers[i].empty();
+        for (size_t i = 0; i < setup_user_drivers.size() && i < user_cryptomattes.count; i++)
+            embedded[CRYPTO_MANIFEST_USER + i] = !setup_user_drivers[i].empty();
+        for (size_t i = 0; i < embedded.size(); i++)
+            any_embedded = any_embedded || embedded[i];
+        if (!any_embedded)
+            return;
+        if (manifests_from_cache) {
+            // The store was never filled, updating it would reprocess every shape. Unchanged
+            // inputs mean the cached manifests are still current, otherwise the rewrite below
+            // tries the cache again under the new fingerprint.
+            const ManifestFingerprint fingerprint = compute_manifest_fingerprint();
+            if (fingerprint.h1 == cached_fingerprint.h1 &&
+                fingerprint.h2 == cached_fingerprint.h2 &&
+                fingerprint.count == cached_fingerprint.count)
+                return;
+            invalidate_caches();
+        } else if (!update_manifest_store(embedded)) {
+            return;
+        }
+
+        AiMsgInfo("Cryptomatte shapes changed since setup, rewriting embedded manifests");
+        CryptoSetupLock lock;
+        build_standard_metadata(setup_drivers[CRYPTO_MANIFEST_ASSET],
+                                setup_drivers[CRYPTO_MANIFEST_OBJECT],
+                                setup_drivers[CRYPTO_MANIFEST_MATERIAL], true);
+        build_user_metadata(setup_user_drivers, true);
+        compile_pending_metadata();
+        write_pending_metadata();
+    }
 
-        for (size_t i = 0; i < user_cryptomattes.count; i++) {
-            do_metadata[i] = true;
+    void write_user_sidecar_manifests() {
+        std::vector<bool> do_metadata(user_cryptomattes.count, false);
+        bool do_anything = false;
+        for (size_t i = 0; i < user_cryptomattes.count && i < manifs_user_paths.size(); i++) {
+            do_metadata[i] = manifs_user_paths[i].size() > 0;
             for (size_t j = 0; j < manifs_user_paths[i].size(); j++)
                 do_metadata[i] = do_metadata[i] && manifs_user_paths[i][j].length() > 0;
+            do_anything = do_anything || do_metadata[i];
         }
-        compile_user_manifests(do_metadata, manf_maps);
+        if (!do_anything)
+            return;
+
+        const bool no_md[CRYPTO_MANIFEST_USER] = {false, false, false};
+        std::string manifests[CRYPTO_MANIFEST_USER];
+        StringVector user_manifests;
+        get_manifests(no_md, do_metadata, manifests, user_manifests);
 
         for (size_t i = 0; i < manifs_user_paths.size(); i++)
             if (do_metadata[i])
-                write_manifest_sidecar_file(manf_maps[i], manifs_user_paths[i]);
-
-        manifs_user_paths = std::vector<StringVector>();
-    }
-
-    void compile_user_manifests(std::vector<bool>& do_metadata,
-                                std::vector<ManifestMap>& manf_maps) {
-        if (user_cryptomattes.count == 0)
-            return;
-        AtNodeIterator* shape_iterator = AiUniverseGetNodeIterator(AI_NODE_SHAPE);
-        while (!AiNodeIteratorFinished(shape_iterator)) {
-            AtNode* node = AiNodeIteratorGetNext(shape_iterator);
-            if (!node || AiNodeIsDisabled(node))
-                continue;
-            for (uint32_t i = 0; i < user_cryptomattes.count; i++) {
-                if (do_metadata[i])
-                    add_override_udata_to_manifest(node, user_cryptomattes.sources[i],
-                                                   manf_maps[i]);
-            }
-        }
-        AiNodeIteratorDestroy(shape_iterator);
+                write_manifest_sidecar_file(user_manifests[i], manifs_user_paths[i]);
     }
 
     void build_standard_metadata(const std::vector<AtNode*>& driver_asset_v,
                                  const std::vector<AtNode*>& driver_object_v,
-                                 const std::vector<AtNode*>& driver_material_v) {
-        clock_t metadata_start_time = clock();
-
-        bool do_md_asset = false, do_md_object = false, do_md_material = false;
-        for (auto& driver_asset : driver_asset_v) {
-            if (metadata_needed(driver_asset, aov_cryptoasset)) {
-                do_md_asset = true;
-                metadata_set_unneeded(driver_asset, aov_cryptoasset);
-                break;
-            }
-        }
-        for (auto& driver_object : driver_object_v) {
-            if (metadata_needed(driver_object, aov_cryptoobject)) {
-                do_md_object = true;
-                metadata_set_unneeded(driver_object, aov_cryptoobject);
-                break;
-            }
-        }
-        for (auto& driver_material : driver_material_v) {
-            if (metadata_needed(driver_material, aov_cryptomaterial)) {
-                do_md_material = true;
-                metadata_set_unneeded(driver_material, aov_cryptomaterial);
-                break;
-            }
-        }
+                                 const std::vector<AtNode*>& driver_material_v,
+                                 bool rewrite = false) {
+        const bool do_md_asset = layer_metadata_needed(driver_asset_v, aov_cryptoasset, rewrite);
+        const bool do_md_object =
+            layer_metadata_needed(driver_object_v, aov_cryptoobject, rewrite);
+        const bool do_md_material =
+            layer_metadata_needed(driver_material_v, aov_cryptomaterial, rewrite);
 
         if (!do_md_asset && !do_md_object && !do_md_material)
             return;
 
-        ManifestMap map_md_asset, map_md_object, map_md_material;
-
-        if (!option_sidecar_manifests)
-            compile_standard_manifests(do_md_asset, do_md_object, do_md_material, map_md_asset,
-                                       map_md_object, map_md_material);
-
-        std::string manif_asset_m, manif_object_m, manif_material_m;
-        manif_asset_paths.resize(driver_asset_v.size());
-        for (size_t i = 0; i < driver_asset_v.size(); i++) {
-            setup_deferred_manifest(driver_asset_v[i], aov_cryptoasset, manif_asset_paths[i],
-                                    manif_asset_m);
-            write_metadata_to_driver(driver_asset_v[i], aov_cryptoasset, map_md_asset,
-                                     manif_asset_m);
-        }
-        manif_object_paths.resize(driver_object_v.size());
-        for (size_t i = 0; i < driver_object_v.size(); i++) {
-            setup_deferred_manifest(driver_object_v[i], aov_cryptoobject, manif_object_paths[i],
-                                    manif_object_m);
-            write_metadata_to_driver(driver_object_v[i], aov_cryptoobject, map_md_object,
-                                     manif_object_m);
-        }
-        manif_material_paths.resize(driver_material_v.size());
-        for (size_t i = 0; i < driver_material_v.size(); i++) {
-            setup_deferred_manifest(driver_material_v[i], aov_cryptomaterial,
-                                    manif_material_paths[i], manif_material_m);
-            write_metadata_to_driver(driver_material_v[i], aov_cryptomaterial, map_md_material,
-                                     manif_material_m);
-        }
-
-        if (!option_sidecar_manifests)
-            AiMsgInfo("Cryptomatte manifest created - %f seconds",
-                      (float(clock() - metadata_start_time) / CLOCKS_PER_SEC));
-        else
-            AiMsgInfo("Cryptomatte manifest creation deferred - sidecar file "
-                      "written at end of render.");
+        queue_standard_metadata(aov_cryptoasset, CRYPTO_MANIFEST_ASSET, driver_asset_v,
+                                manif_asset_paths, do_md_asset);
+        queue_standard_metadata(aov_cryptoobject, CRYPTO_MANIFEST_OBJECT, driver_object_v,
+                                manif_object_paths, do_md_object);
+        queue_standard_metadata(aov_cryptomaterial, CRYPTO_MANIFEST_MATERIAL, driver_material_v,
+                                manif_material_paths, do_md_material);
+    }
+
+    bool layer_metadata_needed(const std::vector<AtNode*>& drivers, AtString aov_name,
+                               bool rewrite) {
+        // Metadata is written once per driver, as other cryptomatte shaders may share it. Later
+        // updates rewrite it instead, replacing what the previous setup wrote.
+        bool needed = false;
+        for (AtNode* driver : drivers) {
+            if (rewrite) {
+                if (check_driver(driver)) {
+                    remove_metadata_from_driver(driver, aov_name);
+                    metadata_set_unneeded(driver, aov_name);
+                    needed = true;
+                }
+            } else if (metadata_needed(driver, aov_name)) {
+                metadata_set_unneeded(driver, aov_name);
+                return true;
+            }
+        }
+        return needed;
+    }
+
+    void queue_standard_metadata(AtString aov_name, CryptoManifestSource source,
+                                 const std::vector<AtNode*>& drivers, StringVector& manif_paths,
+                                 bool needed) {
+        PendingMetadata metadata;
+        metadata.aov_name = aov_name;
+        metadata.source = source;
+        metadata.drivers = drivers;
+        metadata.manif_files.resize(drivers.size());
+        manif_paths.resize(drivers.size());
+        for (size_t i = 0; i < drivers.size(); i++)
+            setup_deferred_manifest(drivers[i], aov_name, manif_paths[i], metadata.manif_files[i]);
+        if (needed)
+            pending_metadata.push_back(metadata);
     }
 
-    void build_user_metadata(const std::vector<std::vector<AtNode*>>& drivers_vv) {
-        std::vector<StringVector> manifs_user_m;
+    void build_user_metadata(const std::vector<std::vector<AtNode*>>& drivers_vv,
+                             bool rewrite = false) {
         manifs_user_paths = std::vector<StringVector>();
-        manifs_user_m.resize(drivers_vv.size());
         manifs_user_paths.resize(drivers_vv.size());
 
         const bool sidecar = option_sidecar_manifests;
         if (user_cryptomattes.count == 0 || drivers_vv.size() == 0)
             return;
 
-        const clock_t metadata_start_time = clock();
-        std::vector<bool> do_metadata;
-        do_metadata.resize(user_cryptomattes.count);
-        std::vector<ManifestMap> manf_maps;
-        manf_maps.resize(user_cryptomattes.count);
-
-        bool do_anything = false;
         for (uint32_t i = 0; i < drivers_vv.size(); i++) {
-            do_metadata[i] = false;
+            AtString user_aov = user_cryptomattes.aovs[i];
+            PendingMetadata metadata;
+            metadata.aov_name = user_aov;
+            metadata.source = CRYPTO_MANIFEST_USER;
+            metadata.user_index = i;
+
+            bool do_metadata = false;
             for (size_t j = 0; j < drivers_vv[i].size(); j++) {
                 AtNode* driver = drivers_vv[i][j];
-                AtString user_aov = user_cryptomattes.aovs[i];
-                do_metadata[i] = do_metadata[i] || metadata_needed(driver, user_aov);
-                do_anything = do_anything || do_metadata[i];
+                if (rewrite && check_driver(driver)) {
+                    remove_metadata_from_driver(driver, user_aov);
+                    do_metadata = true;
+                }
+                do_metadata = do_metadata || metadata_needed(driver, user_aov);
 
                 std::string manif_user_m;
                 if (sidecar) {
-                    std::string manif_asset_paths;
-                    setup_deferred_manifest(driver, user_aov, manif_asset_paths, manif_user_m);
-                    manifs_user_paths[i].push_back(driver ? manif_asset_paths : "");
+                    std::string manif_user_path;
+                    setup_deferred_manifest(driver, user_aov, manif_user_path, manif_user_m);
+                    manifs_user_paths[i].push_back(driver ? manif_user_path : "");
+                }
+                if (driver) {
+                    metadata.drivers.push_back(driver);
+                    metadata.manif_files.push_back(manif_user_m);
                 }
-                manifs_user_m[i].push_back(driver ? manif_user_m : "");
             }
+
+            if (!do_metadata)
+                continue;
+            for (AtNode* driver : metadata.drivers)
+                metadata_set_unneeded(driver, user_aov);
+            pending_metadata.push_back(metadata);
         }
+    }
 
-        if (!do_anything)
+    ///////////////////////////////////////////////
+    //      Compiling and writing queued metadata
+    ///////////////////////////////////////////////
+
+    void start_metadata() {
+        metadata_from_setup = true;
+        if (pending_metadata.empty())
+            return;
+
+        if (option_sidecar_manifests) {
+            // nothing to compile, metadata only points to the sidecar files
+            write_pending_metadata();
+            AiMsgInfo("Cryptomatte manifest creation deferred - sidecar file "
+                      "written at end of render.");
+        } else if (option_async_manifests) {
+            metadata_thread = AiThreadCreate(compile_metadata_thread, this, AI_PRIORITY_LOW);
+            AiMsgInfo("Cryptomatte manifests compiling in background.");
+        } else {
+            compile_pending_metadata();
+            write_pending_metadata();
+        }
+    }
+
+    static unsigned int compile_metadata_thread(void* data) {
+        static_cast<CryptomatteData*>(data)->compile_pending_metadata();
+        return 0;
+    }
+
+    void compile_pending_metadata() {
+        const clock_t metadata_start_time = clock();
+        CryptoStatsTimer timer(CRYPTO_STATS_MANIFEST_COMPILE);
+        CryptoTraceSpan span("compile_pending_metadata");
+
+        bool do_md[CRYPTO_MANIFEST_USER] = {false, false, false};
+        std::vector<bool> do_user_md(user_cryptomattes.count, false);
+        for (const auto& metadata : pending_metadata) {
+            if (metadata.source == CRYPTO_MANIFEST_USER)
+                do_user_md[metadata.user_index] = true;
+            else
+                do_md[metadata.source] = true;
+        }
+
+        std::string manifests[CRYPTO_MANIFEST_USER];
+        StringVector user_manifests;
+        get_manifests(do_md, do_user_md, manifests, user_manifests);
+
+        for (auto& metadata : pending_metadata) {
+            if (metadata.source == CRYPTO_MANIFEST_USER)
+                metadata.manifest = user_manifests[metadata.user_index];
+            else
+                metadata.manifest = manifests[metadata.source];
+        }
+        compress_pending_manifests();
+
+        AiMsgInfo("Cryptomatte manifests created - %f seconds",
+                  float(clock() - metadata_start_time) / CLOCKS_PER_SEC);
+    }
+
+    void compress_pending_manifests() {
+        if (option_manifest_compression == CRYPTO_COMPRESSION_NONE)
+            return;
+        CryptoTraceSpan span("compress_pending_manifests");
+        if (!manifest_deflate_available()) {
+            AiMsgWarning("Cryptomatte: built without zlib, manifests will not be compressed");
             return;
+        }
+        size_t plain_bytes = 0, compressed_bytes = 0;
+        for (auto& metadata : pending_metadata) {
+            if (!deflate_manifest(metadata.manifest, metadata.manifest_deflate)) {
+                AiMsgWarning("Cryptomatte: could not compress manifest for %s",
+                             metadata.aov_name.c_str());
+                metadata.manifest_deflate.clear();
+                continue;
+            }
+            plain_bytes += metadata.manifest.size();
+            if (metadata.manifest_deflate.size() >= metadata.manifest.size()) {
+                // small manifests grow, they are left plain which every reader understands
+                metadata.manifest_deflate.clear();
+                compressed_bytes += metadata.manifest.size();
+                continue;
+            }
+            compressed_bytes += metadata.manifest_deflate.size();
+            if (option_manifest_compression == CRYPTO_COMPRESSION_DEFLATE)
+                metadata.manifest.clear();
+        }
+        AiMsgInfo("Cryptomatte manifests compressed from %lu to %lu bytes", plain_bytes,
+                  compressed_bytes);
+    }
 
-        if (!sidecar)
-            compile_user_manifests(do_metadata, manf_maps);
+    ///////////////////////////////////////////////
+    //      Manifests, from the cache or compiled
+    ///////////////////////////////////////////////
 
-        for (uint32_t i = 0; i < drivers_vv.size(); i++) {
-            if (!do_metadata[i])
+    void get_manifests(const bool do_md[CRYPTO_MANIFEST_USER], const std::vector<bool>& do_user_md,
+                       std::string manifests[CRYPTO_MANIFEST_USER], StringVector& user_manifests) {
+        // Fills in the encoded manifests asked for by do_md and do_user_md.
+        bool need_md[CRYPTO_MANIFEST_USER];
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            need_md[i] = do_md[i];
+        std::vector<bool> need_user_md(do_user_md);
+        user_manifests.resize(do_user_md.size());
+
+        // hit-only manifests differ from render to render, so are never cached
+        const bool hit_only = !observed_ids.empty();
+
+        std::unique_ptr<ManifestCache> cache;
+        std::unique_ptr<ManifestCacheLock> cache_lock;
+        if (!option_manifest_cache.empty() && !hit_only) {
+            const ManifestFingerprint fingerprint = compute_manifest_fingerprint();
+            cache.reset(new ManifestCache(option_manifest_cache, fingerprint));
+            bool hit = read_cached_manifests(*cache, need_md, need_user_md, manifests,
+                                             user_manifests);
+            if (!hit) {
+                // Only one process compiles a given fingerprint, others wait and then
+                // read what it wrote.
+                cache_lock.reset(new ManifestCacheLock(cache->lock_path()));
+                hit = read_cached_manifests(*cache, need_md, need_user_md, manifests,
+                                            user_manifests);
+            } else {
+                AiMsgInfo("Cryptomatte manifests read from cache, %s",
+                          option_manifest_cache.c_str());
+            }
+            if (hit) {
+                manifests_from_cache = true;
+                cached_fingerprint = fingerprint;
+                return;
+            }
+        }
+        manifests_from_cache = false;
+
+        std::vector<bool> needed_layers(CRYPTO_MANIFEST_USER + user_cryptomattes.count, false);
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++)
+            needed_layers[i] = need_md[i];
+        for (size_t i = 0; i < need_user_md.size() && i < user_cryptomattes.count; i++)
+            needed_layers[CRYPTO_MANIFEST_USER + i] = need_user_md[i];
+        {
+            CryptoTraceSpan span("update_manifest_store");
+            update_manifest_store(needed_layers);
+        }
+
+        {
+            CryptoTraceSpan span("compile_standard_manifests");
+            for (int i = 0; i < CRYPTO_MANIFEST_USER; i++) {
+                if (!need_md[i])
+                    continue;
+                encode_stored_manifest(i, hit_only, manifests[i]);
+                if (cache && !cache->write(standard_manifest_key(i), manifests[i]))
+                    AiMsgWarning("Cryptomatte: could not write manifest to cache, %s",
+                                 option_manifest_cache.c_str());
+            }
+        }
+        CryptoTraceSpan span("compile_user_manifests");
+        for (size_t i = 0; i < need_user_md.size(); i++) {
+            if (!need_user_md[i])
                 continue;
-            AtString aov_name = user_cryptomattes.aovs[i];
-            for (size_t j = 0; j < drivers_vv[i].size(); j++) {
-                AtNode* driver = drivers_vv[i][j];
-                if (driver) {
-                    metadata_set_unneeded(driver, aov_name);
-                    write_metadata_to_driver(driver, aov_name, manf_maps[i], manifs_user_m[i][j]);
-                }
+            encode_stored_manifest(CRYPTO_MANIFEST_USER + i, hit_only, user_manifests[i]);
+            if (cache && !cache->write(user_manifest_key(i), user_manifests[i]))
+                AiMsgWarning("Cryptomatte: could not write manifest to cache, %s",
+                             option_manifest_cache.c_str());
+        }
+    }
+
+    void encode_stored_manifest(size_t layer, bool hit_only, std::string& manf_string) const {
+        const ManifestMap& stored = manifest_store.layers[layer].map;
+        if (!hit_only) {
+            encode_manifest(stored, manf_string);
+            return;
+        }
+        ManifestMap observed(stored);
+        filter_to_observed(observed, layer);
+        encode_manifest(observed, manf_string);
+    }
+
+    void reset_observed_ids() {
+        observed_ids.clear();
+        if (!option_hit_only_manifests)
+            return;
+        if (!option_sidecar_manifests) {
+            AiMsgWarning("Cryptomatte: hit-only manifests need sidecar manifests, as embedded "
+                         "manifests are written before rendering. Writing full manifests.");
+            return;
+        }
+        observed_ids.resize(AI_MAX_THREADS);
+        for (auto& thread_ids : observed_ids)
+            thread_ids.resize(CRYPTO_MANIFEST_USER + user_cryptomattes.count);
+        // IDs are only recorded on cache misses, setup_all and open_metadata invalidate the
+        // caches
+    }
+
+    void filter_to_observed(ManifestMap& map, size_t layer) const {
+        IdSet observed;
+        for (const auto& thread_ids : observed_ids)
+            observed.merge(thread_ids[layer]);
+
+        const size_t all_entries = map.size();
+        for (auto it = map.begin(); it != map.end();) {
+            uint32_t bits;
+            std::memcpy(&bits, &it->second, 4);
+            if (observed.contains(bits))
+                ++it;
+            else
+                it = map.erase(it);
+        }
+        AiMsgInfo("Cryptomatte hit-only manifest: %lu of %lu names were rendered", map.size(),
+                  all_entries);
+    }
+
+    bool read_cached_manifests(const ManifestCache& cache, bool need_md[CRYPTO_MANIFEST_USER],
+                               std::vector<bool>& need_user_md,
+                               std::string manifests[CRYPTO_MANIFEST_USER],
+                               StringVector& user_manifests) {
+        // Reads what it can from the cache, clearing need flags. Returns true if nothing
+        // remains to be compiled.
+        bool all_read = true;
+        for (int i = 0; i < CRYPTO_MANIFEST_USER; i++) {
+            if (need_md[i])
+                need_md[i] = !cache.read(standard_manifest_key(i), manifests[i]);
+            all_read = all_read && !need_md[i];
+        }
+        for (size_t i = 0; i < need_user_md.size(); i++) {
+            if (need_user_md[i])
+                need_user_md[i] = !cache.read(user_manifest_key(i), user_manifests[i]);
+            all_read = all_read && !need_user_md[i];
+        }
+        return all_read;
+    }
+
+    std::string standard_manifest_key(int source) const {
+        static const char* keys[CRYPTO_MANIFEST_USER] = {"asset", "object", "material"};
+        return std::string(keys[source]) + manifest_extension();
+    }
+
+    std::string user_manifest_key(size_t user_index) const {
+        // user data names can contain anything, so they are hashed for the file name
+        if (user_cryptomattes.levels[user_index])
+            return "hierarchy_" + std::to_string(user_cryptomattes.levels[user_index]) +
+                   manifest_extension();
+        const char* src = user_cryptomattes.sources[user_index].c_str();
+        uint32_t src_hash = 0;
+        MurmurHash3_x86_32(src, (uint32_t)strlen(src), 0, &src_hash);
+        char key[16];
+        sprintf(key, "user_%08x", src_hash);
+        return std::string(key) + manifest_extension();
+    }
+
+    ManifestFingerprint compute_manifest_fingerprint() {
+        // Fingerprints all the inputs of the manifests. Much cheaper than compiling them, as
+        // there is no name processing or map building, and it is spread over threads.
+        const clock_t fingerprint_start_time = clock();
+
+        const std::vector<AtString> udata_names = manifest_udata_names();
+
+        std::vector<AtNode*> nodes;
+        AtNodeIterator* shape_iterator = AiUniverseGetNodeIterator(AI_NODE_SHAPE);
+        while (!AiNodeIteratorFinished(shape_iterator)) {
+            AtNode* node = AiNodeIteratorGetNext(shape_iterator);
+            if (node && !AiNodeIsDisabled(node) && !AiNodeIs(node, aStr_list_aggregate))
+                nodes.push_back(node);
+        }
+        AiNodeIteratorDestroy(shape_iterator);
+
+        const size_t min_nodes_per_thread = 4096;
+        size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+        num_threads = std::min(num_threads, nodes.size() / min_nodes_per_thread + 1);
+
+        std::vector<FingerprintJob> jobs(num_threads);
+        std::vector<void*> threads(num_threads, nullptr);
+        const size_t nodes_per_thread = nodes.size() / num_threads + 1;
+        for (size_t i = 0; i < num_threads; i++) {
+            jobs[i].nodes = &nodes;
+            jobs[i].udata_names = &udata_names;
+            jobs[i].begin = std::min(i * nodes_per_thread, nodes.size());
+            jobs[i].end = std::min(jobs[i].begin + nodes_per_thread, nodes.size());
+            if (i > 0)
+                threads[i] = AiThreadCreate(fingerprint_thread, &jobs[i], AI_PRIORITY_NORMAL);
+        }
+        fingerprint_thread(&jobs[0]);
+
+        ManifestFingerprint fingerprint;
+        for (size_t i = 0; i < num_threads; i++) {
+            if (threads[i]) {
+                AiThreadWait(threads[i]);
+                AiThreadClose(threads[i]);
             }
+            fingerprint.merge(jobs[i].result);
         }
-        AiMsgInfo("User Cryptomatte manifests created - %f seconds",
-                  float(clock() - metadata_start_time) / CLOCKS_PER_SEC);
+
+        // options that change the names
+        const uint8_t options[] = {option_obj_flags, option_mat_flags, option_pcloud_ice_verbosity};
+        fingerprint.add(options, sizeof(options));
+
+        AiMsgInfo("Cryptomatte manifest fingerprint of %lu shapes - %f seconds",
+                  nodes.size(), float(clock() - fingerprint_start_time) / CLOCKS_PER_SEC);
+        return fingerprint;
     }
 
-    void create_AOV_array(const char* aov_name, const char* filter_name, const char* camera_name,
-                          AtNode* driver, AtArray* cryptoAOVs, StringVector* new_ouputs) {
-        // helper for setup_cryptomatte_nodes. Populates cryptoAOVs and returns
-        // the number of new outputs created.
-        if (!check_driver(driver)) {
-            AiMsgWarning("Cryptomatte: Can only write Cryptomatte to EXR files.");
+    std::vector<AtString> manifest_udata_names() const {
+        std::vector<AtString> udata_names;
+        udata_names.push_back(CRYPTO_ASSET_UDATA);
+        udata_names.push_back(CRYPTO_OBJECT_UDATA);
+        udata_names.push_back(CRYPTO_MATERIAL_UDATA);
+        udata_names.push_back(CRYPTO_ASSET_OFFSET_UDATA);
+        udata_names.push_back(CRYPTO_OBJECT_OFFSET_UDATA);
+        udata_names.push_back(CRYPTO_MATERIAL_OFFSET_UDATA);
+        for (const auto& src : user_cryptomattes.sources)
+            if (!src.empty())
+                udata_names.push_back(src);
+        return udata_names;
+    }
+
+    static void append_manifest_inputs(std::string& node_data, const AtNode* node,
+                                       const std::vector<AtString>& udata_names) {
+        // Everything about a shape its manifest entries depend on.
+        append_fingerprint_str(node_data, AiNodeGetName(node));
+        AtArray* shaders = AiNodeGetArray(node, aStr_shader);
+        for (uint32_t j = 0; shaders && j < AiArrayGetNumElements(shaders); j++) {
+            const AtNode* shader = static_cast<const AtNode*>(AiArrayGetPtr(shaders, j));
+            append_fingerprint_str(node_data, shader ? AiNodeGetName(shader) : "");
+        }
+        for (const auto& udata_name : udata_names)
+            append_fingerprint_udata(node_data, node, udata_name);
+    }
+
+    static uint64_t manifest_input_signature(const std::string& node_data) {
+        uint64_t hash[2];
+        MurmurHash3_x64_128(node_data.data(), (int)node_data.size(), 0, hash);
+        return hash[0];
+    }
+
+    struct FingerprintJob {
+        const std::vector<AtNode*>* nodes = nullptr;
+        const std::vector<AtString>* udata_names = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+        ManifestFingerprint result;
+    };
+
+    static unsigned int fingerprint_thread(void* data) {
+        FingerprintJob* job = static_cast<FingerprintJob*>(data);
+        std::string node_data;
+        for (size_t i = job->begin; i < job->end; i++) {
+            const AtNode* node = (*job->nodes)[i];
+            node_data.clear();
+            append_manifest_inputs(node_data, node, *job->udata_names);
+            job->result.add(node_data.data(), node_data.size());
+        }
+        return 0;
+    }
+
+    static void append_fingerprint_str(std::string& node_data, const char* str) {
+        node_data.append(str ? str : "");
+        node_data.push_back('\0');
+    }
+
+    static void append_fingerprint_udata(std::string& node_data, const AtNode* node,
+                                         const AtString udata_name) {
+        const AtUserParamEntry* pentry = AiNodeLookUpUserParameter(node, udata_name);
+        if (!pentry)
+            return;
+        const int type = AiUserParamGetType(pentry);
+        if (type != AI_TYPE_STRING && type != AI_TYPE_INT)
             return;
+        append_fingerprint_str(node_data, udata_name.c_str());
+        if (AiUserParamGetCategory(pentry) == AI_USERDEF_CONSTANT) {
+            if (type == AI_TYPE_STRING) {
+                append_fingerprint_str(node_data, AiNodeGetStr(node, udata_name).c_str());
+            } else {
+                const int value = AiNodeGetInt(node, udata_name);
+                node_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+            }
+        } else {
+            AtArray* values = AiNodeGetArray(node, udata_name);
+            for (uint32_t i = 0; values && i < AiArrayGetNumElements(values); i++) {
+                if (type == AI_TYPE_STRING) {
+                    append_fingerprint_str(node_data, AiArrayGetStr(values, i).c_str());
+                } else {
+                    const int value = AiArrayGetInt(values, i);
+                    node_data.append(reinterpret_cast<const char*>(&value), sizeof(value));
+                }
+            }
         }
+    }
 
-        ///////////////////////////////////////////////
-        //      Compile info about original filter
+    void write_pending_metadata() {
+        const char* format = binary_manifests() ? CRYPTO_BINARY_MANIFEST_FORMAT : nullptr;
+        for (const auto& metadata : pending_metadata)
+            for (size_t i = 0; i < metadata.drivers.size(); i++)
+                write_metadata_to_driver(metadata.drivers[i], metadata.aov_name,
+                                         metadata.manifest, metadata.manif_files[i], format,
+                                         metadata.manifest_deflate);
+        pending_metadata.clear();
+    }
 
-        float aFilter_width = 2.0;
-        char aFilter_filter[128];
-        AtNode* orig_filter = AiNodeLookUpByName(filter_name);
-        const AtNodeEntry* orig_filter_nodeEntry = AiNodeGetNodeEntry(orig_filter);
-        const char* orig_filter_type_name = AiNodeEntryGetName(orig_filter_nodeEntry);
-        if (AiNodeEntryLookUpParameter(orig_filter_nodeEntry, "width")) {
-            aFilter_width = AiNodeGetFlt(orig_filter, "width");
+    void join_metadata_thread() {
+        if (!metadata_thread)
+            return;
+        AiThreadWait(metadata_thread);
+        AiThreadClose(metadata_thread);
+        metadata_thread = nullptr;
+    }
+
+    void setup_layer_driver(const OutputSpec& spec, AtNode* driver) {
+        // helper for setup_cryptomatte_nodes, for cryptomattes written by cryptomatte_exr.
+        // Registers the ID AOV, which the driver reads from its samples.
+        AiAOVRegister(id_aov_name(spec.aov).c_str(), AI_TYPE_FLOAT, AI_AOV_BLEND_NONE);
+        AiNodeSetInt(driver, "cryptomatte_depth", option_depth);
+        AiNodeSetBool(driver, "preview_channels", option_exr_preview_channels);
+        AiNodeSetInt(driver, "channel_layout", option_channel_layout);
+    }
+
+    static std::string create_layer_output(const OutputSpec& spec, AtNode* driver) {
+        // helper for setup_cryptomatte_nodes. The one output of a cryptomatte written by
+        // cryptomatte_exr, its ID AOV under the cryptomatte's name. The driver filters with the
+        // cryptomatte's own filter.
+        OutputSpec layer_spec = spec;
+        layer_spec.aov = id_aov_name(spec.aov);
+        layer_spec.type = "FLOAT";
+        layer_spec.driver = AiNodeGetName(driver);
+        layer_spec.half = false;
+        layer_spec.layer = spec.aov;
+        return layer_spec.str();
+    }
+
+    std::string create_preview_output(const OutputSpec& spec, AtNode* driver) {
+        // helper for setup_cryptomatte_nodes. The preview output replacing the cryptomatte's own
+        // output, its colors are made by the preview filter from the ID AOV.
+        OutputSpec preview_spec = spec;
+        preview_spec.aov = id_aov_name(spec.aov);
+        preview_spec.type = "FLOAT";
+        preview_spec.filter = preview_filter_name(spec.aov);
+        preview_spec.driver = AiNodeGetName(driver);
+        preview_spec.layer = spec.aov;
+        if (!AiNodeLookUpByName(preview_spec.filter.c_str())) {
+            float aFilter_width = 2.0;
+            char aFilter_filter[128];
+            get_original_filter(spec.filter, aFilter_filter, aFilter_width);
+            AtNode* filter = AiNode("cryptomatte_filter");
+            AiNodeSetStr(filter, "name", preview_spec.filter.c_str());
+            AiNodeSetBool(filter, "preview", true);
+            AiNodeSetStr(filter, "filter", aFilter_filter);
+            AiNodeSetFlt(filter, "width", aFilter_width);
         }
+        return preview_spec.str();
+    }
 
-        memset(aFilter_filter, 0, sizeof(aFilter_filter));
-        size_t filter_name_len = strlen(orig_filter_type_name);
-        strncpy(aFilter_filter, orig_filter_type_name, filter_name_len);
-        char* filter_strip_point = strstr(aFilter_filter, "_filter");
-        if (filter_strip_point) {
-            filter_strip_point[0] = '\0';
+    bool create_rank_outputs(const OutputSpec& spec, AtNode* driver, OutputRewrite& rewrite) {
+        // helper for setup_cryptomatte_nodes. Registers the cryptomatte's ID AOV and outputs it
+        // once per rank, each through its own rank filter and under its own layer name. Adds
+        // the outputs not there yet to rewrite.
+        if (!is_exr_driver(driver)) {
+            AiMsgWarning("Cryptomatte: Can only write Cryptomatte to EXR files.");
+            return false;
         }
 
+        if (option_channel_layout != CRYPTO_CHANNELS_FLOAT)
+            AiMsgWarning("Cryptomatte: %s channel layout needs a cryptomatte_exr driver, "
+                         "writing %s in full float.",
+                         channelLayoutEnumNames[option_channel_layout], spec.aov.c_str());
+
+        float aFilter_width = 2.0;
+        char aFilter_filter[128];
+        get_original_filter(spec.filter, aFilter_filter, aFilter_width);
+
         ///////////////////////////////////////////////
         //      Set CryptoAOV driver to full precision and outlaw RLE
 
@@ -1422,81 +2455,47 @@ private:
             AiNodeSetStr(driver, "compression", "zip");
         }
 
-        AiAOVRegister(aov_name, AI_TYPE_RGB, AI_AOV_BLEND_OPACITY);
-
-        AtArray* outputs = AiNodeGetArray(AiUniverseGetOptions(), "outputs");
+        // without preview channels, the cryptomatte's own output stays and is left black
+        if (!option_exr_preview_channels)
+            AiAOVRegister(spec.aov.c_str(), AI_TYPE_RGB, AI_AOV_BLEND_OPACITY);
 
-        std::unordered_set<std::string> outputSet;
-        for (uint32_t i = 0; i < AiArrayGetNumElements(outputs); i++)
-            outputSet.insert(std::string(AiArrayGetStr(outputs, i)));
-
-        std::unordered_set<std::string> splitAOVs;
         ///////////////////////////////////////////////
         //      Create filters and outputs as needed
+        AiAOVRegister(id_aov_name(spec.aov).c_str(), AI_TYPE_FLOAT, AI_AOV_BLEND_NONE);
         for (int i = 0; i < option_aov_depth; i++) {
-            char filter_rank_name[MAX_STRING_LENGTH];
-            memset(filter_rank_name, 0, MAX_STRING_LENGTH);
-
-            char aov_rank_name[MAX_STRING_LENGTH];
-            memset(aov_rank_name, 0, MAX_STRING_LENGTH);
-
-            size_t aov_name_chars = strlen(aov_name);
-            strncpy(filter_rank_name, aov_name, aov_name_chars);
-            strncpy(aov_rank_name, aov_name, aov_name_chars);
-
-            char rank_number_string[MAX_STRING_LENGTH];
-            memset(rank_number_string, 0, MAX_STRING_LENGTH);
-            sprintf(rank_number_string, "%002d", i);
-
-            strcat(filter_rank_name, "_filter");
-            strcat(filter_rank_name, rank_number_string);
-            strcat(aov_rank_name, rank_number_string);
-
-            const bool nofilter = AiNodeLookUpByName(filter_rank_name) == nullptr;
+            const std::string filter_name = rank_filter_name(spec.aov, i);
+            const bool nofilter = AiNodeLookUpByName(filter_name.c_str()) == nullptr;
             if (nofilter) {
                 AtNode* filter = AiNode("cryptomatte_filter");
-                AiNodeSetStr(filter, "name", filter_rank_name);
+                AiNodeSetStr(filter, "name", filter_name.c_str());
                 AiNodeSetInt(filter, "rank", i * 2);
                 AiNodeSetStr(filter, "filter", aFilter_filter);
                 AiNodeSetFlt(filter, "width", aFilter_width);
             }
-
-            std::string new_output_str;
-            if (camera_name)
-                new_output_str += std::string(camera_name) + " ";
-            new_output_str += aov_rank_name;
-            new_output_str += " ";
-            new_output_str += "FLOAT";
-            new_output_str += " ";
-            new_output_str += filter_rank_name;
-            new_output_str += " ";
-            new_output_str += AiNodeGetName(driver);
-
-            if (outputSet.find(new_output_str) == outputSet.end()) {
-                AiAOVRegister(aov_rank_name, AI_TYPE_FLOAT, AI_AOV_BLEND_NONE);
-                new_ouputs->push_back(new_output_str.c_str());
-            }
-            AiArraySetStr(cryptoAOVs, i, aov_rank_name);
         }
+        rewrite.add_rank_outputs(spec, option_aov_depth);
+        return true;
     }
 
     ///////////////////////////////////////////////
     //      Cleanup
     ///////////////////////////////////////////////
 
-    void destroy_arrays() {
-        if (aov_array_cryptoasset)
-            AiArrayDestroy(aov_array_cryptoasset);
-        if (aov_array_cryptoobject)
-            AiArrayDestroy(aov_array_cryptoobject);
-        if (aov_array_cryptomaterial)
-            AiArrayDestroy(aov_array_cryptomaterial);
-        aov_array_cryptoasset = nullptr;
-        aov_array_cryptoobject = nullptr;
-        aov_array_cryptomaterial = nullptr;
-        user_cryptomattes = UserCryptomattes();
+    void clear_sample_layers() {
+        sample_layers.clear();
+        sample_objects = false;
+        sample_materials = false;
+        sample_user_data = false;
+        sample_hierarchy = false;
     }
 
 public:
-    ~CryptomatteData() { destroy_arrays(); }
+    ~CryptomatteData() {
+        // drivers may already be gone, so the queued metadata is dropped
+        join_metadata_thread();
+        if (option_performance_stats)
+            CryptoStats::get().disable();
+        if (option_performance_trace)
+            CryptoTrace::get().disable();
+    }
 };
@@ -0,0 +1,377 @@
+/*
+Microbenchmarks of the cryptomatte hot paths in cryptomatte_core, with no Arnold dependency.
+
+    cryptomatte_benchmark [--json <file>] [--filter <substring>] [--min-time <seconds>]
+
+Names come from generated corpora in the styles of MtoA, HtoA (paths), C4DtoA and SItoA point
+cloud instances, and pixels from synthetic sample distributions, from single opaque IDs to deep
+stacks of transparent ones. Manifests of those names are encoded, deflated and inflated as
+embedded manifests are. Every benchmark is timed in batches of at least min-time seconds, five
+times, and reports the fastest and median nanoseconds per operation. --json also writes them as
+JSON, to compare between releases.
+*/
+
+#include "cryptomatte_core.h"
+#include "manifest_deflate.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define BENCHMARK_REPEATS 5
+#define CORPUS_SIZE 4096
+#define PIXEL_COUNT 4096
+
+struct BenchmarkResult {
+    std::string name;
+    uint64_t ops_per_repeat;
+    double min_ns;
+    double median_ns;
+};
+
+// Keeps the optimizer from removing the work being timed.
+static volatile uint32_t benchmark_sink = 0;
+
+static void sink(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, 4);
+    benchmark_sink = benchmark_sink ^ bits;
+}
+
+static void sink(const char* c) { benchmark_sink = benchmark_sink ^ (uint32_t)c[0]; }
+
+///////////////////////////////////////////////
+//
+//      Inputs
+//
+///////////////////////////////////////////////
+
+// Deterministic, so corpora are the same from run to run and machine to machine.
+struct Random {
+    uint32_t state;
+    explicit Random(uint32_t seed) : state(seed) {}
+    uint32_t next() {
+        state = state * 1664525u + 1013904223u;
+        return state >> 8;
+    }
+    uint32_t below(uint32_t n) { return next() % n; }
+    float uniform() { return (float)next() / (float)(1 << 24); }
+};
+
+static StringVector name_corpus(const char* style) {
+    Random random(1234);
+    StringVector names;
+    char name[MAX_STRING_LENGTH];
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        const uint32_t a = random.below(40), b = random.below(1000), c = random.below(100000);
+        if (strcmp(style, "mtoa") == 0)
+            sprintf(name, "|shot:char_%u:rig|char_%u:body_grp|char_%u:geo_%u|char_%u:mesh_%uShape",
+                    a, a, a, b, a, c);
+        else if (strcmp(style, "htoa") == 0)
+            sprintf(name, "/obj/set/district_%u/building_%u/floor_%u/window_%u/pane_shape", a, b,
+                    c % 40, c);
+        else if (strcmp(style, "c4d") == 0)
+            sprintf(name, i % 2 ? "c4d|Null_%u|Cloner_%u|Sphere_%u"
+                                : "/Null_%u/Cloner_%u|Null/Sphere_%u",
+                    a, b, c);
+        else // sitoa point cloud instances
+            sprintf(name, "mdl_%u.icecloud_%u.SItoA.Instance.1001.%u master_%u.SItoA.1001", a, b,
+                    c, b);
+        names.push_back(name);
+    }
+    return names;
+}
+
+// Camera samples of a pixel, each with its depth samples front to back.
+struct DepthSample {
+    float id;
+    float opacity;
+};
+
+struct PixelSamples {
+    std::vector<float> weights;          // per camera sample
+    std::vector<uint32_t> depth_offsets; // per camera sample, then the end
+    std::vector<DepthSample> depth_samples;
+};
+
+// Distributions of IDs per pixel: interior pixels of one opaque object, edges between a few,
+// hair and smoke of many transparent layers, and instanced particles with many opaque IDs.
+static std::vector<PixelSamples> pixel_corpus(const char* distribution) {
+    Random random(5678);
+    std::vector<float> ids(512);
+    for (float& id : ids)
+        id = hash_to_float(random.next() * 2654435761u);
+
+    const bool transparent = strcmp(distribution, "hair") == 0;
+    uint32_t ids_per_pixel = 64;
+    if (strcmp(distribution, "interior") == 0)
+        ids_per_pixel = 1;
+    else if (strcmp(distribution, "edge") == 0)
+        ids_per_pixel = 3;
+    else if (transparent)
+        ids_per_pixel = 24;
+    const uint32_t camera_samples = 9 * 9; // AA 3 over a filter width of 3 pixels
+    const uint32_t depth = transparent ? 8 : 1;
+
+    std::vector<PixelSamples> pixels(PIXEL_COUNT);
+    for (PixelSamples& pixel : pixels) {
+        const uint32_t first_id = random.below((uint32_t)ids.size());
+        for (uint32_t s = 0; s < camera_samples; s++) {
+            pixel.weights.push_back(0.25f + random.uniform());
+            pixel.depth_offsets.push_back((uint32_t)pixel.depth_samples.size());
+            for (uint32_t d = 0; d < depth; d++) {
+                const float id = ids[(first_id + random.below(ids_per_pixel)) % ids.size()];
+                const float opacity = transparent ? 0.1f + 0.3f * random.uniform() : 1.0f;
+                pixel.depth_samples.push_back({id, opacity});
+            }
+        }
+        pixel.depth_offsets.push_back((uint32_t)pixel.depth_samples.size());
+    }
+    return pixels;
+}
+
+///////////////////////////////////////////////
+//
+//      Timing
+//
+///////////////////////////////////////////////
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// op runs ops_per_call operations per call
+static BenchmarkResult run_benchmark(const std::string& name, uint64_t ops_per_call,
+                                     double min_time, const std::function<void()>& op) {
+    // calls per batch, doubled until a batch takes min_time
+    uint64_t calls = 1;
+    for (;;) {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < calls; i++)
+            op();
+        if (seconds_since(start) >= min_time || calls >= (1ull << 40))
+            break;
+        calls *= 2;
+    }
+
+    std::vector<double> ns_per_op;
+    for (int repeat = 0; repeat < BENCHMARK_REPEATS; repeat++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (uint64_t i = 0; i < calls; i++)
+            op();
+        ns_per_op.push_back(seconds_since(start) * 1e9 / (double)(calls * ops_per_call));
+    }
+    std::sort(ns_per_op.begin(), ns_per_op.end());
+
+    BenchmarkResult result;
+    result.name = name;
+    result.ops_per_repeat = calls * ops_per_call;
+    result.min_ns = ns_per_op.front();
+    result.median_ns = ns_per_op[ns_per_op.size() / 2];
+    printf("%-48s %12.1f %12.1f %14llu\n", name.c_str(), result.min_ns, result.median_ns,
+           (unsigned long long)result.ops_per_repeat);
+    fflush(stdout);
+    return result;
+}
+
+///////////////////////////////////////////////
+//
+//      Benchmarks
+//
+///////////////////////////////////////////////
+
+struct NameMode {
+    const char* name;
+    CryptoNameFlag flags;
+};
+
+static const char* name_styles[] = {"mtoa", "htoa", "c4d", "sitoa", nullptr};
+static const char* pixel_distributions[] = {"interior", "edge", "hair", "particles", nullptr};
+static const NameMode name_modes[] = {
+    {"none", CRYPTO_NAME_NONE},
+    {"strip_ns", CRYPTO_NAME_STRIP_NS},
+    {"maya", CRYPTO_NAME_STRIP_NS | CRYPTO_NAME_MAYA},
+    {"paths", CRYPTO_NAME_STRIP_NS | CRYPTO_NAME_PATHS},
+    {"path_pipes", CRYPTO_NAME_STRIP_NS | CRYPTO_NAME_PATHS | CRYPTO_NAME_OBJPATHPIPES},
+    {"legacy", CRYPTO_NAME_STRIP_NS | CRYPTO_NAME_LEGACY},
+    {"all", CRYPTO_NAME_ALL},
+};
+
+static void name_benchmarks(const std::string& filter, double min_time,
+                            std::vector<BenchmarkResult>& results) {
+    for (int s = 0; name_styles[s]; s++) {
+        const StringVector names = name_corpus(name_styles[s]);
+        const std::string prefix = std::string("/") + name_styles[s];
+
+        std::string name = "hash_name_rgb" + prefix;
+        if (name.find(filter) != std::string::npos)
+            results.push_back(run_benchmark(name, names.size(), min_time, [&names]() {
+                float rgb[3];
+                for (const std::string& n : names) {
+                    hash_name_rgb(n.c_str(), rgb);
+                    sink(rgb[0]);
+                }
+            }));
+
+        name = "mtoa_strip_namespaces" + prefix;
+        if (name.find(filter) != std::string::npos)
+            results.push_back(run_benchmark(name, names.size(), min_time, [&names]() {
+                char obj_name[MAX_STRING_LENGTH];
+                for (const std::string& n : names) {
+                    mtoa_strip_namespaces(n.c_str(), obj_name);
+                    sink(obj_name);
+                }
+            }));
+
+        for (const NameMode& mode : name_modes) {
+            name = std::string("get_clean_object_name/") + mode.name + prefix;
+            if (name.find(filter) == std::string::npos)
+                continue;
+            const CryptoNameFlag flags = mode.flags;
+            results.push_back(run_benchmark(name, names.size(), min_time, [&names, flags]() {
+                for (const std::string& n : names) {
+                    // zeroed as the shader does, the names aren't always terminated
+                    char obj_name[MAX_STRING_LENGTH] = "";
+                    char nsp_name[MAX_STRING_LENGTH] = "";
+                    get_clean_object_name(n.c_str(), obj_name, nsp_name, flags, 1);
+                    sink(obj_name);
+                }
+            }));
+        }
+    }
+}
+
+static void manifest_benchmarks(const std::string& filter, double min_time,
+                                std::vector<BenchmarkResult>& results) {
+    // Embedded manifests are written, and with manifest_compression deflated, once per render.
+    // Deflate is timed per entry as well, and its sizes are printed, as they are what it's for.
+    const size_t sizes[] = {1000, 100000};
+    for (size_t size : sizes) {
+        const std::string suffix = "/" + std::to_string(size);
+        const std::string write_name = "write_manifest_to_string" + suffix;
+        const std::string deflate_name = "deflate_manifest" + suffix;
+        const std::string inflate_name = "inflate_manifest" + suffix;
+        const bool deflate = manifest_deflate_available();
+        if (write_name.find(filter) == std::string::npos &&
+            (!deflate || (deflate_name.find(filter) == std::string::npos &&
+                          inflate_name.find(filter) == std::string::npos)))
+            continue;
+        ManifestMap map;
+        for (size_t i = 0; map.size() < size; i++) {
+            const StringVector names = name_corpus(name_styles[i % 4]);
+            for (const std::string& n : names)
+                if (map.size() < size)
+                    add_hash_to_map((n + "_" + std::to_string(i)).c_str(), map);
+        }
+        if (write_name.find(filter) != std::string::npos)
+            results.push_back(run_benchmark(write_name, map.size(), min_time, [&map]() {
+                std::string manifest;
+                write_manifest_to_string(map, manifest);
+                sink(manifest.c_str());
+            }));
+        if (!deflate)
+            continue;
+
+        std::string manifest, deflated;
+        write_manifest_to_string(map, manifest);
+        deflate_manifest(manifest, deflated);
+        if (deflate_name.find(filter) != std::string::npos) {
+            results.push_back(run_benchmark(deflate_name, map.size(), min_time, [&manifest]() {
+                std::string encoded;
+                deflate_manifest(manifest, encoded);
+                sink(encoded.c_str());
+            }));
+            printf("    %lu bytes deflated to %lu (%.2f)\n", (unsigned long)manifest.size(),
+                   (unsigned long)deflated.size(), (double)deflated.size() / manifest.size());
+        }
+        if (inflate_name.find(filter) != std::string::npos)
+            results.push_back(run_benchmark(inflate_name, map.size(), min_time, [&deflated]() {
+                std::string inflated;
+                inflate_manifest(deflated, inflated);
+                sink(inflated.c_str());
+            }));
+    }
+}
+
+static void coverage_benchmarks(const std::string& filter, double min_time,
+                                std::vector<BenchmarkResult>& results) {
+    for (int d = 0; pixel_distributions[d]; d++) {
+        const std::string name = std::string("accumulate_id_coverage/") + pixel_distributions[d];
+        if (name.find(filter) == std::string::npos)
+            continue;
+        const std::vector<PixelSamples> pixels = pixel_corpus(pixel_distributions[d]);
+        std::vector<IdCoverage> coverages;
+        results.push_back(run_benchmark(name, pixels.size(), min_time, [&pixels, &coverages]() {
+            for (const PixelSamples& pixel : pixels) {
+                IdCoverageAccumulator accumulator(coverages);
+                for (size_t s = 0; s < pixel.weights.size(); s++) {
+                    accumulator.begin_sample(pixel.weights[s]);
+                    for (uint32_t i = pixel.depth_offsets[s]; i < pixel.depth_offsets[s + 1]; i++)
+                        accumulator.add_depth_sample(pixel.depth_samples[i].id,
+                                                     pixel.depth_samples[i].opacity);
+                    accumulator.end_sample();
+                }
+                sink(accumulator.finish());
+            }
+        }));
+    }
+}
+
+///////////////////////////////////////////////
+//
+//      Output
+//
+///////////////////////////////////////////////
+
+static bool write_json(const char* path, const std::vector<BenchmarkResult>& results) {
+    FILE* f = fopen(path, "w");
+    if (!f)
+        return false;
+    fprintf(f, "{\n  \"repeats\": %d,\n  \"benchmarks\": [\n", BENCHMARK_REPEATS);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult& r = results[i];
+        fprintf(f,
+                "    {\"name\": \"%s\", \"ops_per_repeat\": %llu, \"min_ns_per_op\": %.3f, "
+                "\"median_ns_per_op\": %.3f}%s\n",
+                r.name.c_str(), (unsigned long long)r.ops_per_repeat, r.min_ns, r.median_ns,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+int main(int argc, char** argv) {
+    const char* json_path = nullptr;
+    std::string filter;
+    double min_time = 0.1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            min_time = atof(argv[++i]);
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--json <file>] [--filter <substring>] [--min-time <seconds>]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%-48s %12s %12s %14s\n", "benchmark", "min ns/op", "median ns/op", "ops/repeat");
+    std::vector<BenchmarkResult> results;
+    name_benchmarks(filter, min_time, results);
+    manifest_benchmarks(filter, min_time, results);
+    coverage_benchmarks(filter, min_time, results);
+
+    if (json_path && !write_json(json_path, results)) {
+        fprintf(stderr, "could not write %s\n", json_path);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "cryptomatte_core.h"
+
+void write_manifest_to_string(const ManifestMap& map, std::string& manf_string,
+                              size_t max_entries) {
+    ManifestMap::const_iterator map_it = map.begin();
+    const size_t metadata_entries = std::min(map.size(), max_entries);
+
+    manf_string.append("{");
+    std::string pair;
+    pair.reserve(MAX_STRING_LENGTH);
+    for (size_t i = 0; i < metadata_entries; i++) {
+        const std::string& name = map_it->first;
+        float hash_value = map_it->second;
+        ++map_it;
+
+        uint32_t float_bits;
+        std::memcpy(&float_bits, &hash_value, 4);
+        char hex_chars[9];
+        sprintf(hex_chars, "%08x", float_bits);
+
+        pair.clear();
+        pair.append("\"");
+        for (size_t j = 0; j < name.length(); j++) {
+            // append the name, char by char
+            const char c = name.at(j);
+            if (c == '"' || c == '\\' || c == '/')
+                pair += "\\";
+            pair += c;
+        }
+        pair.append("\":\"");
+        pair.append(hex_chars);
+        pair.append("\"");
+        if (i < metadata_entries - 1)
+            pair.append(",");
+        manf_string.append(pair);
+    }
+    manf_string.append("}");
+}
+
+void write_manifest_to_binary(const ManifestMap& map, std::string& manf_string) {
+    std::vector<ManifestEntry> entries(map.size());
+    size_t i = 0;
+    for (const auto& name_hash : map) {
+        entries[i].name = name_hash.first;
+        std::memcpy(&entries[i].hash, &name_hash.second, 4);
+        i++;
+    }
+    encode_binary_manifest(entries, manf_string);
+}
@@ -0,0 +1,512 @@
+#pragma once
+/*
+The parts of cryptomatte with no Arnold dependency: name processing, hashing, manifest containers
+and serializers, and the coverage accumulator and ranker the filter and drivers use. Built as the
+cryptomatte_core library, which the plugin links, so these can be tested and profiled without a
+render.
+*/
+
+#include "MurmurHash3.h"
+#include "manifest_binary.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using ManifestMap = std::map<std::string, float>;
+
+using StringVector = std::vector<std::string>;
+
+// System values
+#define MAX_STRING_LENGTH 2048
+#define MAX_CRYPTOMATTE_DEPTH 99
+#define MAX_HIERARCHY_LEVELS 16
+#define CRYPTO_MAX_MANIFEST_ENTRIES 100000
+
+// For per thread data that must not share cache lines
+// clang-format off
+#define CACHE_LINE 64
+#if defined(_WIN32) || defined(_MSC_VER)
+#define CACHE_ALIGN __declspec(align(CACHE_LINE))
+#else
+#define CACHE_ALIGN __attribute__((aligned(CACHE_LINE)))
+#endif
+// clang-format on
+
+// Name processing flags
+using CryptoNameFlag = uint8_t;
+
+// clang-format off
+#define CRYPTO_NAME_NONE          0x00
+#define CRYPTO_NAME_STRIP_NS      0x01 /* remove "namespace" */
+#define CRYPTO_NAME_MAYA          0x02 /* mtoa style */
+#define CRYPTO_NAME_PATHS         0x04 /* path based (starting with "/") */
+#define CRYPTO_NAME_OBJPATHPIPES  0x08 /* pipes are considered in paths (c4d) */
+#define CRYPTO_NAME_MATPATHPIPES  0x10 /* sitoa, old-c4d style */
+#define CRYPTO_NAME_LEGACY        0x20 /* sitoa, old-c4d style */
+#define CRYPTO_NAME_ALL           CryptoNameFlag(-1)
+// clang-format on
+
+///////////////////////////////////////////////
+//
+//      String processing
+//
+///////////////////////////////////////////////
+
+inline void safe_copy_to_buffer(char buffer[MAX_STRING_LENGTH], const char* c) {
+    if (c)
+        strncpy(buffer, c, std::min(strlen(c), (size_t)MAX_STRING_LENGTH - 1));
+    else
+        buffer[0] = '\0';
+}
+
+inline bool cstr_empty(const char* c) { return !c || c[0] == '\0'; }
+
+///////////////////////////////////////////////
+//
+//      Name processing
+//
+///////////////////////////////////////////////
+
+inline bool sitoa_pointcloud_instance_handling(const char* obj_full_name,
+                                               char obj_name_out[MAX_STRING_LENGTH],
+                                               uint8_t pcloud_verbosity) {
+    if (pcloud_verbosity == 0 || !strstr(obj_full_name, ".SItoA.Instance.")) {
+        return false;
+    }
+    char obj_name[MAX_STRING_LENGTH];
+    safe_copy_to_buffer(obj_name, obj_full_name);
+
+    char* instance_start = strstr(obj_name, ".SItoA.Instance.");
+    if (!instance_start)
+        return false;
+
+    char* space = strstr(instance_start, " ");
+    if (!space)
+        return false;
+
+    char* instance_name = &space[1];
+    char* obj_suffix2 = strstr(instance_name, ".SItoA.");
+    if (!obj_suffix2)
+        return false;
+    obj_suffix2[0] = '\0'; // strip the suffix
+    size_t chars_to_copy = strlen(instance_name);
+    if (chars_to_copy >= MAX_STRING_LENGTH || chars_to_copy == 0) {
+        return false;
+    }
+    if (pcloud_verbosity == 2) {
+        char* frame_numbers = &instance_start[16]; // 16 chars in ".SItoA.Instance.", this gets us
+                                                   // to the first number
+        char* instance_ID = strstr(frame_numbers, ".");
+        if (!instance_ID)
+            return false;
+        char* instance_ID_end = strstr(instance_ID, " ");
+        if (!instance_ID_end)
+            return false;
+        instance_ID_end[0] = '\0';
+        size_t ID_len = strlen(instance_ID);
+        strncpy(&instance_name[chars_to_copy], instance_ID, ID_len);
+        chars_to_copy += ID_len;
+    }
+
+    strncpy(obj_name_out, instance_name, chars_to_copy);
+    return true;
+}
+
+inline void mtoa_strip_namespaces(const char* obj_full_name, char obj_name_out[MAX_STRING_LENGTH]) {
+    char* to = obj_name_out;
+    size_t len = 0;
+    size_t sublen = 0;
+    const char* from = obj_full_name;
+    const char* end = from + strlen(obj_full_name);
+    const char* found = strchr(from, '|');
+    const char* sep = nullptr;
+
+    while (found) {
+        sep = strchr(from, ':');
+        if (sep && sep < found) {
+            from = sep + 1;
+        }
+        sublen = found - from;
+        memmove(to, from, sublen);
+        to[sublen] = '|';
+
+        len += sublen + 1;
+        to += sublen + 1;
+        from = found + 1;
+
+        found = strchr(from, '|');
+    }
+
+    sep = strchr(from, ':');
+    if (sep && sep < end) {
+        from = sep + 1;
+    }
+    sublen = end - from;
+    memmove(to, from, sublen);
+    to[sublen] = '\0';
+}
+
+inline void get_clean_object_name(const char* obj_full_name, char obj_name_out[MAX_STRING_LENGTH],
+                                  char ns_name_out[MAX_STRING_LENGTH], CryptoNameFlag flags,
+                                  uint8_t pcloud_verbosity) {
+    if (flags == CRYPTO_NAME_NONE) {
+        memmove(obj_name_out, obj_full_name, strlen(obj_full_name));
+        strcpy(ns_name_out, "default");
+        return;
+    }
+
+    char ns_name[MAX_STRING_LENGTH] = "";
+    safe_copy_to_buffer(ns_name, obj_full_name);
+    bool obj_already_done = false;
+
+    const bool do_strip_ns = (flags & CRYPTO_NAME_STRIP_NS) != 0;
+    const bool do_maya = (flags & CRYPTO_NAME_MAYA) != 0;
+    const bool do_paths = (flags & CRYPTO_NAME_PATHS) != 0;
+    const bool do_path_pipe = (flags & CRYPTO_NAME_OBJPATHPIPES) != 0;
+    const bool do_legacy = (flags & CRYPTO_NAME_LEGACY) != 0;
+
+    const uint8_t mode_maya = 0;
+    const uint8_t mode_pathstyle = 1;
+    const uint8_t mode_si = 2;
+    const uint8_t mode_c4d = 3;
+
+    uint8_t mode = mode_maya;
+    if (ns_name[0] == '/') {
+        // Path-style: /obj/hierarchy|obj_cache_hierarchy
+        // For instance: /Null/Sphere
+        //               /Null/Cloner|Null/Sphere1
+        mode = mode_pathstyle;
+    } else if (do_legacy && strncmp(ns_name, "c4d|", 4) == 0) {
+        // C4DtoA prior 2.3: c4d|obj_hierarchy|...
+        mode = mode_c4d;
+        const char* nsp = ns_name + 4;
+        size_t len = strlen(nsp);
+        memmove(ns_name, nsp, len);
+        ns_name[len] = '\0';
+    } else if (do_legacy && strstr(ns_name, ".SItoA.")) {
+        // in Softimage mode
+        mode = mode_si;
+        char* sitoa_suffix = strstr(ns_name, ".SItoA.");
+        obj_already_done = sitoa_pointcloud_instance_handling(obj_full_name, obj_name_out,
+                                                              pcloud_verbosity);
+        sitoa_suffix[0] = '\0'; // cut off everything after the start of .SItoA
+    } else {
+        mode = mode_maya;
+    }
+
+    char* nsp_separator = nullptr;
+    if (mode == mode_c4d && do_legacy) {
+        nsp_separator = strrchr(ns_name, '|');
+    } else if (mode == mode_pathstyle && do_paths) {
+        char* lastPipe = do_path_pipe ? strrchr(ns_name, '|') : nullptr;
+        char* lastSlash = strrchr(ns_name, '/');
+        nsp_separator = lastSlash > lastPipe ? lastSlash : lastPipe;
+    } else if (mode == mode_si && do_legacy) {
+        nsp_separator = strchr(ns_name, '.');
+    } else if (mode == mode_maya && do_maya)
+        nsp_separator = strchr(ns_name, ':');
+
+    if (!obj_already_done) {
+        if (!nsp_separator || !do_strip_ns) { // use whole name
+            memmove(obj_name_out, ns_name, strlen(ns_name));
+        } else if (mode == mode_maya) { // maya
+            mtoa_strip_namespaces(ns_name, obj_name_out);
+        } else { // take everything right of sep
+            char* obj_name_start = nsp_separator + 1;
+            memmove(obj_name_out, obj_name_start, strlen(obj_name_start));
+        }
+    }
+
+    if (nsp_separator) {
+        nsp_separator[0] = '\0';
+        strcpy(ns_name_out, ns_name); // copy namespace
+    } else {
+        strcpy(ns_name_out, "default");
+    }
+}
+
+inline uint8_t get_hierarchy_levels(const char* obj_full_name, uint8_t num_levels,
+                                    size_t level_lengths[MAX_HIERARCHY_LEVELS]) {
+    // Lengths of the names of the first num_levels levels of a hierarchical object name, all
+    // from one pass over it. Levels are split at slashes and pipes, so /set/building/window is
+    // /set at level 1 and /set/building at level 2, and |grp|mesh (maya) or c4d|Null|Sphere
+    // work alike. Levels below the object are the whole name. Returns the levels in the name.
+    num_levels = std::min(num_levels, (uint8_t)MAX_HIERARCHY_LEVELS);
+    uint8_t found = 0;
+    const char* c = obj_full_name;
+    while (*c == '/' || *c == '|')
+        c++;
+    while (*c && found < num_levels) {
+        while (*c && *c != '/' && *c != '|')
+            c++;
+        level_lengths[found++] = c - obj_full_name;
+        while (*c == '/' || *c == '|')
+            c++;
+    }
+    const uint8_t levels_in_name = found;
+    const size_t full_length = strlen(obj_full_name);
+    for (; found < num_levels; found++)
+        level_lengths[found] = full_length;
+    return levels_in_name;
+}
+
+inline void get_clean_material_name(const char* mat_full_name, char mat_name_out[MAX_STRING_LENGTH],
+                                    CryptoNameFlag flags) {
+    safe_copy_to_buffer(mat_name_out, mat_full_name);
+    if (flags == CRYPTO_NAME_NONE)
+        return;
+
+    const bool do_strip_ns = (flags & CRYPTO_NAME_STRIP_NS) != 0;
+    const bool do_maya = (flags & CRYPTO_NAME_MAYA) != 0;
+    const bool do_paths = (flags & CRYPTO_NAME_PATHS) != 0;
+    const bool do_strip_pipes = (flags & CRYPTO_NAME_MATPATHPIPES) != 0;
+    const bool do_legacy = (flags & CRYPTO_NAME_LEGACY) != 0;
+
+    // Path Style Names /my/mat/name|root_node_name
+    if (do_paths && mat_name_out[0] == '/') {
+        char* mat_name = do_strip_pipes ? strtok(mat_name_out, "|") : nullptr;
+        mat_name = mat_name ? mat_name : mat_name_out;
+        if (do_strip_ns) {
+            char* ns_separator = strrchr(mat_name, '/');
+            if (ns_separator)
+                mat_name = ns_separator + 1;
+        }
+        if (mat_name != mat_name_out)
+            memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
+        return;
+    }
+
+    // C4DtoA prior 2.3: c4d|mat_name|root_node_name
+    if (do_legacy) {
+        if (strncmp(mat_name_out, "c4d|", 4) == 0) {
+            char* mat_name = strtok(mat_name_out + 4, "|");
+            if (mat_name)
+                memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
+            return;
+        }
+    }
+
+    // For maya, you get something simpler, like namespace:my_material_sg.
+    if (do_maya) {
+        char* ns_separator = strchr(mat_name_out, ':');
+        if (do_strip_ns && ns_separator) {
+            ns_separator[0] = '\0';
+            char* mat_name = ns_separator + 1;
+            memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
+            return;
+        }
+    }
+
+    // Softimage: Sources.Materials.myLibraryName.myMatName.Standard_Mattes.uBasic.SITOA.25000....
+    if (do_legacy) {
+        char* mat_postfix = strstr(mat_name_out, ".SItoA.");
+        if (mat_postfix) {
+            char* mat_name = mat_name_out;
+            mat_postfix[0] = '\0';
+
+            char* mat_shader_name = strrchr(mat_name, '.');
+            if (mat_shader_name)
+                mat_shader_name[0] = '\0';
+
+            char* standard_mattes = strstr(mat_name, ".Standard_Mattes");
+            if (standard_mattes)
+                standard_mattes[0] = '\0';
+
+            const char* prefix = "Sources.Materials.";
+            char* mat_prefix_separator = strstr(mat_name, prefix);
+            if (mat_prefix_separator)
+                mat_name = mat_prefix_separator + strlen(prefix);
+
+            char* nsp_separator = strchr(mat_name, '.');
+            if (do_strip_ns && nsp_separator) {
+                nsp_separator[0] = '\0';
+                mat_name = nsp_separator + 1;
+            }
+            if (mat_name != mat_name_out)
+                memmove(mat_name_out, mat_name, strlen(mat_name) + 1);
+            return;
+        }
+    }
+}
+
+inline float hash_to_float(uint32_t hash) {
+    // if all exponent bits are 0 (subnormals, +zero, -zero) set exponent to 1
+    // if all exponent bits are 1 (NaNs, +inf, -inf) set exponent to 254
+    uint32_t exponent = hash >> 23 & 255; // extract exponent (8 bits)
+    if (exponent == 0 || exponent == 255)
+        hash ^= 1 << 23; // toggle bit
+    float f;
+    std::memcpy(&f, &hash, 4);
+    return f;
+}
+
+inline float hash_name_id(const char* name, size_t length) {
+    uint32_t m3hash = 0;
+    MurmurHash3_x86_32(name, (uint32_t)length, 0, &m3hash);
+    return hash_to_float(m3hash);
+}
+
+inline float hash_name_id(const char* name) { return hash_name_id(name, strlen(name)); }
+
+inline void hash_name_rgb(const char* name, float rgb[3]) {
+    // This puts the float ID into the red channel, and the human-readable
+    // versions into the G and B channels.
+    uint32_t m3hash = 0;
+    MurmurHash3_x86_32(name, (uint32_t)strlen(name), 0, &m3hash);
+    rgb[0] = hash_to_float(m3hash);
+    rgb[1] = ((float)((m3hash << 8)) / (float)std::numeric_limits<uint32_t>::max());
+    rgb[2] = ((float)((m3hash << 16)) / (float)std::numeric_limits<uint32_t>::max());
+}
+
+///////////////////////////////////////////////
+//
+//      Manifests
+//
+///////////////////////////////////////////////
+
+inline void compute_metadata_ID(char id_buffer[8], const char* cryptomatte_name) {
+    const float id = hash_name_id(cryptomatte_name);
+    uint32_t float_bits;
+    std::memcpy(&float_bits, &id, 4);
+    char hex_chars[9];
+    sprintf(hex_chars, "%08x", float_bits);
+    strncpy(id_buffer, hex_chars, 7);
+    id_buffer[7] = '\0';
+}
+
+inline void add_hash_to_map(const char* c_str, ManifestMap& md_map) {
+    if (cstr_empty(c_str))
+        return;
+    std::string name_string = std::string(c_str);
+    if (md_map.count(name_string) == 0)
+        md_map[name_string] = hash_name_id(c_str);
+}
+
+// JSON manifests, for EXR metadata, of the first max_entries names of the map.
+void write_manifest_to_string(const ManifestMap& map, std::string& manf_string,
+                              size_t max_entries = CRYPTO_MAX_MANIFEST_ENTRIES);
+
+// Binary manifests (see manifest_binary.h). No entry limit, unlike JSON, as binary manifests are
+// only ever sidecar files.
+void write_manifest_to_binary(const ManifestMap& map, std::string& manf_string);
+
+///////////////////////////////////////////////
+//
+//      ID coverage
+//
+///////////////////////////////////////////////
+
+struct IdCoverage {
+    float id;
+    float coverage;
+};
+
+inline void id_preview_color(float id, float& g, float& b) {
+    // The human readable colors of hash_name_rgb, from the bits of the float ID. These are the
+    // bits of the hash, except for bit 23 of the few hashes hash_to_float changes.
+    uint32_t bits;
+    std::memcpy(&bits, &id, 4);
+    g = (float)(bits << 8) / (float)std::numeric_limits<uint32_t>::max();
+    b = (float)(bits << 16) / (float)std::numeric_limits<uint32_t>::max();
+}
+
+inline void add_id_coverage(std::vector<IdCoverage>& coverages, float id, float weight) {
+    // pixels hold few IDs, a linear search beats a map
+    for (IdCoverage& coverage : coverages) {
+        if (coverage.id == id) {
+            coverage.coverage += weight;
+            return;
+        }
+    }
+    coverages.push_back({id, weight});
+}
+
+// The coverage of each ID of a pixel, from its camera samples, each made of depth samples
+// composited front to back by opacity. For every camera sample call begin_sample, then
+// add_depth_sample for each of its depth samples, then end_sample. finish normalizes the
+// coverages and sorts them largest first. Given a preview RGBA, also makes the legacy preview
+// color, (0, g, b) of each ID composited by opacity, over whatever the RGBA held.
+class IdCoverageAccumulator {
+public:
+    explicit IdCoverageAccumulator(std::vector<IdCoverage>& coverages, float* preview = nullptr)
+        : coverages(coverages), preview(preview) {
+        coverages.clear();
+        if (preview)
+            std::fill(preview, preview + 4, 0.0f);
+    }
+
+    void begin_sample(float weight) {
+        sample_weight = weight;
+        quota = weight;
+        transparency_weight = 1.0f;
+        last_id = 0.0f;
+        total_weight += weight;
+    }
+
+    // Returns the weight the depth sample's ID was given.
+    float add_depth_sample(float id, float opacity) {
+        const float weight = opacity * transparency_weight * sample_weight;
+        // so if the current sub sample is 80% opaque, it means 20% of the weight will remain
+        // for the next subsample
+        transparency_weight *= (1.0f - opacity);
+        quota -= weight;
+        last_id = id;
+        add_id_coverage(coverages, id, weight);
+        if (preview) {
+            float g, b;
+            id_preview_color(id, g, b);
+            preview[1] += g * weight;
+            preview[2] += b * weight;
+            preview[3] += weight;
+        }
+        return weight;
+    }
+
+    void end_sample() {
+        // the remaining values gets allocated to the last sample
+        if (quota > 0.0f)
+            add_id_coverage(coverages, last_id, quota);
+    }
+
+    // Returns the total weight of the samples, which the coverages were divided by.
+    float finish() {
+        if (total_weight > 0.0f) {
+            for (IdCoverage& coverage : coverages)
+                coverage.coverage /= total_weight;
+            if (preview)
+                for (int i = 1; i < 4; i++)
+                    preview[i] /= total_weight;
+        }
+        std::sort(coverages.begin(), coverages.end(), [](const IdCoverage& a, const IdCoverage& b) {
+            return a.coverage > b.coverage;
+        });
+        return total_weight;
+    }
+
+private:
+    std::vector<IdCoverage>& coverages;
+    float* preview;
+    float total_weight = 0.0f;
+    float sample_weight = 0.0f;
+    float quota = 0.0f;
+    float transparency_weight = 1.0f;
+    float last_id = 0.0f;
+};
+
+// Writes the ranks of a pixel, (ID, coverage) pairs largest first, to pixel_floats floats. Ranks
+// beyond the pixel's IDs are zeroed, so that a bucket rendered again leaves none of the IDs of
+// its earlier pass.
+inline void write_pixel_ranks(const std::vector<IdCoverage>& coverages, int depth, float* ranks,
+                              int pixel_floats) {
+    std::fill(ranks, ranks + pixel_floats, 0.0f);
+    const size_t num_ranks = std::min(coverages.size(), (size_t)depth);
+    for (size_t rank = 0; rank < num_ranks; rank++) {
+        ranks[rank * 2] = coverages[rank].id;
+        ranks[rank * 2 + 1] = coverages[rank].coverage;
+    }
+}
@@ -0,0 +1,470 @@
+/*
+Writes cryptomattes to EXR files by itself, instead of through driver_exr.
+
+It is a raw driver, given the samples of each bucket, and ranks the IDs of every cryptomatte in
+one pass over them. A cryptomatte is then a single output of its ID AOV, with no rank outputs or
+rank filters, which setup makes of the cryptomatte outputs to this driver:
+
+    crypto_object RGB gaussian_filter my_cryptomatte_exr
+
+becomes
+
+    crypto_object_id FLOAT gaussian_filter my_cryptomatte_exr crypto_object
+
+The output's filter type and width are used for the ranks. The file has the rank layers,
+crypto_object00, crypto_object01..., in full float, with the cryptomatte metadata setup adds to
+custom_attributes in its header. Only cryptomatte outputs can be written.
+
+With deep on, cryptomatte_depth is ignored and each pixel stores all of its IDs, as a deep
+scanline EXR with one part per cryptomatte. A part is named after the cryptomatte and has the
+channels id and coverage, each pixel having a sample per ID, largest coverage first. Deep readers
+need depths, so Z and ZBack are the sample's rank, 0 for the largest coverage, rather than a
+distance from the camera. The part's cryptomatte metadata says so, with cryptomatte/<id>/deep_depth
+set to "rank". Pixels with no IDs take no space, so file size and write time follow the IDs in
+the frame rather than its worst pixel. Deep files have no preview channels.
+
+With multipart on, each cryptomatte is written to its own part of the file instead, named after
+it, with its ranks and preview channels and only its own cryptomatte metadata. Readers can then
+load one cryptomatte without decompressing the others. Deep files are always multi-part.
+
+With channel_layout uint_half, IDs are stored as UINT channels of their hash bits and coverage and
+preview as HALF, and setup writes "conversion none" in the metadata.
+*/
+
+#include "cryptomatte.h"
+#include "exr.h"
+#include "filters.h"
+#include "output_spec.h"
+#include <ai.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+AI_DRIVER_NODE_EXPORT_METHODS(CryptomatteExrDriverMtd);
+
+// lossless compressions only, IDs don't survive lossy ones
+static const char* exrCompressionNames[] = {"none", "zip", "zips", "piz", nullptr};
+
+// IDs and coverage in memory are always float, as ranked
+static EXRPixelType id_type(int layout) {
+    return layout == CRYPTO_CHANNELS_UINT_HALF ? EXR_UINT : EXR_FLOAT;
+}
+
+static EXRPixelType coverage_type(int layout) {
+    return layout == CRYPTO_CHANNELS_UINT_HALF ? EXR_HALF : EXR_FLOAT;
+}
+
+struct CryptomatteExrLayer {
+    std::string name;
+    AtString id_aov;
+    FilterFunc filter_func;
+    float width;
+    std::vector<float> ranks;   // per pixel, ID and coverage of every rank, in whole rank layers
+    std::vector<float> preview; // per pixel RGBA, with preview channels
+    // deep only
+    std::vector<unsigned int> sample_counts;   // per pixel, the number of its IDs
+    std::vector<const float*> sample_pointers; // per pixel, its first ID then first coverage
+};
+
+struct CryptomatteExrDriverData {
+    AtBBox2 display_window;
+    AtBBox2 data_window;
+    int width = 0;
+    int height = 0;
+    int depth = 0;           // ranks kept per pixel
+    int pixel_floats = 0;    // per pixel of the ranks of a layer
+    bool preview = false;
+    bool deep = false;
+    int channel_layout = CRYPTO_CHANNELS_FLOAT;
+    std::vector<CryptomatteExrLayer> layers;
+    // deep samples of every layer, in a block per bucket, (id, coverage) pairs
+    std::vector<std::unique_ptr<float[]>> sample_blocks;
+    AtCritSec sample_blocks_lock;
+};
+
+node_parameters {
+    AiParameterStr("filename", "cryptomatte.exr");
+    AiParameterEnum("compression", 1, exrCompressionNames);
+    AiParameterInt("threads", 0);
+    AiParameterInt("cryptomatte_depth", CRYPTO_DEPTH_DEFAULT);
+    AiParameterBool("preview_channels", CRYPTO_PREVIEWINEXR_DEFAULT);
+    AiParameterBool("deep", false);
+    AiParameterBool("multipart", false);
+    AiParameterEnum("channel_layout", CRYPTO_CHANNELLAYOUT_DEFAULT, channelLayoutEnumNames);
+    AiParameterArray("custom_attributes", AiArray(0, 1, AI_TYPE_STRING));
+}
+
+node_initialize {
+    static const char* required_aovs[] = {"FLOAT Z", "RGB opacity", nullptr};
+    // depth samples, the IDs behind transparent surfaces are composited by opacity
+    AiRawDriverInitialize(node, required_aovs, true);
+    CryptomatteExrDriverData* data = new CryptomatteExrDriverData();
+    AiCritSecInit(&data->sample_blocks_lock);
+    AiNodeSetLocalData(node, data);
+}
+
+node_update {}
+
+node_finish {
+    CryptomatteExrDriverData* data = (CryptomatteExrDriverData*)AiNodeGetLocalData(node);
+    AiCritSecClose(&data->sample_blocks_lock);
+    delete data;
+    AiNodeSetLocalData(node, nullptr);
+}
+
+driver_supports_pixel_type { return pixel_type == AI_TYPE_FLOAT; }
+
+driver_extension {
+    static const char* extensions[] = {"exr", nullptr};
+    return extensions;
+}
+
+static void find_layers(AtNode* node, CryptomatteExrDriverData* data) {
+    // The cryptomattes are the outputs to this driver, whose filters and names are only in the
+    // options' outputs.
+    const AtArray* outputs = AiNodeGetArray(AiUniverseGetOptions(), "outputs");
+    const uint32_t num_outputs = outputs ? AiArrayGetNumElements(outputs) : 0;
+    const std::string driver_name = AiNodeGetName(node);
+    OutputSpec spec;
+    for (uint32_t i = 0; i < num_outputs; i++) {
+        if (!parse_output_spec(AiArrayGetStr(outputs, i), spec) || spec.driver != driver_name)
+            continue;
+        if (!is_layer_output(spec)) {
+            AiMsgWarning("[cryptomatte_exr] %s only writes cryptomattes, ignoring output %s",
+                         driver_name.c_str(), AiArrayGetStr(outputs, i).c_str());
+            continue;
+        }
+        bool duplicate = false; // the same cryptomatte from another camera
+        for (const CryptomatteExrLayer& layer : data->layers)
+            duplicate = duplicate || layer.name == spec.layer;
+        if (duplicate)
+            continue;
+
+        CryptomatteExrLayer layer;
+        layer.name = spec.layer;
+        layer.id_aov = AtString(spec.aov.c_str());
+        char filter_type[128];
+        layer.width = 2.0f;
+        get_original_filter(spec.filter, filter_type, layer.width);
+        const int filter = filter_enum(filter_type);
+        layer.filter_func = filter_function(filter);
+        if (filter == p_filter_box)
+            layer.width = 1.0f;
+        data->layers.push_back(layer);
+    }
+}
+
+driver_open {
+    CryptomatteExrDriverData* data = (CryptomatteExrDriverData*)AiNodeGetLocalData(node);
+    data->display_window = display_window;
+    data->data_window = data_window;
+    data->width = data_window.maxx - data_window.minx + 1;
+    data->height = data_window.maxy - data_window.miny + 1;
+    data->depth =
+        std::min(std::max(AiNodeGetInt(node, "cryptomatte_depth"), 1), MAX_CRYPTOMATTE_DEPTH);
+    data->pixel_floats = (data->depth + 1) / 2 * 4;
+    data->deep = AiNodeGetBool(node, "deep");
+    data->channel_layout = AiNodeGetInt(node, "channel_layout");
+    data->preview = AiNodeGetBool(node, "preview_channels") && !data->deep;
+
+    data->layers.clear();
+    data->sample_blocks.clear();
+    find_layers(node, data);
+    const size_t num_pixels = (size_t)data->width * data->height;
+    for (CryptomatteExrLayer& layer : data->layers) {
+        if (data->deep) {
+            layer.sample_counts.assign(num_pixels, 0);
+            layer.sample_pointers.assign(num_pixels * 2, nullptr);
+            continue;
+        }
+        layer.ranks.assign(num_pixels * data->pixel_floats, 0.0f);
+        if (data->preview)
+            layer.preview.assign(num_pixels * 4, 0.0f);
+    }
+}
+
+driver_needs_bucket { return true; }
+
+driver_prepare_bucket {}
+
+static void accumulate_layer(AtAOVSampleIterator* sample_iterator, CryptomatteExrLayer& layer,
+                             int x, int y, std::vector<IdCoverage>& coverages,
+                             AtRGBA* preview = nullptr) {
+    AiAOVSampleIteratorInitPixel(sample_iterator, x, y);
+    const AtString id_aov = layer.id_aov;
+    accumulate_id_coverage(
+        sample_iterator, layer.filter_func, layer.width,
+        [id_aov](AtAOVSampleIterator* it) { return AiAOVSampleIteratorGetAOVFlt(it, id_aov); },
+        coverages, preview);
+}
+
+static void process_deep_bucket(CryptomatteExrDriverData* data,
+                                AtAOVSampleIterator* sample_iterator, int bucket_xo,
+                                int bucket_yo, int bucket_size_x, int bucket_size_y) {
+    // The pairs of the whole bucket are gathered first, then copied to a block of their exact
+    // size, which the pixels' sample pointers point into.
+    std::vector<IdCoverage> coverages;
+    std::vector<IdCoverage> bucket_samples;
+    for (int y = bucket_yo; y < bucket_yo + bucket_size_y; y++) {
+        for (int x = bucket_xo; x < bucket_xo + bucket_size_x; x++) {
+            const size_t pixel = (size_t)(y - data->data_window.miny) * data->width +
+                                 (x - data->data_window.minx);
+            for (CryptomatteExrLayer& layer : data->layers) {
+                accumulate_layer(sample_iterator, layer, x, y, coverages);
+                layer.sample_counts[pixel] = (unsigned int)coverages.size();
+                bucket_samples.insert(bucket_samples.end(), coverages.begin(), coverages.end());
+            }
+        }
+    }
+    if (bucket_samples.empty())
+        return;
+
+    float* block = new float[bucket_samples.size() * 2];
+    memcpy(block, bucket_samples.data(), bucket_samples.size() * sizeof(IdCoverage));
+    AiCritSecEnter(&data->sample_blocks_lock);
+    data->sample_blocks.emplace_back(block);
+    AiCritSecLeave(&data->sample_blocks_lock);
+
+    // same order as above
+    for (int y = bucket_yo; y < bucket_yo + bucket_size_y; y++) {
+        for (int x = bucket_xo; x < bucket_xo + bucket_size_x; x++) {
+            const size_t pixel = (size_t)(y - data->data_window.miny) * data->width +
+                                 (x - data->data_window.minx);
+            for (CryptomatteExrLayer& layer : data->layers) {
+                if (!layer.sample_counts[pixel])
+                    continue;
+                layer.sample_pointers[pixel * 2] = block;
+                layer.sample_pointers[pixel * 2 + 1] = block + 1;
+                block += layer.sample_counts[pixel] * 2;
+            }
+        }
+    }
+}
+
+driver_process_bucket {
+    // Buckets are processed concurrently, but write separate pixels. A bucket may be processed
+    // again without a driver_open, by progressive and IPR passes, so its pixels are overwritten.
+    CryptoTraceSpan span("filter_bucket");
+    CryptomatteExrDriverData* data = (CryptomatteExrDriverData*)AiNodeGetLocalData(node);
+    if (data->deep) {
+        process_deep_bucket(data, sample_iterator, bucket_xo, bucket_yo, bucket_size_x,
+                            bucket_size_y);
+        return;
+    }
+    std::vector<IdCoverage> coverages;
+    for (int y = bucket_yo; y < bucket_yo + bucket_size_y; y++) {
+        for (int x = bucket_xo; x < bucket_xo + bucket_size_x; x++) {
+            const size_t pixel = (size_t)(y - data->data_window.miny) * data->width +
+                                 (x - data->data_window.minx);
+            for (CryptomatteExrLayer& layer : data->layers) {
+                AtRGBA* preview =
+                    data->preview ? reinterpret_cast<AtRGBA*>(&layer.preview[pixel * 4]) : nullptr;
+                accumulate_layer(sample_iterator, layer, x, y, coverages, preview);
+
+                // over whatever an earlier pass over the bucket left
+                write_pixel_ranks(coverages, data->depth, &layer.ranks[pixel * data->pixel_floats],
+                                  data->pixel_floats);
+            }
+        }
+    }
+}
+
+driver_write_bucket {}
+
+static void get_attributes(const AtNode* node, std::vector<EXRAttribute>& attributes) {
+    // custom_attributes entries are "TYPE name value", the value running to the end.
+    const AtArray* custom_attributes = AiNodeGetArray(node, "custom_attributes");
+    const uint32_t num_attributes =
+        custom_attributes ? AiArrayGetNumElements(custom_attributes) : 0;
+    for (uint32_t i = 0; i < num_attributes; i++) {
+        const std::string entry = AiArrayGetStr(custom_attributes, i).c_str();
+        const size_t name_start = entry.find(' ');
+        const size_t value_start =
+            name_start == std::string::npos ? name_start : entry.find(' ', name_start + 1);
+        if (value_start == std::string::npos) {
+            AiMsgWarning("[cryptomatte_exr] malformed custom attribute: %s", entry.c_str());
+            continue;
+        }
+        EXRAttribute attribute;
+        attribute.type = entry.substr(0, name_start);
+        attribute.name = entry.substr(name_start + 1, value_start - name_start - 1);
+        attribute.value = entry.substr(value_start + 1);
+        if (attribute.type != "STRING" && attribute.type != "INT" && attribute.type != "FLOAT") {
+            AiMsgWarning("[cryptomatte_exr] unsupported custom attribute type: %s",
+                         entry.c_str());
+            continue;
+        }
+        attributes.push_back(attribute);
+    }
+}
+
+static void get_layer_attributes(const CryptomatteExrLayer& layer,
+                                 const std::vector<EXRAttribute>& attributes,
+                                 std::vector<EXRAttribute>& layer_attributes) {
+    // the attributes of one part, the layer's own cryptomatte metadata and anything that isn't
+    // cryptomatte metadata
+    char metadata_id[8];
+    compute_metadata_ID(metadata_id, layer.name.c_str());
+    const std::string own_prefix = std::string("cryptomatte/") + metadata_id + "/";
+    for (const EXRAttribute& attribute : attributes) {
+        if (attribute.name.compare(0, 12, "cryptomatte/") != 0 ||
+            attribute.name.compare(0, own_prefix.size(), own_prefix) == 0)
+            layer_attributes.push_back(attribute);
+    }
+}
+
+static void get_layer_channels(const CryptomatteExrDriverData* data,
+                               const CryptomatteExrLayer& layer,
+                               std::vector<EXRChannel>& channels) {
+    static const char* rgba[] = {".R", ".G", ".B", ".A"};
+    const size_t rank_xstride = data->pixel_floats * sizeof(float);
+    for (int rank_layer = 0; rank_layer < data->pixel_floats / 4; rank_layer++) {
+        char rank_name[8];
+        sprintf(rank_name, "%02d", rank_layer);
+        for (int c = 0; c < 4; c++) {
+            EXRChannel channel;
+            channel.name = layer.name + rank_name + rgba[c];
+            channel.pixels = &layer.ranks[rank_layer * 4 + c];
+            channel.xstride = rank_xstride;
+            channel.ystride = rank_xstride * data->width;
+            // R and B are IDs, G and A coverage
+            channel.type =
+                c % 2 ? coverage_type(data->channel_layout) : id_type(data->channel_layout);
+            channels.push_back(channel);
+        }
+    }
+    for (int c = 0; c < 4 && data->preview; c++) {
+        EXRChannel channel;
+        channel.name = layer.name + rgba[c];
+        channel.pixels = &layer.preview[c];
+        channel.xstride = 4 * sizeof(float);
+        channel.ystride = 4 * sizeof(float) * data->width;
+        channel.type = coverage_type(data->channel_layout);
+        channels.push_back(channel);
+    }
+}
+
+static void get_parts(const CryptomatteExrDriverData* data,
+                      const std::vector<EXRAttribute>& attributes, std::vector<EXRPart>& parts) {
+    for (const CryptomatteExrLayer& layer : data->layers) {
+        EXRPart part;
+        part.name = layer.name;
+        get_layer_channels(data, layer, part.channels);
+        get_layer_attributes(layer, attributes, part.attributes);
+        parts.push_back(part);
+    }
+}
+
+static void get_deep_parts(const CryptomatteExrDriverData* data,
+                           const std::vector<EXRAttribute>& attributes,
+                           std::vector<float>& ranks, const float*& ranks_start,
+                           std::vector<EXRDeepPart>& parts) {
+    // The depths of every pixel are the same ranks, 0, 1, 2..., so Z and ZBack read them from
+    // one pointer, ranks_start, with no strides between pixels.
+    static const char* channel_names[] = {"id", "coverage"};
+    unsigned int max_count = 0;
+    for (const CryptomatteExrLayer& layer : data->layers)
+        for (const unsigned int count : layer.sample_counts)
+            max_count = std::max(max_count, count);
+    ranks.resize(std::max(max_count, 1u));
+    for (size_t i = 0; i < ranks.size(); i++)
+        ranks[i] = (float)i;
+    ranks_start = ranks.data();
+
+    for (const CryptomatteExrLayer& layer : data->layers) {
+        EXRDeepPart part;
+        part.name = layer.name;
+        get_layer_attributes(layer, attributes, part.attributes);
+        char metadata_id[8];
+        compute_metadata_ID(metadata_id, layer.name.c_str());
+        EXRAttribute depth_attribute;
+        depth_attribute.type = "STRING";
+        depth_attribute.name = std::string("cryptomatte/") + metadata_id + "/deep_depth";
+        depth_attribute.value = "rank";
+        part.attributes.push_back(depth_attribute);
+        part.counts = layer.sample_counts.data();
+        for (int c = 0; c < 2; c++) {
+            EXRDeepChannel channel;
+            channel.name = channel_names[c];
+            channel.samples = &layer.sample_pointers[c];
+            channel.xstride = 2 * sizeof(const float*);
+            channel.ystride = 2 * sizeof(const float*) * data->width;
+            channel.sample_stride = sizeof(IdCoverage);
+            channel.type = c ? coverage_type(data->channel_layout) : id_type(data->channel_layout);
+            part.channels.push_back(channel);
+        }
+        for (const char* depth_name : {"Z", "ZBack"}) {
+            EXRDeepChannel channel;
+            channel.name = depth_name;
+            channel.samples = &ranks_start;
+            channel.xstride = 0;
+            channel.ystride = 0;
+            channel.sample_stride = sizeof(float);
+            part.channels.push_back(channel);
+        }
+        parts.push_back(part);
+    }
+}
+
+driver_close {
+    CryptomatteExrDriverData* data = (CryptomatteExrDriverData*)AiNodeGetLocalData(node);
+    if (data->layers.empty())
+        return;
+
+    std::vector<EXRAttribute> attributes;
+    get_attributes(node, attributes);
+
+    const EXRWindow display_window = {data->display_window.minx, data->display_window.miny,
+                                      data->display_window.maxx, data->display_window.maxy};
+    const EXRWindow data_window = {data->data_window.minx, data->data_window.miny,
+                                   data->data_window.maxx, data->data_window.maxy};
+    const AtString filename = AiNodeGetStr(node, "filename");
+    const AtEnum compressions =
+        AiParamGetEnum(AiNodeEntryLookUpParameter(AiNodeGetNodeEntry(node), "compression"));
+    const char* compression = AiEnumGetString(compressions, AiNodeGetInt(node, "compression"));
+
+    AiMsgInfo("[cryptomatte_exr] writing file, %s", filename.c_str());
+    const int threads = AiNodeGetInt(node, "threads");
+    std::string error;
+    bool written;
+    if (data->deep) {
+        std::vector<EXRDeepPart> parts;
+        std::vector<float> ranks;
+        const float* ranks_start = nullptr;
+        get_deep_parts(data, attributes, ranks, ranks_start, parts);
+        written = writeDeepEXR(filename.c_str(), display_window, data_window, parts, compression,
+                               threads, error);
+    } else if (AiNodeGetBool(node, "multipart")) {
+        std::vector<EXRPart> parts;
+        get_parts(data, attributes, parts);
+        written = writeMultiPartEXR(filename.c_str(), display_window, data_window, parts,
+                                    compression, threads, error);
+    } else {
+        std::vector<EXRChannel> channels;
+        for (const CryptomatteExrLayer& layer : data->layers)
+            get_layer_channels(data, layer, channels);
+        written = writeChannelsEXR(filename.c_str(), display_window, data_window, channels,
+                                   attributes, compression, threads, error);
+    }
+    if (!written)
+        AiMsgError("[cryptomatte_exr] could not write %s: %s", filename.c_str(), error.c_str());
+
+    for (CryptomatteExrLayer& layer : data->layers) {
+        std::vector<float>().swap(layer.ranks);
+        std::vector<float>().swap(layer.preview);
+        std::vector<unsigned int>().swap(layer.sample_counts);
+        std::vector<const float*>().swap(layer.sample_pointers);
+    }
+    data->sample_blocks.clear();
+}
+
+void registerCryptomatteExrDriver(AtNodeLib* node) {
+    node->methods = (AtNodeMethods*)CryptomatteExrDriverMtd;
+    node->output_type = AI_TYPE_NONE;
+    node->name = "cryptomatte_exr";
+    node->node_type = AI_NODE_DRIVER;
+    strcpy(node->version, AI_VERSION);
+}
@@ -1,9 +1,6 @@
 #include "filters.h"
 #include <ai.h>
-#include <algorithm>
 #include <cstring>
-#include <map>
-#include <string>
 #include <vector>
 
 ///////////////////////////////////////////////
@@ -14,19 +11,19 @@
 
 AI_FILTER_NODE_EXPORT_METHODS(cryptomatte_filter_mtd)
 
-static const AtString ats_opacity("opacity");
-
 enum cryptomatte_filterParams {
     p_width,
     p_rank,
     p_filter,
+    p_preview,
 };
 
 struct CryptomatteFilterData {
-    float (*filter_func)(AtVector2, float);
+    FilterFunc filter_func;
     float width;
     int rank;
     int filter;
+    bool preview;
 };
 
 node_parameters {
@@ -37,6 +34,7 @@ node_parameters {
     AiParameterFlt("width", 2.0);
     AiParameterInt("rank", -1);
     AiParameterEnum("filter", p_filter_gaussian, filterEnumNames);
+    AiParameterBool("preview", false);
 }
 
 void registerCryptomatteFilter(AtNodeLib* node) {
@@ -63,35 +61,17 @@ node_finish {
 
 node_update {
     const int rank = AiNodeGetInt(node, "rank");
-    if (rank < 0) 
+    const bool preview = AiNodeGetBool(node, "preview");
+    if (rank < 0 && !preview)
         AiMsgError("Cryptomatte not set up correctly, %s rank not set.", AiNodeGetName(node));
 
     CryptomatteFilterData* data = (CryptomatteFilterData*)AiNodeGetLocalData(node);
     data->width = AiNodeGetFlt(node, "width");
     data->rank = rank;
     data->filter = AiNodeGetInt(node, "filter");
+    data->preview = preview;
 
-    switch (data->filter) {
-    case p_filter_triangle:
-        data->filter_func = &triangle;
-        break;
-    case p_filter_blackman_harris:
-        data->filter_func = &blackman_harris;
-        break;
-    case p_filter_box:
-        data->filter_func = &box;
-        break;
-    case p_filter_disk:
-        data->filter_func = &disk;
-        break;
-    case p_filter_cone:
-        data->filter_func = &cone;
-        break;
-    case p_filter_gaussian:
-    default:
-        data->filter_func = &gaussian;
-        break;
-    }
+    data->filter_func = filter_function(data->filter);
 
     if (data->filter == p_filter_box) {
         AiFilterUpdate(node, 1.0f);
@@ -109,34 +89,28 @@ filter_output_type {
 
 ///////////////////////////////////////////////
 //
-//    Sample-Weight map Class and type definitions
+//    Filter proper
 //
 ///////////////////////////////////////////////
 
-class compareTail {
-public:
-    bool operator()(const std::pair<float, float> x, const std::pair<float, float> y) {
-        return x.second > y.second;
-    }
-};
-
-typedef std::map<float, float> sw_map_t;
-typedef std::map<float, float>::iterator sw_map_iterator_t;
-
-void write_to_samples_map(sw_map_t* vals, float hash, float sample_weight) {
-    (*vals)[hash] += sample_weight;
+static float filter_aov_id(AtAOVSampleIterator* iterator) {
+    return AiAOVSampleIteratorGetFlt(iterator);
 }
 
-///////////////////////////////////////////////
-//
-//    Filter proper
-//
-///////////////////////////////////////////////
-
 filter_pixel {
     AtRGBA* out_value = (AtRGBA*)data_out;
     *out_value = AI_RGBA_ZERO;
     CryptomatteFilterData* data = (CryptomatteFilterData*)AiNodeGetLocalData(node);
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->filter_pixels++;
+
+    std::vector<IdCoverage> coverages;
+    if (data->preview) {
+        // the legacy preview layer, as shading used to write it to an RGB AOV
+        accumulate_id_coverage(iterator, data->filter_func, data->width, filter_aov_id,
+                               coverages, out_value);
+        return;
+    }
 
     ///////////////////////////////////////////////
     //
@@ -164,86 +138,23 @@ filter_pixel {
     }
     AiAOVSampleIteratorReset(iterator);
 
-    ///////////////////////////////////////////////
-    //
-    //    Set up sample-weight maps and friends
-    //
-    ///////////////////////////////////////////////
-
-    sw_map_t vals;
-    float total_weight = 0.0f;
-
-    ///////////////////////////////////////////////
-    //
-    //    Iterate samples
-    //
-    ///////////////////////////////////////////////
-
-    while (AiAOVSampleIteratorGetNext(iterator)) {
-        float sample_weight =
-            data->filter_func(AiAOVSampleIteratorGetOffset(iterator), data->width);
-        if (sample_weight == 0.0f)
-            continue;
-        sample_weight *= AiAOVSampleIteratorGetInvDensity(iterator);
-
-        float iterative_transparency_weight = 1.0f;
-        float quota = sample_weight;
-        float sample_value = 0.0f;
-        total_weight += quota;
-
-        while (AiAOVSampleIteratorGetNextDepth(iterator)) {
-            const float sub_sample_opacity =
-                AiColorToGrey(AiAOVSampleIteratorGetAOVRGB(iterator, ats_opacity));
-            sample_value = AiAOVSampleIteratorGetFlt(iterator);
-            const float sub_sample_weight =
-                sub_sample_opacity * iterative_transparency_weight * sample_weight;
-
-            // so if the current sub sample is 80% opaque, it means 20% of the weight will remain
-            // for the next subsample
-            iterative_transparency_weight *= (1.0f - sub_sample_opacity);
-
-            quota -= sub_sample_weight;
-            write_to_samples_map(&vals, sample_value, sub_sample_weight);
-        }
-
-        if (quota > 0.0) {
-            // the remaining values gets allocated to the last sample
-            write_to_samples_map(&vals, sample_value, quota);
-        }
-    }
-
     ///////////////////////////////////////////////
     //
     //    Rank samples and make pixels
     //
     ///////////////////////////////////////////////
 
-    // rank 0 means if vals.size() does not contain 0, we can stop
-    // rank 2 means if vals.size() does not contain 2, we can stop
-    if (vals.size() <= data->rank)
-        return;
-
-    sw_map_iterator_t vals_iter;
-
-    std::vector<std::pair<float, float>> all_vals;
-    std::vector<std::pair<float, float>>::iterator all_vals_iter;
-
-    all_vals.reserve(vals.size());
-    for (vals_iter = vals.begin(); vals_iter != vals.end(); ++vals_iter)
-        all_vals.push_back(*vals_iter);
+    accumulate_id_coverage(iterator, data->filter_func, data->width, filter_aov_id, coverages);
 
-    std::sort(all_vals.begin(), all_vals.end(), compareTail());
+    // rank 0 means if coverages.size() does not contain 0, we can stop
+    // rank 2 means if coverages.size() does not contain 2, we can stop
+    if (coverages.size() <= data->rank)
+        return;
 
-    int iter = 0;
-    for (all_vals_iter = all_vals.begin(); all_vals_iter != all_vals.end(); ++all_vals_iter) {
-        if (iter == data->rank) {
-            out_value->r = all_vals_iter->first;
-            out_value->g = (all_vals_iter->second / total_weight);
-        } else if (iter == data->rank + 1) {
-            out_value->b = all_vals_iter->first;
-            out_value->a = (all_vals_iter->second / total_weight);
-            return;
-        }
-        iter++;
+    out_value->r = coverages[data->rank].id;
+    out_value->g = coverages[data->rank].coverage;
+    if (coverages.size() > data->rank + 1) {
+        out_value->b = coverages[data->rank + 1].id;
+        out_value->a = coverages[data->rank + 1].coverage;
     }
 }
@@ -6,11 +6,17 @@ typedef void (*NodeRegisterFunc)(AtNodeLib* node);
 void registerCryptomatte(AtNodeLib* node);
 void registerCryptomatteFilter(AtNodeLib* node);
 void registerCryptomatteManifestDriver(AtNodeLib* node);
+#ifdef CRYPTO_HAVE_OPENEXR
+void registerCryptomatteExrDriver(AtNodeLib* node);
+#endif
 
 static NodeRegisterFunc registry[] = {
     &registerCryptomatte,
     &registerCryptomatteFilter,
     &registerCryptomatteManifestDriver,
+#ifdef CRYPTO_HAVE_OPENEXR
+    &registerCryptomatteExrDriver,
+#endif
 };
 
 static const int num_nodes = sizeof(registry) / sizeof(NodeRegisterFunc);
@@ -18,7 +18,11 @@ node_update {}
 
 driver_supports_pixel_type { return true; }
 
-driver_open {}
+driver_open {
+    CryptomatteData* data = (CryptomatteData*)AiNodeGetLocalData(node);
+    if (data)
+        data->open_metadata();
+}
 
 driver_extension {
     static const char* extensions[] = {nullptr};
@@ -32,7 +36,7 @@ driver_write_bucket {}
 driver_close {
     CryptomatteData* data = (CryptomatteData*)AiNodeGetLocalData(node);
     if (data)
-        data->write_sidecar_manifests();
+        data->close_metadata();
 }
 
 node_finish {}
@@ -1,5 +1,4 @@
 #include "cryptomatte.h"
-#include "cryptomatte_tests.h"
 #include <ai.h>
 #include <cstring>
 #include <string>
@@ -8,6 +7,15 @@ AI_SHADER_NODE_EXPORT_METHODS(cryptomatteMtd)
 
 enum cryptomatteParams {
     p_sidecar_manifests,
+    p_async_manifests,
+    p_manifest_cache,
+    p_hit_only_manifests,
+    p_manifest_format,
+    p_manifest_compression,
+    p_channel_layout,
+    p_performance_stats,
+    p_performance_stats_json,
+    p_performance_trace,
     p_cryptomatte_depth,
     p_strip_obj_namespaces,
     p_strip_mat_namespaces,
@@ -28,10 +36,24 @@ enum cryptomatteParams {
     p_user_crypto_src_2,
     p_user_crypto_aov_3,
     p_user_crypto_src_3,
+    p_user_crypto_aovs,
+    p_user_crypto_srcs,
+    p_aov_crypto_hierarchy,
+    p_hierarchy_levels,
 };
 
 node_parameters {
     AiParameterBool("sidecar_manifests", CRYPTO_SIDECARMANIFESTS_DEFAULT);
+    AiParameterBool("async_manifests", CRYPTO_ASYNCMANIFESTS_DEFAULT);
+    AiParameterStr("manifest_cache", "");
+    AiParameterBool("hit_only_manifests", CRYPTO_HITONLYMANIFESTS_DEFAULT);
+    AiParameterEnum("manifest_format", CRYPTO_MANIFESTFORMAT_DEFAULT, manifestFormatEnumNames);
+    AiParameterEnum("manifest_compression", CRYPTO_MANIFESTCOMPRESSION_DEFAULT,
+                    manifestCompressionEnumNames);
+    AiParameterEnum("channel_layout", CRYPTO_CHANNELLAYOUT_DEFAULT, channelLayoutEnumNames);
+    AiParameterBool("performance_stats", CRYPTO_PERFORMANCESTATS_DEFAULT);
+    AiParameterBool("performance_stats_json", false);
+    AiParameterBool("performance_trace", CRYPTO_PERFORMANCETRACE_DEFAULT);
     AiParameterInt("cryptomatte_depth", CRYPTO_DEPTH_DEFAULT);
     AiParameterBool("strip_obj_namespaces", CRYPTO_STRIPOBJNS_DEFAULT);
     AiParameterBool("strip_mat_namespaces", CRYPTO_STRIPMATNS_DEFAULT);
@@ -52,11 +74,29 @@ node_parameters {
     AiParameterStr("user_crypto_src_2", "");
     AiParameterStr("user_crypto_aov_3", "");
     AiParameterStr("user_crypto_src_3", "");
+    AiParameterArray("user_crypto_aovs", AiArray(0, 1, AI_TYPE_STRING));
+    AiParameterArray("user_crypto_srcs", AiArray(0, 1, AI_TYPE_STRING));
+    AiParameterStr("aov_crypto_hierarchy", "");
+    AiParameterInt("hierarchy_levels", CRYPTO_HIERARCHYLEVELS_DEFAULT);
+}
+
+static AtArray* user_crypto_array(const AtNode* node, const char* legacy_param,
+                                  const char* array_param) {
+    // the four numbered parameters, followed by the array parameter
+    const AtArray* extra = AiNodeGetArray(node, array_param);
+    const uint32_t num_extra = extra ? AiArrayGetNumElements(extra) : 0;
+    AtArray* combined = AiArrayAllocate(4 + num_extra, 1, AI_TYPE_STRING);
+    for (uint32_t i = 0; i < 4; i++) {
+        const std::string param = legacy_param + std::to_string(i);
+        AiArraySetStr(combined, i, AiNodeGetStr(node, param.c_str()));
+    }
+    for (uint32_t i = 0; i < num_extra; i++)
+        AiArraySetStr(combined, 4 + i, AiArrayGetStr(extra, i));
+    return combined;
 }
 
 node_initialize {
     CryptomatteData* data = new CryptomatteData();
-    run_all_unit_tests(node);
     AiNodeSetLocalData(node, data);
 }
 
@@ -69,6 +109,15 @@ node_update {
     CryptomatteData* data = reinterpret_cast<CryptomatteData*>(AiNodeGetLocalData(node));
 
     data->set_option_sidecar_manifests(AiNodeGetBool(node, "sidecar_manifests"));
+    data->set_option_async_manifests(AiNodeGetBool(node, "async_manifests"));
+    data->set_option_manifest_cache(AiNodeGetStr(node, "manifest_cache").c_str());
+    data->set_option_hit_only_manifests(AiNodeGetBool(node, "hit_only_manifests"));
+    data->set_option_manifest_format(AiNodeGetInt(node, "manifest_format"));
+    data->set_option_manifest_compression(AiNodeGetInt(node, "manifest_compression"));
+    data->set_option_channel_layout(AiNodeGetInt(node, "channel_layout"));
+    data->set_option_performance_stats(AiNodeGetBool(node, "performance_stats"),
+                                       AiNodeGetBool(node, "performance_stats_json"));
+    data->set_option_performance_trace(AiNodeGetBool(node, "performance_trace"));
     data->set_option_channels(AiNodeGetInt(node, "cryptomatte_depth"), AiNodeGetBool(node, "preview_in_exr"));
 
     CryptoNameFlag flags = CRYPTO_NAME_ALL;
@@ -90,20 +139,16 @@ node_update {
         mat_flags ^= CRYPTO_NAME_STRIP_NS;
 
     data->set_option_namespace_stripping(obj_flags, mat_flags);
+    data->set_option_hierarchy(AiNodeGetStr(node, "aov_crypto_hierarchy"),
+                               AiNodeGetInt(node, "hierarchy_levels"));
 
-    AtArray* uc_aov_array = AiArray(4, 1, AI_TYPE_STRING, //
-                                    AiNodeGetStr(node, "user_crypto_aov_0").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_aov_1").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_aov_2").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_aov_3").c_str());
-    AtArray* uc_src_array = AiArray(4, 1, AI_TYPE_STRING, //
-                                    AiNodeGetStr(node, "user_crypto_src_0").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_src_1").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_src_2").c_str(),
-                                    AiNodeGetStr(node, "user_crypto_src_3").c_str());
+    AtArray* uc_aov_array = user_crypto_array(node, "user_crypto_aov_", "user_crypto_aovs");
+    AtArray* uc_src_array = user_crypto_array(node, "user_crypto_src_", "user_crypto_srcs");
 
     data->setup_all(AiNodeGetStr(node, "aov_crypto_asset"), AiNodeGetStr(node, "aov_crypto_object"),
                     AiNodeGetStr(node, "aov_crypto_material"), uc_aov_array, uc_src_array);
+    AiArrayDestroy(uc_aov_array);
+    AiArrayDestroy(uc_src_array);
 }
 
 shader_evaluate {
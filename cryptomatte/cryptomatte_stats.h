@@ -0,0 +1,252 @@
+#pragma once
+/*
+Render-time performance counters, on while any cryptomatte shader's performance_stats is. Every
+thread counts into its own CryptoThreadStats, a shard of a ShardedStats (stats.h), with no locks or
+atomics, and the last manifest driver to close merges and reports them through AiMsgInfo, once per
+render. With that shader's performance_stats_json they are also written next to its first
+cryptomatte image, as <image>.cryptomatte_stats.json.
+
+Off, counting costs a branch: crypto_thread_stats() returns null.
+*/
+
+#include "cryptomatte_core.h"
+#include "stats.h"
+#include <ai.h>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+// unique IDs per pixel are counted one by one up to this, and above it together
+#define CRYPTO_STATS_MAX_IDS 16
+
+enum CryptoStatsTime {
+    CRYPTO_STATS_SETUP = 0,
+    CRYPTO_STATS_MANIFEST_COMPILE,
+    CRYPTO_STATS_SIDECAR_WRITE,
+    CRYPTO_STATS_TIMES
+};
+static const char* cryptoStatsTimeNames[] = {"setup", "manifest_compile", "sidecar_write",
+                                             nullptr};
+
+struct CryptoThreadStats {
+    // name caches of the shader, of objects, materials and user data
+    uint64_t cache_hits = 0;
+    uint64_t cache_misses = 0;
+    uint64_t name_calls = 0; // object, material and hierarchy name processing
+    uint64_t user_data_lookups = 0;
+    uint64_t filter_pixels = 0;
+    Histogram ids_per_pixel; // by the filter and raw drivers, zero IDs counted as less
+    Range sort_sizes;        // of pixels with more than one ID
+
+    CryptoThreadStats()
+        : ids_per_pixel("unique IDs per pixel", 1.0, CRYPTO_STATS_MAX_IDS + 1.0,
+                        CRYPTO_STATS_MAX_IDS, false),
+          sort_sizes("sort sizes") {}
+
+    void add_pixel_ids(size_t num_ids) {
+        ids_per_pixel.addSample((double)num_ids);
+        if (num_ids > 1)
+            sort_sizes.addSample((double)num_ids);
+    }
+
+    void merge(const CryptoThreadStats& other) {
+        cache_hits += other.cache_hits;
+        cache_misses += other.cache_misses;
+        name_calls += other.name_calls;
+        user_data_lookups += other.user_data_lookups;
+        filter_pixels += other.filter_pixels;
+        ids_per_pixel.merge(other.ids_per_pixel);
+        sort_sizes.merge(other.sort_sizes);
+    }
+
+    void reset() {
+        cache_hits = cache_misses = name_calls = user_data_lookups = filter_pixels = 0;
+        ids_per_pixel.reset();
+        sort_sizes.reset();
+    }
+};
+
+class CryptoStats {
+    // Process wide, as the filters have no way to the shader's CryptomatteData.
+public:
+    static CryptoStats& get() {
+        static CryptoStats stats;
+        return stats;
+    }
+
+    bool enabled() const { return num_enabled.load(std::memory_order_relaxed) > 0; }
+
+    // On while any shader has it on, each enable() is matched by a disable().
+    void enable() { num_enabled.fetch_add(1, std::memory_order_relaxed); }
+    void disable() { num_enabled.fetch_sub(1, std::memory_order_relaxed); }
+
+    // The calling thread's stats, null beyond AI_MAX_THREADS threads.
+    CryptoThreadStats* local() { return threads.local(); }
+
+    void add_time(CryptoStatsTime which, double seconds) {
+        std::lock_guard<std::mutex> lock(mutex);
+        times[which].addSample(seconds);
+    }
+
+    // Merges the threads' stats, reports them and starts over. Between renders only.
+    void report(const std::string& json_path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const CryptoThreadStats total = threads.merged();
+        Range hit_rates("cache hit rate");
+        threads.forEach([&hit_rates](const CryptoThreadStats& thread_stats) {
+            const uint64_t lookups = thread_stats.cache_hits + thread_stats.cache_misses;
+            if (lookups)
+                hit_rates.addSample(double(thread_stats.cache_hits) / lookups);
+        });
+
+        AiMsgInfo("Cryptomatte stats: setup %.3f s, manifest compile %.3f s, sidecar write %.3f s",
+                  times[CRYPTO_STATS_SETUP].total, times[CRYPTO_STATS_MANIFEST_COMPILE].total,
+                  times[CRYPTO_STATS_SIDECAR_WRITE].total);
+        const uint64_t lookups = total.cache_hits + total.cache_misses;
+        AiMsgInfo("Cryptomatte stats: name cache %" PRIu64 " hits, %" PRIu64 " misses (%.1f%%), "
+                  "%.1f%% to %.1f%% by thread",
+                  total.cache_hits, total.cache_misses,
+                  lookups ? 100.0 * total.cache_hits / lookups : 0.0,
+                  hit_rates.n ? 100.0 * hit_rates.min : 0.0,
+                  hit_rates.n ? 100.0 * hit_rates.max : 0.0);
+        AiMsgInfo("Cryptomatte stats: %" PRIu64 " name processing calls, %" PRIu64
+                  " user data lookups, %" PRIu64 " filter pixels",
+                  total.name_calls, total.user_data_lookups, total.filter_pixels);
+        AiMsgInfo("Cryptomatte stats: unique IDs per pixel, %s", id_histogram(total).c_str());
+        if (total.ids_per_pixel.total)
+            AiMsgInfo("Cryptomatte stats: unique IDs per pixel, median %.1f, 90%% %.1f, 99%% %.1f",
+                      id_percentile(total, 0.5), id_percentile(total, 0.9),
+                      id_percentile(total, 0.99));
+        if (total.sort_sizes.n)
+            AiMsgInfo("Cryptomatte stats: %.0f sorts of %.0f to %.0f IDs, %.2f on average",
+                      total.sort_sizes.n, total.sort_sizes.min, total.sort_sizes.max,
+                      total.sort_sizes.mean());
+
+        if (!json_path.empty() && !write_json(json_path, total))
+            AiMsgWarning("Cryptomatte: could not write stats to %s", json_path.c_str());
+
+        threads.reset();
+        for (int i = 0; i < CRYPTO_STATS_TIMES; i++)
+            times[i].reset();
+    }
+
+private:
+    CryptoStats()
+        : num_enabled(0), threads(CryptoThreadStats(), AI_MAX_THREADS),
+          times{Range(cryptoStatsTimeNames[CRYPTO_STATS_SETUP]),
+                Range(cryptoStatsTimeNames[CRYPTO_STATS_MANIFEST_COMPILE]),
+                Range(cryptoStatsTimeNames[CRYPTO_STATS_SIDECAR_WRITE])} {}
+    CryptoStats(const CryptoStats&);
+    CryptoStats& operator=(const CryptoStats&);
+
+    static double id_percentile(const CryptoThreadStats& total, double p) {
+        // pixels with no IDs are below the histogram, and counted as 0 rather than its minimum
+        const Histogram& histogram = total.ids_per_pixel;
+        if (p * histogram.total <= histogram.less)
+            return 0.0;
+        return histogram.percentile(p);
+    }
+
+    static std::string id_histogram(const CryptoThreadStats& total) {
+        // "0: n, 1: n, ... >16: n", leaving out empty bins
+        const Histogram& histogram = total.ids_per_pixel;
+        char entry[64];
+        std::string text;
+        if (histogram.less) {
+            snprintf(entry, sizeof(entry), "0: %.0f", histogram.less);
+            text += entry;
+        }
+        for (int i = 0; i < histogram.nbins; i++) {
+            if (!histogram.bins[i])
+                continue;
+            snprintf(entry, sizeof(entry), "%s%d: %.0f", text.empty() ? "" : ", ", i + 1,
+                     histogram.bins[i]);
+            text += entry;
+        }
+        if (histogram.more) {
+            snprintf(entry, sizeof(entry), "%s>%d: %.0f", text.empty() ? "" : ", ",
+                     CRYPTO_STATS_MAX_IDS, histogram.more);
+            text += entry;
+        }
+        return text.empty() ? "none" : text;
+    }
+
+    bool write_json(const std::string& path, const CryptoThreadStats& total) const {
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\n  \"times\": {");
+        for (int i = 0; i < CRYPTO_STATS_TIMES; i++)
+            fprintf(file, "%s\"%s\": %g", i ? ", " : "", cryptoStatsTimeNames[i],
+                    times[i].total);
+        fprintf(file, "},\n  \"cache_hits\": %" PRIu64 ",\n  \"cache_misses\": %" PRIu64 ",\n",
+                total.cache_hits, total.cache_misses);
+        fprintf(file, "  \"name_calls\": %" PRIu64 ",\n  \"user_data_lookups\": %" PRIu64 ",\n",
+                total.name_calls, total.user_data_lookups);
+        fprintf(file, "  \"filter_pixels\": %" PRIu64 ",\n", total.filter_pixels);
+
+        // index i is the count of pixels with i unique IDs, the last those with more
+        const Histogram& histogram = total.ids_per_pixel;
+        fprintf(file, "  \"ids_per_pixel\": [%.0f", histogram.less);
+        for (int i = 0; i < histogram.nbins; i++)
+            fprintf(file, ", %.0f", histogram.bins[i]);
+        fprintf(file, ", %.0f],\n", histogram.more);
+        const Range& sorts = total.sort_sizes;
+        fprintf(file, "  \"sort_sizes\": {\"count\": %.0f, \"min\": %g, \"max\": %g, "
+                      "\"mean\": %g},\n",
+                sorts.n, sorts.n ? sorts.min : 0.0, sorts.n ? sorts.max : 0.0, sorts.mean());
+        fprintf(file, "  \"ids_per_pixel_percentiles\": {\"p50\": %g, \"p90\": %g, "
+                      "\"p99\": %g},\n",
+                id_percentile(total, 0.5), id_percentile(total, 0.9), id_percentile(total, 0.99));
+
+        fprintf(file, "  \"threads\": [");
+        bool first = true;
+        threads.forEach([file, &first](const CryptoThreadStats& thread_stats) {
+            if (!thread_stats.cache_hits && !thread_stats.cache_misses &&
+                !thread_stats.filter_pixels)
+                return;
+            fprintf(file, "%s\n    {\"cache_hits\": %" PRIu64 ", \"cache_misses\": %" PRIu64
+                          ", \"filter_pixels\": %" PRIu64 "}",
+                    first ? "" : ",", thread_stats.cache_hits, thread_stats.cache_misses,
+                    thread_stats.filter_pixels);
+            first = false;
+        });
+        fprintf(file, "\n  ]\n}\n");
+        return fclose(file) == 0;
+    }
+
+    std::atomic<int> num_enabled;
+    // not an AtCritSec, as the static is destroyed at exit, after Arnold may have shut down
+    std::mutex mutex;
+    ShardedStats<CryptoThreadStats> threads;
+    Range times[CRYPTO_STATS_TIMES];
+};
+
+inline CryptoThreadStats* crypto_thread_stats() {
+    // The calling thread's stats, null when stats are off.
+    CryptoStats& stats = CryptoStats::get();
+    return stats.enabled() ? stats.local() : nullptr;
+}
+
+class CryptoStatsTimer {
+    // Adds the time from construction to destruction, when stats were on at construction.
+public:
+    explicit CryptoStatsTimer(CryptoStatsTime which)
+        : which(which), enabled(CryptoStats::get().enabled()),
+          start(std::chrono::steady_clock::now()) {}
+
+    ~CryptoStatsTimer() {
+        if (!enabled)
+            return;
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        CryptoStats::get().add_time(which, elapsed.count());
+    }
+
+private:
+    CryptoStatsTime which;
+    bool enabled;
+    std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,58 @@
+/*
+Runs the unit tests in cryptomatte_tests.h. Registered with ctest.
+
+    cryptomatte_tests [-v]
+
+Prints each suite with its result, and exits non-zero if any assertion failed. -v also prints
+test_debug messages.
+*/
+
+#include "cryptomatte_tests.h"
+
+#include <cstring>
+
+struct TestSuite {
+    const char* name;
+    void (*run)();
+};
+
+static const TestSuite suites[] = {
+    {"name parsing", NameParsingTests::run},
+    {"material names", MaterialNameTests::run},
+    {"hashing", HashingTests::run},
+    {"id coverage", IdCoverageTests::run},
+    {"manifest format", ManifestFormatTests::run},
+#ifdef CRYPTO_TESTS_WITH_ARNOLD
+    {"thread caches", ThreadCacheTests::run},
+#endif
+    {"stats", StatsTests::run},
+    {"output parsing", OutputParsingTests::run},
+};
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) {
+            test_verbose() = true;
+        } else {
+            fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int failed_suites = 0;
+    for (const TestSuite& suite : suites) {
+        const int failures_before = test_failure_count();
+        suite.run();
+        const int failures = test_failure_count() - failures_before;
+        printf("%-24s %s\n", suite.name, failures ? "FAILED" : "ok");
+        fflush(stdout);
+        failed_suites += failures ? 1 : 0;
+    }
+
+    if (test_failure_count()) {
+        printf("%d assertions failed in %d suites\n", test_failure_count(), failed_suites);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
@@ -1,24 +1,59 @@
+#pragma once
 /*
-
 Testing documentation:
 
-The supplied python unit tests of this repo should run these tests.
-
-Tests run on node_init, if:
-    * Cryptomatte node has boolean user data, "run_unit_tests"
-    * run_unit_tests is set to true
+These are built into the cryptomatte_tests executable (cryptomatte_tests.cpp) and run by ctest,
+not by the plugin. An assertion failure is reported by test_failure, which makes the executable
+fail. The suites need only cryptomatte_core and common/stats.h, except ThreadCacheTests, which is
+built when the Arnold SDK is found (CRYPTO_TESTS_WITH_ARNOLD).
 
-For example:
-    declare run_unit_tests constant BOOL
-    run_unit_tests true
+*/
 
-The unit tests will run as part of node init, when CryptomatteData is constructed.
+#include "manifest_deflate.h"
+#include "output_spec.h"
+#include "stats.h"
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+
+#ifdef CRYPTO_TESTS_WITH_ARNOLD
+#include "cryptomatte.h"
+#else
+#include "cryptomatte_core.h"
+#endif
+
+inline int& test_failure_count() {
+    static int failures = 0;
+    return failures;
+}
 
-In this test suite, an assertion failure results in an AiMsgError.
+inline bool& test_verbose() {
+    static bool verbose = false;
+    return verbose;
+}
 
-*/
+inline void test_failure(const char* format, ...) {
+    test_failure_count()++;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAILED: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
 
-#define CRYPTO_TEST_FLAG "run_unit_tests"
+// Also keeps the compiler from removing the work of tests that only check for crashes.
+inline void test_debug(const char* format, ...) {
+    if (!test_verbose())
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
 
 ///////////////////////////////////////////////
 //
@@ -35,47 +70,50 @@ static const char test_utf8_madchen[] = {'m', (char)0xc3, (char)0xa4, 'd', 'c',
 
 namespace NameParsingTests {
 inline void assert_clean_names(const char* msg, const char* obj_name_in, bool strip_obj_ns,
-                               const char* obj_correct, const char* nsp_correct) {
+                               const char* obj_correct, const char* nsp_correct,
+                               uint8_t pcloud_verbosity = 1) {
     char obj_name_out[MAX_STRING_LENGTH] = "", nsp_name_out[MAX_STRING_LENGTH] = "";
     CryptoNameFlag flags = CRYPTO_NAME_ALL;
     if (!strip_obj_ns)
         flags = flags ^ CRYPTO_NAME_STRIP_NS;
 
-    get_clean_object_name(obj_name_in, obj_name_out, nsp_name_out, flags);
+    get_clean_object_name(obj_name_in, obj_name_out, nsp_name_out, flags, pcloud_verbosity);
     /*
         null "correct" names mean just check there was no crash and the result is a string
-        AiMsgInfo reporting makes sure compiller can't remove this
+        test_debug reporting makes sure compiller can't remove this
     */
     if (!obj_correct || !nsp_correct)
-        AiMsgDebug("Success (%s did not crash) - %lu %lu", msg, strlen(obj_name_out),
+        test_debug("Success (%s did not crash) - %lu %lu", msg, strlen(obj_name_out),
                    strlen(nsp_name_out));
-    else if (strncmp(obj_name_out, obj_correct, -1) != 0)
-        AiMsgError("get_clean_object: OBJECT name mismatch: ((%s)) Expected %s, was %s", msg,
-                   obj_correct, obj_name_out);
-    else if (strncmp(nsp_name_out, nsp_correct, -1) != 0)
-        AiMsgError("get_clean_object: NAMESPACE mismatch: ((%s)) Expected %s, was %s", msg,
-                   nsp_correct, nsp_name_out);
-    AiMsgDebug("Test completed (%s)", msg);
+    else if (strcmp(obj_name_out, obj_correct) != 0)
+        test_failure("get_clean_object: OBJECT name mismatch: ((%s)) Expected %s, was %s", msg,
+                     obj_correct, obj_name_out);
+    else if (strcmp(nsp_name_out, nsp_correct) != 0)
+        test_failure("get_clean_object: NAMESPACE mismatch: ((%s)) Expected %s, was %s", msg,
+                     nsp_correct, nsp_name_out);
+    test_debug("Test completed (%s)", msg);
 }
 
 inline void assert_name_doesnt_crash(const char* msg, const char* obj_name_in, bool strip_obj_ns) {
-    assert_clean_names(msg, obj_name_in, strip_obj_ns, nullptr, nullptr);
+    // the highest verbosity goes through the most parsing
+    assert_clean_names(msg, obj_name_in, strip_obj_ns, nullptr, nullptr, 2);
 }
 
 inline void assert_sitoa_inst_handling(const char* msg, const char* obj_name_in,
-                                       const char* obj_correct, bool handled_correct) {
+                                       const char* obj_correct, bool handled_correct,
+                                       uint8_t pcloud_verbosity) {
     char obj_name_out[MAX_STRING_LENGTH] = "";
-    bool handled = sitoa_pointcloud_instance_handling(obj_name_in, obj_name_out);
+    bool handled = sitoa_pointcloud_instance_handling(obj_name_in, obj_name_out, pcloud_verbosity);
 
     if (handled_correct != handled)
-        AiMsgError("Should have been handled, wasn't. (%s)", msg);
+        test_failure("Should have been handled, wasn't. (%s)", msg);
 
     if (!obj_correct)
-        AiMsgDebug("Success - %lu", strlen(obj_name_out));
-    else if (handled && strncmp(obj_name_out, obj_correct, -1) != 0)
-        AiMsgError("sitoa pointcloud handling: ((%s)) Expected %s, was %s", msg, obj_correct,
-                   obj_name_out);
-    AiMsgDebug("Test ran: %s", msg);
+        test_debug("Success - %lu", strlen(obj_name_out));
+    else if (handled && strcmp(obj_name_out, obj_correct) != 0)
+        test_failure("sitoa pointcloud handling: ((%s)) Expected %s, was %s", msg, obj_correct,
+                     obj_name_out);
+    test_debug("Test ran: %s", msg);
 }
 
 inline void assert_mtoa_strip(const char* msg, const char* obj_name_in, const char* obj_correct) {
@@ -83,10 +121,11 @@ inline void assert_mtoa_strip(const char* msg, const char* obj_name_in, const ch
     mtoa_strip_namespaces(obj_name_in, obj_name_out);
 
     if (!obj_correct)
-        AiMsgDebug("Success - %lu", strlen(obj_name_out));
-    else if (strncmp(obj_name_out, obj_correct, -1) != 0)
-        AiMsgError("MtoA ns stripping: ((%s)) Expected %s, was %s", msg, obj_correct, obj_name_out);
-    AiMsgDebug("Test ran: %s", msg);
+        test_debug("Success - %lu", strlen(obj_name_out));
+    else if (strcmp(obj_name_out, obj_correct) != 0)
+        test_failure("MtoA ns stripping: ((%s)) Expected %s, was %s", msg, obj_correct,
+                     obj_name_out);
+    test_debug("Test ran: %s", msg);
 }
 
 inline void mtoa_parsing() {
@@ -113,48 +152,35 @@ inline void sitoa_parsing() {
     assert_clean_names("sitoa-3", "model.object.SItoA.1002", false, "model.object", "model");
 
     const char* sitoa_inst_schema = "mdl.icecloud.SItoA.Instance.<frame>.<id> mstr.SItoA.1001";
-    g_pointcloud_instance_verbosity = 0;
-    assert_clean_names("sitoa-4", sitoa_inst_schema, true, "icecloud", "mdl");
-    assert_sitoa_inst_handling("sitoa-4b", sitoa_inst_schema, "", false);
-    g_pointcloud_instance_verbosity = 1;
-    assert_clean_names("sitoa-5", sitoa_inst_schema, true, "mstr", "mdl");
-    assert_sitoa_inst_handling("sitoa-5b", sitoa_inst_schema, "mstr", true);
-    g_pointcloud_instance_verbosity = 2;
-    assert_clean_names("sitoa-6", sitoa_inst_schema, true, "mstr.<id>", "mdl");
-    assert_sitoa_inst_handling("sitoa-6b", sitoa_inst_schema, "mstr.<id>", true);
+    assert_clean_names("sitoa-4", sitoa_inst_schema, true, "icecloud", "mdl", 0);
+    assert_sitoa_inst_handling("sitoa-4b", sitoa_inst_schema, "", false, 0);
+    assert_clean_names("sitoa-5", sitoa_inst_schema, true, "mstr", "mdl", 1);
+    assert_sitoa_inst_handling("sitoa-5b", sitoa_inst_schema, "mstr", true, 1);
+    assert_clean_names("sitoa-6", sitoa_inst_schema, true, "mstr.<id>", "mdl", 2);
+    assert_sitoa_inst_handling("sitoa-6b", sitoa_inst_schema, "mstr.<id>", true, 2);
 
     const char* sitoa_inst = "mdl.icecloud.SItoA.Instance.1001.47 master.SItoA.1001";
-    g_pointcloud_instance_verbosity = 0;
-    assert_clean_names("sitoa-7", sitoa_inst, true, "icecloud", "mdl");
-    assert_sitoa_inst_handling("sitoa-7b", sitoa_inst_schema, "", false);
+    assert_clean_names("sitoa-7", sitoa_inst, true, "icecloud", "mdl", 0);
+    assert_sitoa_inst_handling("sitoa-7b", sitoa_inst_schema, "", false, 0);
 
-    g_pointcloud_instance_verbosity = 1;
-    assert_clean_names("sitoa-8", sitoa_inst, true, "master", "mdl");
-    assert_sitoa_inst_handling("sitoa-8b", sitoa_inst, "master", true);
+    assert_clean_names("sitoa-8", sitoa_inst, true, "master", "mdl", 1);
+    assert_sitoa_inst_handling("sitoa-8b", sitoa_inst, "master", true, 1);
 
-    g_pointcloud_instance_verbosity = 2;
-    assert_clean_names("sitoa-9", sitoa_inst, true, "master.47", "mdl");
-    assert_sitoa_inst_handling("sitoa-9b", sitoa_inst, "master.47", true);
+    assert_clean_names("sitoa-9", sitoa_inst, true, "master.47", "mdl", 2);
+    assert_sitoa_inst_handling("sitoa-9b", sitoa_inst, "master.47", true, 2);
 
-    g_pointcloud_instance_verbosity = 0;
-    assert_clean_names("sitoa-10", sitoa_inst, false, "mdl.icecloud", "mdl");
-    assert_sitoa_inst_handling("sitoa-10b", sitoa_inst, "", false);
+    assert_clean_names("sitoa-10", sitoa_inst, false, "mdl.icecloud", "mdl", 0);
+    assert_sitoa_inst_handling("sitoa-10b", sitoa_inst, "", false, 0);
 
-    g_pointcloud_instance_verbosity = 1;
-    assert_clean_names("sitoa-11", sitoa_inst, false, "master", "mdl");
-    assert_sitoa_inst_handling("sitoa-11b", sitoa_inst, "master", true);
+    assert_clean_names("sitoa-11", sitoa_inst, false, "master", "mdl", 1);
+    assert_sitoa_inst_handling("sitoa-11b", sitoa_inst, "master", true, 1);
 
-    g_pointcloud_instance_verbosity = 2;
-    assert_clean_names("sitoa-12", sitoa_inst, false, "master.47", "mdl");
-    assert_sitoa_inst_handling("sitoa-12b", sitoa_inst, "master.47", true);
+    assert_clean_names("sitoa-12", sitoa_inst, false, "master.47", "mdl", 2);
+    assert_sitoa_inst_handling("sitoa-12b", sitoa_inst, "master.47", true, 2);
 
-    g_pointcloud_instance_verbosity = 0;
     const char* sitoa_inst_no_mdl = "icecloud.SItoA.Instance.1001.47 master.SItoA.1001";
-    assert_clean_names("sitoa-13", sitoa_inst_no_mdl, false, "icecloud", "default");
-    assert_sitoa_inst_handling("sitoa-13b", sitoa_inst_no_mdl, "", false);
-
-    // reset
-    g_pointcloud_instance_verbosity = CRYPTO_ICEPCLOUDVERB_DEFAULT;
+    assert_clean_names("sitoa-13", sitoa_inst_no_mdl, false, "icecloud", "default", 0);
+    assert_sitoa_inst_handling("sitoa-13b", sitoa_inst_no_mdl, "", false, 0);
 }
 
 inline void c4dtoa_parsing() {
@@ -196,9 +222,8 @@ inline void crazy_maya_parsing() {
 
 inline void crazy_sitoa_parsing() {
     const char* crashed_parsing = "mdl.icecloud.SItoA.Instance.<frame> <id> mstr.SItoA.1001";
-    g_pointcloud_instance_verbosity = 2;
     assert_name_doesnt_crash("sitoa-ugly-1", crashed_parsing, false);
-    assert_sitoa_inst_handling("sitoa-ugly-14b", crashed_parsing, nullptr, false);
+    assert_sitoa_inst_handling("sitoa-ugly-14b", crashed_parsing, nullptr, false, 2);
 
     std::string looong = long_string("model", 10) + "." + long_string("object", 10) + ".SItoA.1001";
     std::string weird = long_string("mdl.obj", 10);
@@ -207,11 +232,11 @@ inline void crazy_sitoa_parsing() {
                            long_string("masterName", 10) + ".SItoA.1001"; // master name
 
     assert_name_doesnt_crash("sitoa-ugly-2", looong.c_str(), false);
-    assert_sitoa_inst_handling("sitoa-ugly-2b", looong.c_str(), nullptr, false);
+    assert_sitoa_inst_handling("sitoa-ugly-2b", looong.c_str(), nullptr, false, 2);
     assert_name_doesnt_crash("sitoa-ugly-3", weird.c_str(), false);
-    assert_sitoa_inst_handling("sitoa-ugly-3b", weird.c_str(), nullptr, false);
+    assert_sitoa_inst_handling("sitoa-ugly-3b", weird.c_str(), nullptr, false, 2);
     assert_name_doesnt_crash("sitoa-ugly-4", longInst.c_str(), false);
-    assert_sitoa_inst_handling("sitoa-ugly-4b", longInst.c_str(), nullptr, false);
+    assert_sitoa_inst_handling("sitoa-ugly-4b", longInst.c_str(), nullptr, false, 2);
 }
 
 inline void malformed_name_parsing() {
@@ -239,6 +264,36 @@ inline void utf8_parsing() {
         test_utf8_madchen);
 }
 
+inline void assert_hierarchy_levels(const char* name, uint8_t num_levels, uint8_t levels_correct,
+                                    const char* const* names_correct) {
+    size_t lengths[MAX_HIERARCHY_LEVELS];
+    const uint8_t levels = get_hierarchy_levels(name, num_levels, lengths);
+    if (levels != levels_correct)
+        test_failure("get_hierarchy_levels: ((%s)) Expected %u levels, was %u", name,
+                     levels_correct, levels);
+    for (uint8_t i = 0; i < num_levels; i++)
+        if (std::string(name, lengths[i]) != names_correct[i])
+            test_failure("get_hierarchy_levels: ((%s)) Expected level %u %s, was %s", name, i + 1,
+                         names_correct[i], std::string(name, lengths[i]).c_str());
+}
+
+inline void hierarchy_levels() {
+    const char* path[] = {"/set", "/set/building", "/set/building/window",
+                          "/set/building/window/pane", "/set/building/window/pane"};
+    assert_hierarchy_levels("/set/building/window/pane", 5, 4, path);
+    assert_hierarchy_levels("/set/building/window/pane", 2, 2, path);
+    const char* c4d[] = {"/Null", "/Null/Cloner", "/Null/Cloner|Null"};
+    assert_hierarchy_levels("/Null/Cloner|Null/Sphere1", 3, 3, c4d);
+    const char* maya[] = {"|grp", "|grp|ns:mesh", "|grp|ns:mesh"};
+    assert_hierarchy_levels("|grp|ns:mesh", 3, 2, maya);
+    const char* flat[] = {"ns:obj", "ns:obj"};
+    assert_hierarchy_levels("ns:obj", 2, 1, flat);
+    const char* empty[] = {"", ""};
+    assert_hierarchy_levels("", 2, 0, empty);
+    const char* separators[] = {"//", "//"};
+    assert_hierarchy_levels("//", 2, 0, separators);
+}
+
 inline void run() {
     mtoa_parsing();
     mtoa_strip();
@@ -249,7 +304,7 @@ inline void run() {
     crazy_sitoa_parsing();
     malformed_name_parsing();
     utf8_parsing();
-    AiMsgInfo("Cryptomatte unit tests: Name parsing checks complete");
+    hierarchy_levels();
 }
 } // namespace NameParsingTests
 
@@ -266,10 +321,10 @@ inline void assert_material_name(const char* msg, const char* mat_full_name, boo
     get_clean_material_name(mat_full_name, mat_name_out, flags);
 
     if (!mat_correct)
-        AiMsgDebug("Success (%s did not crash) - %lu", msg, strlen(mat_name_out));
-    else if (strncmp(mat_correct, mat_name_out, -1) != 0)
-        AiMsgError("get_clean_material: Mismatch: ((%s)) Expected %s, was %s", msg, mat_correct,
-                   mat_name_out);
+        test_debug("Success (%s did not crash) - %lu", msg, strlen(mat_name_out));
+    else if (strcmp(mat_correct, mat_name_out) != 0)
+        test_failure("get_clean_material: Mismatch: ((%s)) Expected %s, was %s", msg, mat_correct,
+                     mat_name_out);
 }
 
 inline void test_c4d_old_names() {
@@ -315,7 +370,11 @@ inline void assert_hash_to_float(const char* name, float expected_hash) {
     MurmurHash3_x86_32(name, (uint32_t)strlen(name), 0, &m3hash);
     float hash = hash_to_float(m3hash);
     if (expected_hash != hash)
-        AiMsgError("(f) hash mismatch: (%s) Expected %g, was %g", name, expected_hash, hash);
+        test_failure("(f) hash mismatch: (%s) Expected %g, was %g", name, expected_hash, hash);
+    float rgb[3];
+    hash_name_rgb(name, rgb);
+    if (hash_name_id(name) != hash || rgb[0] != hash)
+        test_failure("(f) name hash differs from its float hash: (%s)", name);
 }
 
 inline void hash_ascii_names() {
@@ -336,15 +395,446 @@ inline void run() {
 }
 } // namespace HashingTests
 
-inline void run_all_unit_tests(AtNode* node) {
-    if (node && AiNodeLookUpUserParameter(node, CRYPTO_TEST_FLAG) &&
-        AiNodeGetBool(node, CRYPTO_TEST_FLAG)) {
-        AiMsgWarning("Cryptomatte unit tests: Running");
-        NameParsingTests::run();
-        HashingTests::run();
-        MaterialNameTests::run();
-        AiMsgWarning("Cryptomatte unit tests: Complete");
+namespace IdCoverageTests {
+inline void accumulate_pixel(const std::vector<float>& ids, std::vector<IdCoverage>& coverages,
+                             float* preview) {
+    // one opaque camera sample per ID
+    IdCoverageAccumulator accumulator(coverages, preview);
+    for (const float id : ids) {
+        accumulator.begin_sample(1.0f);
+        accumulator.add_depth_sample(id, 1.0f);
+        accumulator.end_sample();
+    }
+    accumulator.finish();
+}
+
+inline void bucket_twice() {
+    // A bucket of 2 pixels processed twice as cryptomatte_exr does, with fewer IDs the second
+    // time, must hold only the second pass.
+    const int depth = 4, pixel_floats = 8;
+    const std::vector<std::vector<float>> first = {{1.0f, 2.0f, 3.0f}, {4.0f, 5.0f}};
+    const std::vector<std::vector<float>> second = {{1.0f}, {}};
+    std::vector<float> ranks(2 * pixel_floats), preview(2 * 4);
+    std::vector<IdCoverage> coverages;
+    for (const auto* pass : {&first, &second})
+        for (int pixel = 0; pixel < 2; pixel++) {
+            accumulate_pixel((*pass)[pixel], coverages, &preview[pixel * 4]);
+            write_pixel_ranks(coverages, depth, &ranks[pixel * pixel_floats], pixel_floats);
+        }
+
+    if (ranks[0] != 1.0f || ranks[1] != 1.0f)
+        test_failure("(c) second pass rank 0 is %g, %g", ranks[0], ranks[1]);
+    for (int i = 2; i < 2 * pixel_floats; i++)
+        if (ranks[i] != 0.0f)
+            test_failure("(c) rank float %d kept %g from the first pass", i, ranks[i]);
+
+    std::vector<float> expected(4);
+    accumulate_pixel(second[0], coverages, expected.data());
+    for (int i = 0; i < 4; i++)
+        if (preview[i] != expected[i] || preview[4 + i] != 0.0f)
+            test_failure("(c) preview channel %d added to the first pass", i);
+}
+
+inline void run() { bucket_twice(); }
+} // namespace IdCoverageTests
+
+namespace ManifestFormatTests {
+inline void binary_round_trip() {
+    ManifestMap map;
+    add_hash_to_map("hello", map);
+    add_hash_to_map("cube", map);
+    add_hash_to_map(test_utf8_madchen, map);
+    add_hash_to_map("path/with\\escapes\"", map);
+
+    std::string binary;
+    write_manifest_to_binary(map, binary);
+    // std::string buffers are allocated at least 8 byte aligned
+    BinaryManifest manifest;
+    if (!manifest.view(binary.data(), binary.size())) {
+        test_failure("(m) binary manifest did not validate");
+        return;
+    }
+    if (manifest.size() != map.size())
+        test_failure("(m) binary manifest has %u entries, expected %lu", manifest.size(),
+                     map.size());
+    for (const auto& name_hash : map) {
+        uint32_t bits;
+        std::memcpy(&bits, &name_hash.second, 4);
+        const char* found = manifest.find(bits);
+        if (!found || name_hash.first != found)
+            test_failure("(m) binary manifest lookup failed: %s", name_hash.first.c_str());
+    }
+    if (manifest.find(0))
+        test_failure("(m) binary manifest found a missing hash");
+
+    std::string json;
+    write_manifest_to_string(map, json);
+    std::vector<ManifestEntry> entries;
+    if (!parse_json_manifest(json, entries) || entries.size() != map.size())
+        test_failure("(m) JSON manifest did not parse: %s", json.c_str());
+    std::string reencoded;
+    encode_binary_manifest(entries, reencoded);
+    if (reencoded != binary)
+        test_failure("(m) JSON and binary manifests differ");
+}
+
+inline void json_unicode_escapes() {
+    // U+1F600 is escaped as the surrogate pair D83D DE00, and is one 4 byte UTF-8 code point
+    static const char grinning[] = {(char)0xf0, (char)0x9f, (char)0x98, (char)0x80, '\0'};
+    std::vector<ManifestEntry> entries;
+    if (!parse_json_manifest("{\"\\uD83D\\uDE00\":\"00000001\",\"caf\\u00e9\":\"00000002\"}",
+                             entries) ||
+        entries.size() != 2) {
+        test_failure("(m) JSON manifest with unicode escapes did not parse");
+        return;
     }
+    if (entries[0].name != grinning)
+        test_failure("(m) surrogate pair not decoded as one code point");
+    if (entries[1].name != "caf\xc3\xa9")
+        test_failure("(m) \\u00e9 not decoded as UTF-8");
+
+    std::string binary;
+    encode_binary_manifest(entries, binary);
+    BinaryManifest manifest;
+    const char* found = manifest.view(binary.data(), binary.size()) ? manifest.find(1) : nullptr;
+    if (!found || strcmp(found, grinning) != 0)
+        test_failure("(m) binary manifest lookup of a surrogate pair name failed");
+
+    static const char* unpaired[] = {
+        "{\"\\uD83D\":\"00000001\"}",        // high surrogate at the end
+        "{\"\\uD83Dx\":\"00000001\"}",       // high surrogate followed by a character
+        "{\"\\uD83D\\u0041\":\"00000001\"}", // high surrogate followed by a non surrogate
+        "{\"\\uDE00\":\"00000001\"}",        // low surrogate alone
+        "{\"\\uD8G0\":\"00000001\"}",        // not hex
+    };
+    for (const char* json : unpaired)
+        if (parse_json_manifest(json, entries))
+            test_failure("(m) invalid unicode escape parsed: %s", json);
 }
 
+inline void deflate_round_trip() {
+    if (!manifest_deflate_available()) {
+        test_debug("(m) built without zlib, deflate not tested");
+        return;
+    }
+    // Manifests of growing length, until their base64 has ended on each of no padding, "=" and
+    // "==", that is until the zlib streams have had lengths of 0, 2 and 1 mod 3.
+    bool padding_seen[3] = {false, false, false};
+    std::string manifest, encoded, decoded;
+    for (int names = 1; names < 64; names++) {
+        ManifestMap map;
+        for (int i = 0; i < names; i++)
+            add_hash_to_map(("object_" + std::to_string(i * 7919)).c_str(), map);
+        write_manifest_to_string(map, manifest);
+        if (!deflate_manifest(manifest, encoded) || encoded.size() % 4 != 0) {
+            test_failure("(m) deflate of %d names failed or isn't padded base64", names);
+            continue;
+        }
+        const size_t padding = encoded.size() - encoded.find_last_not_of('=') - 1;
+        if (padding < 3)
+            padding_seen[padding] = true;
+        if (!inflate_manifest(encoded, decoded) || decoded != manifest)
+            test_failure("(m) deflate round trip of %d names with %lu padding failed", names,
+                         (unsigned long)padding);
+    }
+    for (int padding = 0; padding < 3; padding++)
+        if (!padding_seen[padding])
+            test_failure("(m) no deflated manifest had %d base64 padding", padding);
+
+    // manifests this small grow, setup then writes them plain, but they must still round trip
+    manifest = "{\"a\":\"3f800000\"}";
+    if (!deflate_manifest(manifest, encoded) || encoded.size() < manifest.size())
+        test_failure("(m) tiny manifest did not grow when deflated");
+    if (!inflate_manifest(encoded, decoded) || decoded != manifest)
+        test_failure("(m) deflate round trip of a manifest that grows failed");
+
+    if (inflate_manifest("not*base64", decoded))
+        test_failure("(m) inflated invalid base64");
+    if (inflate_manifest(encoded.substr(0, encoded.size() - 8), decoded))
+        test_failure("(m) inflated a truncated stream");
+}
 
+inline void run() {
+    binary_round_trip();
+    json_unicode_escapes();
+    deflate_round_trip();
+}
+} // namespace ManifestFormatTests
+
+#ifdef CRYPTO_TESTS_WITH_ARNOLD
+namespace ThreadCacheTests {
+inline void thread_caches() {
+    ThreadCaches caches;
+    caches.resize(3, 20);
+    for (uint16_t tid = 0; tid < 3; tid++) {
+        CryptomatteCache* cache = caches.get(tid);
+        if (!cache || reinterpret_cast<uintptr_t>(cache) % CACHE_LINE != 0)
+            test_failure("(t) thread %u has no cache line aligned cache", tid);
+        else if (cache->object || cache->object_generation || cache->user_object)
+            test_failure("(t) thread %u cache is not empty", tid);
+        for (size_t i = 0; i < 20; i++)
+            if (!std::isnan(caches.user_ids(tid)[i]))
+                test_failure("(t) thread %u user ID %u is cached", tid, (unsigned)i);
+    }
+    // user IDs of one thread must not run into the cache of the next
+    caches.user_ids(0)[19] = 1.0f;
+    if (caches.get(1)->object || caches.get(1)->object_generation)
+        test_failure("(t) user IDs overlap the next thread's cache");
+    if (caches.get(3))
+        test_failure("(t) thread beyond the session has a cache");
+    caches.resize(0, 0);
+    if (caches.get(0))
+        test_failure("(t) empty caches returned a cache");
+}
+
+inline void run() { thread_caches(); }
+} // namespace ThreadCacheTests
+#endif
+
+namespace StatsTests {
+inline void histogram_percentiles() {
+    // 100 samples, 10 in each of bins 0 to 9
+    Histogram histogram("h", 0.0, 10.0, 10, false);
+    for (int i = 0; i < 100; i++)
+        histogram.addSample(i * 0.1);
+    if (fabs(histogram.percentile(0.5) - 5.0) > 1e-6)
+        test_failure("(s) median %g, expected 5", histogram.percentile(0.5));
+    if (fabs(histogram.percentile(0.25) - 2.5) > 1e-6)
+        test_failure("(s) 25th percentile %g, expected 2.5", histogram.percentile(0.25));
+    histogram.addSample(-1.0);
+    if (histogram.percentile(0.0) != 0.0)
+        test_failure("(s) samples below the bins are not clamped to min");
+    for (int i = 0; i < 200; i++)
+        histogram.addSample(20.0);
+    if (histogram.percentile(0.99) != 10.0)
+        test_failure("(s) samples above the bins are not clamped to max");
+}
+
+inline void sharded_merge() {
+    ShardedStats<Histogram> shards(Histogram("ids", 0.0, 4.0, 4, false));
+    const int num_threads = 4, samples = 1000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+        threads.emplace_back([&shards, t]() {
+            Histogram* local = shards.local();
+            for (int i = 0; local && i < samples; i++)
+                local->addSample(double(t));
+        });
+    for (auto& thread : threads)
+        thread.join();
+
+    const Histogram merged = shards.merged();
+    if (merged.total != num_threads * samples)
+        test_failure("(s) merged %g samples, expected %d", merged.total, num_threads * samples);
+    for (int t = 0; t < num_threads; t++)
+        if (merged.bins[t] != samples)
+            test_failure("(s) merged bin %d has %g samples, expected %d", t, merged.bins[t],
+                         samples);
+    shards.reset();
+    if (shards.merged().total != 0.0)
+        test_failure("(s) reset shards still have samples");
+
+    Range range("r"), other("r");
+    range.addSample(1.0);
+    other.addSample(3.0);
+    range.merge(other);
+    if (range.min != 1.0 || range.max != 3.0 || range.mean() != 2.0)
+        test_failure("(s) merged range is %g to %g, mean %g", range.min, range.max, range.mean());
+}
+
+inline void shard_copies() {
+    // only the prototype's owner reports on destruction, not every shard and merged copy
+    Range reporting("r", true);
+    ShardedStats<Range> shards(reporting);
+    Range* local = shards.local();
+    if (!local || local->reportOnDestruction || shards.merged().reportOnDestruction)
+        test_failure("(s) shard copies report on destruction");
+    Histogram reporting_histogram("h", 0.0, 1.0, 2, false, true);
+    ShardedStats<Histogram> histograms(reporting_histogram);
+    if (!histograms.local() || histograms.local()->reportOnDestruction ||
+        histograms.merged().reportOnDestruction)
+        test_failure("(s) histogram shard copies report on destruction");
+    reporting.reportOnDestruction = false;
+    reporting_histogram.reportOnDestruction = false;
+}
+
+inline void export_formats() {
+    Histogram histogram("h", 0.0, 2.0, 2, false);
+    histogram.addSample(0.5);
+    histogram.addSample(5.0);
+    std::ostringstream json, csv;
+    histogram.writeJSON(json);
+    histogram.writeCSV(csv);
+    if (json.str().find("\"bins\": [1, 0], \"more\": 1") == std::string::npos)
+        test_failure("(s) histogram JSON is %s", json.str().c_str());
+    if (csv.str() != "h,-inf,0,0\nh,0,1,1\nh,1,2,0\nh,2,inf,1\n")
+        test_failure("(s) histogram CSV is %s", csv.str().c_str());
+}
+
+inline void run() {
+    histogram_percentiles();
+    sharded_merge();
+    shard_copies();
+    export_formats();
+}
+} // namespace StatsTests
+
+namespace OutputParsingTests {
+inline void assert_output_spec(const char* output, const char* camera, const char* aov,
+                               const char* filter, const char* driver, bool half,
+                               const char* layer = "") {
+    OutputSpec spec;
+    if (!parse_output_spec(output, spec)) {
+        test_failure("(o) output did not parse: %s", output);
+        return;
+    }
+    if (spec.camera != camera || spec.aov != aov || spec.filter != filter ||
+        spec.driver != driver || spec.half != half || spec.layer != layer)
+        test_failure("(o) output parsed wrong: %s", output);
+}
+
+inline void parse_outputs() {
+    assert_output_spec("crypto_object RGBA gaussian_filter exr_driver", "", "crypto_object",
+                       "gaussian_filter", "exr_driver", false);
+    assert_output_spec("crypto_object RGBA gaussian_filter exr_driver HALF", "", "crypto_object",
+                       "gaussian_filter", "exr_driver", true);
+    assert_output_spec("camera1 crypto_object RGBA box exr_driver", "camera1", "crypto_object",
+                       "box", "exr_driver", false);
+    assert_output_spec("  camera1  RGBA RGBA box exr_driver  HALF ", "camera1", "RGBA", "box",
+                       "exr_driver", true);
+    assert_output_spec("crypto_object_id FLOAT crypto_object_filter00 exr_driver crypto_object00",
+                       "", "crypto_object_id", "crypto_object_filter00", "exr_driver", false,
+                       "crypto_object00");
+    assert_output_spec("camera1 RGBA RGBA box exr_driver HALF beauty", "camera1", "RGBA", "box",
+                       "exr_driver", true, "beauty");
+
+    OutputSpec spec;
+    if (parse_output_spec("RGBA RGBA box", spec) || parse_output_spec("", spec))
+        test_failure("(o) incomplete output parsed");
+
+    const char* output =
+        "camera1 crypto_object_id FLOAT crypto_object_filter00 exr_driver crypto_object00";
+    parse_output_spec(output, spec);
+    if (spec.str() != output)
+        test_failure("(o) output did not round trip: %s", spec.str().c_str());
+    if (rank_aov_name("crypto_object", 0) != "crypto_object00" ||
+        rank_filter_name("crypto_object", 11) != "crypto_object_filter11" ||
+        id_aov_name("crypto_object") != "crypto_object_id")
+        test_failure("(o) wrong rank names");
+
+    parse_output_spec(
+        "crypto_object_id FLOAT crypto_object_preview_filter exr_driver crypto_object", spec);
+    if (!is_preview_output(spec))
+        test_failure("(o) preview output not recognized: %s", spec.str().c_str());
+    parse_output_spec(output, spec);
+    if (is_preview_output(spec))
+        test_failure("(o) rank output taken for a preview output: %s", output);
+    if (is_layer_output(spec))
+        test_failure("(o) rank output taken for a layer output: %s", output);
+
+    parse_output_spec("crypto_object_id FLOAT gaussian_filter crypto_exr crypto_object", spec);
+    if (!is_layer_output(spec) || is_preview_output(spec))
+        test_failure("(o) layer output not recognized: %s", spec.str().c_str());
+}
+
+inline void rewrite_outputs() {
+    const std::string manifest = "cryptomatte_manifest_driver";
+    const StringVector outputs = {
+        "RGBA RGBA gaussian_filter exr_driver",
+        "crypto_object RGBA gaussian_filter exr_driver",
+        manifest,
+        "crypto_asset_id FLOAT crypto_asset_preview_filter exr_driver crypto_asset",
+        "N VECTOR closest_filter exr_driver",
+        manifest,
+    };
+    OutputRewrite rewrite(outputs, manifest);
+    if (!rewrite.is_manifest_output(2) || rewrite.is_manifest_output(1))
+        test_failure("(o) manifest output not recognized");
+
+    OutputSpec spec;
+    parse_output_spec(outputs[1].c_str(), spec);
+    if (rewrite.add_rank_outputs(spec, 2) != 2 || rewrite.add_rank_outputs(spec, 2) != 0)
+        test_failure("(o) rank outputs not added once");
+    rewrite.replace(1, "crypto_object_id FLOAT crypto_object_preview_filter exr_driver "
+                       "crypto_object");
+    rewrite.drop(3);
+    rewrite.set_half(4);
+    rewrite.add_manifest_output();
+
+    const StringVector expected = {
+        manifest,
+        "RGBA RGBA gaussian_filter exr_driver",
+        "crypto_object_id FLOAT crypto_object_preview_filter exr_driver crypto_object",
+        "N VECTOR closest_filter exr_driver HALF",
+        "crypto_object_id FLOAT crypto_object_filter00 exr_driver crypto_object00",
+        "crypto_object_id FLOAT crypto_object_filter01 exr_driver crypto_object01",
+    };
+    if (!rewrite.changed() || rewrite.outputs() != expected)
+        test_failure("(o) outputs rewritten wrong");
+
+    // a second setup of the rewritten outputs leaves them as they are
+    OutputRewrite again(expected, manifest);
+    again.add_manifest_output();
+    if (again.add_rank_outputs(spec, 2) != 0 || again.changed() || again.outputs() != expected)
+        test_failure("(o) rewritten outputs changed again");
+
+    // the manifest output moves to the front, also when it's the only change
+    OutputRewrite moved({outputs[0], manifest}, manifest);
+    if (!moved.changed() || moved.outputs() != StringVector({manifest, outputs[0]}))
+        test_failure("(o) manifest output not moved first");
+}
+
+inline size_t setup_parses(int num_outputs, int depth, size_t& added) {
+    // Light group AOVs for several cameras, with a cryptomatte every so often and some outputs
+    // set to HALF, rewritten as setup does. Returns how many outputs were parsed.
+    StringVector outputs;
+    char output[MAX_STRING_LENGTH];
+    for (int i = 0; i < num_outputs; i++) {
+        if (i % 50 == 0)
+            sprintf(output, "camera%d crypto_object RGBA gaussian_filter exr_%d", i % 4, i);
+        else
+            sprintf(output, "camera%d RGBA_lg%d RGBA gaussian_filter exr_%d", i % 4, i, i);
+        outputs.push_back(output);
+    }
+
+    const size_t parses_before = output_spec_parses();
+    OutputRewrite rewrite(outputs, "cryptomatte_manifest_driver");
+    added = 0;
+    visit_outputs(rewrite, [&](size_t i, const OutputSpec& spec, bool, bool) {
+        if (spec.aov == "crypto_object")
+            added += rewrite.add_rank_outputs(spec, depth);
+        else if (i % 7 == 0)
+            rewrite.set_half(i);
+    });
+    rewrite.add_manifest_output();
+    if (rewrite.outputs().size() != outputs.size() + added + 1)
+        test_failure("(o) %lu outputs rewritten to %lu", (unsigned long)outputs.size(),
+                     (unsigned long)rewrite.outputs().size());
+    return output_spec_parses() - parses_before;
+}
+
+inline void linear_rewrite() {
+    // Ten times the outputs is ten times the parsing, each output is parsed once and again only
+    // if it's set to HALF. 1400 is a multiple of both the cryptomatte and the HALF spacing.
+    const int num_outputs = 1400, depth = 3;
+    size_t added = 0, added_10 = 0;
+    const size_t parses = setup_parses(num_outputs, depth, added);
+    const size_t parses_10 = setup_parses(10 * num_outputs, depth, added_10);
+    if (added != (num_outputs / 50) * depth || added_10 != 10 * added)
+        test_failure("(o) %lu and %lu rank outputs added", (unsigned long)added,
+                     (unsigned long)added_10);
+    const size_t halved = num_outputs / 7 - (num_outputs / 350);
+    if (parses != num_outputs + halved)
+        test_failure("(o) %lu parses for %d outputs", (unsigned long)parses, num_outputs);
+    if (parses_10 != 10 * parses)
+        test_failure("(o) output rewrite is not linear: %lu parses for %d outputs, %lu for %d",
+                     (unsigned long)parses, num_outputs, (unsigned long)parses_10,
+                     10 * num_outputs);
+}
+
+inline void run() {
+    parse_outputs();
+    rewrite_outputs();
+    linear_rewrite();
+}
+} // namespace OutputParsingTests
@@ -0,0 +1,148 @@
+#pragma once
+/*
+Timeline of cryptomatte's setup, manifest and I/O work, on while any cryptomatte shader's
+performance_trace is, or the CRYPTOMATTE_TRACE environment variable names a file. Every thread
+records the spans it runs into its own CryptoTraceBuffer, a shard of a ShardedStats (stats.h), and
+the last manifest driver to close writes them once per render in the Chrome trace event format,
+which chrome://tracing and ui.perfetto.dev open. The trace goes to the file CRYPTOMATTE_TRACE
+names, else next to that shader's first cryptomatte image, as <image>.cryptomatte_trace.json.
+
+Off, a span costs a branch.
+*/
+
+#include "stats.h"
+#include <ai.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// spans kept per thread and render, later ones are counted and dropped
+#define CRYPTO_TRACE_MAX_EVENTS (1 << 20)
+
+struct CryptoTraceEvent {
+    const char* name; // a string literal, written as is
+    double start;     // microseconds since the trace started
+    double duration;  // microseconds
+};
+
+struct CryptoTraceBuffer {
+    int thread = -1; // StatsThreadIndex of the thread that owns the buffer
+    std::vector<CryptoTraceEvent> events;
+    uint64_t dropped = 0;
+
+    void add(const CryptoTraceEvent& event) {
+        if (thread < 0)
+            thread = StatsThreadIndex::get();
+        if (events.size() < CRYPTO_TRACE_MAX_EVENTS)
+            events.push_back(event);
+        else
+            dropped++;
+    }
+
+    void merge(const CryptoTraceBuffer& other) {
+        events.insert(events.end(), other.events.begin(), other.events.end());
+        dropped += other.dropped;
+    }
+
+    void reset() {
+        events.clear();
+        dropped = 0;
+    }
+};
+
+class CryptoTrace {
+    // Process wide, as the drivers and filters have no way to the shader's CryptomatteData.
+public:
+    static CryptoTrace& get() {
+        static CryptoTrace trace;
+        return trace;
+    }
+
+    bool enabled() const { return num_enabled.load(std::memory_order_relaxed) > 0; }
+
+    // On while any shader has it on, each enable() is matched by a disable().
+    void enable() { num_enabled.fetch_add(1, std::memory_order_relaxed); }
+    void disable() { num_enabled.fetch_sub(1, std::memory_order_relaxed); }
+
+    double now() const {
+        const std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - epoch;
+        return elapsed.count();
+    }
+
+    // The calling thread's buffer, null beyond AI_MAX_THREADS threads.
+    CryptoTraceBuffer* local() { return buffers.local(); }
+
+    // Writes the spans of every thread and starts over. Between renders only.
+    void write(const std::string& path) {
+        uint64_t num_events = 0, dropped = 0;
+        buffers.forEach([&num_events, &dropped](const CryptoTraceBuffer& buffer) {
+            num_events += buffer.events.size();
+            dropped += buffer.dropped;
+        });
+        if (dropped)
+            AiMsgWarning("Cryptomatte: trace dropped %lu spans over %d per thread",
+                         (unsigned long)dropped, CRYPTO_TRACE_MAX_EVENTS);
+        if (write_json(path))
+            AiMsgInfo("Cryptomatte trace of %lu spans written to %s", (unsigned long)num_events,
+                      path.c_str());
+        else
+            AiMsgWarning("Cryptomatte: could not write trace to %s", path.c_str());
+        buffers.reset();
+    }
+
+private:
+    CryptoTrace()
+        : num_enabled(0), epoch(std::chrono::steady_clock::now()),
+          buffers(CryptoTraceBuffer(), AI_MAX_THREADS) {}
+    CryptoTrace(const CryptoTrace&);
+    CryptoTrace& operator=(const CryptoTrace&);
+
+    bool write_json(const std::string& path) const {
+        // complete ("X") events, and a name ("M") event per thread
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file)
+            return false;
+        fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+        bool first = true;
+        buffers.forEach([file, &first](const CryptoTraceBuffer& buffer) {
+            if (buffer.events.empty())
+                return;
+            fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                          "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+                    first ? "" : ",", buffer.thread, buffer.thread);
+            first = false;
+            for (const CryptoTraceEvent& event : buffer.events)
+                fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"cryptomatte\", \"ph\": \"X\", "
+                              "\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                        event.name, buffer.thread, event.start, event.duration);
+        });
+        fprintf(file, "\n]}\n");
+        return fclose(file) == 0;
+    }
+
+    std::atomic<int> num_enabled;
+    std::chrono::steady_clock::time_point epoch;
+    ShardedStats<CryptoTraceBuffer> buffers;
+};
+
+class CryptoTraceSpan {
+    // Records the time from construction to destruction, when tracing was on at construction.
+public:
+    explicit CryptoTraceSpan(const char* name)
+        : name(name), start(CryptoTrace::get().enabled() ? CryptoTrace::get().now() : -1.0) {}
+
+    ~CryptoTraceSpan() {
+        if (start < 0.0)
+            return;
+        CryptoTrace& trace = CryptoTrace::get();
+        if (CryptoTraceBuffer* buffer = trace.local())
+            buffer->add({name, start, trace.now() - start});
+    }
+
+private:
+    const char* name;
+    double start;
+};
@@ -1,5 +1,10 @@
+#pragma once
+#include "cryptomatte_core.h"
+#include "cryptomatte_stats.h"
 #include <ai.h>
 #include <algorithm>
+#include <cstring>
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
@@ -16,7 +21,7 @@ enum filterEnum {
 static const char* filterEnumNames[] = {
     "gaussian", "blackman_harris", "triangle", "box", "disk", "cone", NULL};
 
-float gaussian(AtVector2 p, float width) {
+inline float gaussian(AtVector2 p, float width) {
     /* matches Arnold's exactly. */
     /* Sharpness=2 is good for width 2, sigma=1/sqrt(8) for the width=4,sharpness=4 case */
     // const float sigma = 0.5f;
@@ -40,7 +45,7 @@ float gaussian(AtVector2 p, float width) {
     }
 }
 
-float blackman_harris(AtVector2 p, float width) {
+inline float blackman_harris(AtVector2 p, float width) {
     // Close to matching Arnolds, but not exact.
     p /= (width * 0.5f);
 
@@ -61,13 +66,13 @@ float blackman_harris(AtVector2 p, float width) {
     return weight;
 }
 
-float box(AtVector2 p, float width) {
+inline float box(AtVector2 p, float width) {
     // The trick with matching arnold's filter here is making sure you give a value of 1.0 in the
     // filter update .
     return 1.0f;
 }
 
-float box_strict(AtVector2 p, float width) {
+inline float box_strict(AtVector2 p, float width) {
     // The trick with matching arnold's filter here is making sure you give a value of 1.0 in the
     // filter update.
     if (std::abs(p.x) > 1.0 || std::abs(p.y) > 1.0)
@@ -76,14 +81,14 @@ float box_strict(AtVector2 p, float width) {
         return 0.0f;
 }
 
-float triangle(AtVector2 p, float width) {
+inline float triangle(AtVector2 p, float width) {
     // Still does not match arnold's
     p /= (width * 0.5f);
     float weight = std::abs(p.x) + std::abs(p.y);
     return 2.0f - weight;
 }
 
-float disk(AtVector2 p, float width) {
+inline float disk(AtVector2 p, float width) {
     // Is now extremely close to arnold's
 
     p /= (width * 0.5f);
@@ -95,7 +100,7 @@ float disk(AtVector2 p, float width) {
     }
 }
 
-float cone(AtVector2 p, float width) {
+inline float cone(AtVector2 p, float width) {
     // Is now extremely close to arnold's
 
     p /= (width * 0.5f);
@@ -106,3 +111,68 @@ float cone(AtVector2 p, float width) {
         return 1.0f - distance;
     }
 }
+
+typedef float (*FilterFunc)(AtVector2, float);
+
+inline FilterFunc filter_function(int filter) {
+    switch (filter) {
+    case p_filter_triangle:
+        return &triangle;
+    case p_filter_blackman_harris:
+        return &blackman_harris;
+    case p_filter_box:
+        return &box;
+    case p_filter_disk:
+        return &disk;
+    case p_filter_cone:
+        return &cone;
+    case p_filter_gaussian:
+    default:
+        return &gaussian;
+    }
+}
+
+inline bool is_supported_filter(const char* filter_name) {
+    for (int i = 0; filterEnumNames[i]; i++)
+        if (strcmp(filter_name, filterEnumNames[i]) == 0)
+            return true;
+    return false;
+}
+
+inline int filter_enum(const char* filter_name) {
+    for (int i = 0; filterEnumNames[i]; i++)
+        if (strcmp(filter_name, filterEnumNames[i]) == 0)
+            return i;
+    return p_filter_gaussian;
+}
+
+///////////////////////////////////////////////
+//
+//    ID coverage
+//
+///////////////////////////////////////////////
+
+template <typename GetId>
+inline void accumulate_id_coverage(AtAOVSampleIterator* iterator, FilterFunc filter_func,
+                                   float width, GetId get_id, std::vector<IdCoverage>& coverages,
+                                   AtRGBA* preview = nullptr) {
+    // The coverage of each ID of a pixel, composited by opacity and sorted largest first. Used by
+    // cryptomatte_filter for a single AOV, and by raw drivers for the ID AOVs of every layer.
+    // Also makes the legacy preview color when asked, over what preview held.
+    static const AtString opacity("opacity");
+    IdCoverageAccumulator accumulator(coverages, preview ? &preview->r : nullptr);
+    while (AiAOVSampleIteratorGetNext(iterator)) {
+        const float sample_weight = filter_func(AiAOVSampleIteratorGetOffset(iterator), width);
+        if (sample_weight == 0.0f)
+            continue;
+        accumulator.begin_sample(sample_weight * AiAOVSampleIteratorGetInvDensity(iterator));
+        while (AiAOVSampleIteratorGetNextDepth(iterator))
+            accumulator.add_depth_sample(
+                get_id(iterator), AiColorToGrey(AiAOVSampleIteratorGetAOVRGB(iterator, opacity)));
+        accumulator.end_sample();
+    }
+
+    accumulator.finish();
+    if (CryptoThreadStats* stats = crypto_thread_stats())
+        stats->add_pixel_ids(coverages.size());
+}
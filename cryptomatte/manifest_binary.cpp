@@ -0,0 +1,345 @@
+#include "manifest_binary.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char binary_magic[8] = {'C', 'R', 'Y', 'P', 'M', 'A', 'N', 'F'};
+static const uint32_t binary_version = 1;
+static const size_t header_size = 24;
+
+static size_t hashes_size(uint32_t count) { return ((size_t)count * 4 + 7) & ~(size_t)7; }
+
+///////////////////////////////////////////////
+//
+//      Encoding
+//
+///////////////////////////////////////////////
+
+template <typename T> static void append_pod(std::string& out, const T& value) {
+    // values are written in host order; every platform Arnold runs on is little endian
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void encode_binary_manifest(std::vector<ManifestEntry>& entries, std::string& encoded) {
+    std::sort(entries.begin(), entries.end(), [](const ManifestEntry& a, const ManifestEntry& b) {
+        return a.hash < b.hash || (a.hash == b.hash && a.name < b.name);
+    });
+    const uint32_t count = (uint32_t)entries.size();
+    uint64_t blob_size = 0;
+    for (const auto& entry : entries)
+        blob_size += entry.name.length() + 1;
+
+    encoded.clear();
+    encoded.reserve(header_size + hashes_size(count) + ((size_t)count + 1) * 8 + blob_size);
+    encoded.append(binary_magic, 8);
+    append_pod(encoded, binary_version);
+    append_pod(encoded, count);
+    append_pod(encoded, blob_size);
+    for (const auto& entry : entries)
+        append_pod(encoded, entry.hash);
+    encoded.append(hashes_size(count) - (size_t)count * 4, '\0');
+    uint64_t offset = 0;
+    for (const auto& entry : entries) {
+        append_pod(encoded, offset);
+        offset += entry.name.length() + 1;
+    }
+    append_pod(encoded, offset);
+    for (const auto& entry : entries)
+        encoded.append(entry.name.c_str(), entry.name.length() + 1);
+}
+
+void encode_json_manifest(const std::vector<ManifestEntry>& entries, std::string& encoded) {
+    encoded.append("{");
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (i)
+            encoded.append(",");
+        encoded.append("\"");
+        for (const char c : entries[i].name) {
+            if (c == '"' || c == '\\' || c == '/')
+                encoded += '\\';
+            encoded += c;
+        }
+        char hex_chars[9];
+        sprintf(hex_chars, "%08x", entries[i].hash);
+        encoded.append("\":\"");
+        encoded.append(hex_chars);
+        encoded.append("\"");
+    }
+    encoded.append("}");
+}
+
+///////////////////////////////////////////////
+//
+//      JSON parsing
+//
+///////////////////////////////////////////////
+
+static void skip_space(const std::string& json, size_t& pos) {
+    while (pos < json.length() &&
+           (json[pos] == ' ' || json[pos] == '\t' || json[pos] == '\n' || json[pos] == '\r'))
+        pos++;
+}
+
+static void append_utf8(std::string& out, uint32_t code) {
+    if (code < 0x80) {
+        out += (char)code;
+    } else if (code < 0x800) {
+        out += (char)(0xC0 | (code >> 6));
+        out += (char)(0x80 | (code & 0x3F));
+    } else if (code < 0x10000) {
+        out += (char)(0xE0 | (code >> 12));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    } else {
+        out += (char)(0xF0 | (code >> 18));
+        out += (char)(0x80 | ((code >> 12) & 0x3F));
+        out += (char)(0x80 | ((code >> 6) & 0x3F));
+        out += (char)(0x80 | (code & 0x3F));
+    }
+}
+
+static bool parse_hex4(const std::string& json, size_t& pos, uint32_t& code) {
+    // the 4 hex digits of a \u escape
+    if (pos + 4 > json.length())
+        return false;
+    code = 0;
+    for (size_t end = pos + 4; pos < end; pos++) {
+        const char c = json[pos];
+        code <<= 4;
+        if (c >= '0' && c <= '9')
+            code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            code |= c - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+static bool parse_unicode_escape(const std::string& json, size_t& pos, std::string& out) {
+    // After "\u". Code points above U+FFFF are escaped as a UTF-16 surrogate pair, which is
+    // one code point, and its UTF-8 is what names are hashed as. Unpaired surrogates are errors.
+    uint32_t code;
+    if (!parse_hex4(json, pos, code))
+        return false;
+    if (code >= 0xDC00 && code <= 0xDFFF)
+        return false;
+    if (code >= 0xD800 && code <= 0xDBFF) {
+        uint32_t low;
+        if (json.compare(pos, 2, "\\u") != 0)
+            return false;
+        pos += 2;
+        if (!parse_hex4(json, pos, low) || low < 0xDC00 || low > 0xDFFF)
+            return false;
+        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+    }
+    append_utf8(out, code);
+    return true;
+}
+
+static bool parse_string(const std::string& json, size_t& pos, std::string& out) {
+    out.clear();
+    if (pos >= json.length() || json[pos] != '"')
+        return false;
+    pos++;
+    while (pos < json.length()) {
+        const char c = json[pos++];
+        if (c == '"')
+            return true;
+        if (c != '\\') {
+            out += c;
+            continue;
+        }
+        if (pos >= json.length())
+            return false;
+        const char escaped = json[pos++];
+        switch (escaped) {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u':
+            if (!parse_unicode_escape(json, pos, out))
+                return false;
+            break;
+        default: out += escaped; break; // \" \\ \/
+        }
+    }
+    return false;
+}
+
+bool parse_json_manifest(const std::string& json, std::vector<ManifestEntry>& entries) {
+    // Only what manifests use: a single object of string names to hex string hashes.
+    entries.clear();
+    size_t pos = 0;
+    skip_space(json, pos);
+    if (pos >= json.length() || json[pos++] != '{')
+        return false;
+    skip_space(json, pos);
+    if (pos < json.length() && json[pos] == '}')
+        return true;
+
+    std::string hex;
+    while (pos < json.length()) {
+        ManifestEntry entry;
+        skip_space(json, pos);
+        if (!parse_string(json, pos, entry.name))
+            return false;
+        skip_space(json, pos);
+        if (pos >= json.length() || json[pos++] != ':')
+            return false;
+        skip_space(json, pos);
+        if (!parse_string(json, pos, hex) || hex.empty())
+            return false;
+        char* end = nullptr;
+        entry.hash = (uint32_t)strtoul(hex.c_str(), &end, 16);
+        if (*end != '\0')
+            return false;
+        entries.push_back(entry);
+
+        skip_space(json, pos);
+        if (pos >= json.length())
+            return false;
+        const char separator = json[pos++];
+        if (separator == '}')
+            return true;
+        if (separator != ',')
+            return false;
+    }
+    return false;
+}
+
+///////////////////////////////////////////////
+//
+//      BinaryManifest
+//
+///////////////////////////////////////////////
+
+bool is_binary_manifest(const char* data, size_t size) {
+    return size >= header_size && memcmp(data, binary_magic, 8) == 0;
+}
+
+bool BinaryManifest::view(const char* view_data, size_t view_size) {
+    close();
+    return validate(view_data, view_size);
+}
+
+bool BinaryManifest::validate(const char* view_data, size_t view_size) {
+    if (!is_binary_manifest(view_data, view_size))
+        return false;
+    uint32_t version, view_count;
+    uint64_t blob_size;
+    memcpy(&version, view_data + 8, 4);
+    memcpy(&view_count, view_data + 12, 4);
+    memcpy(&blob_size, view_data + 16, 8);
+    if (version != binary_version)
+        return false;
+
+    const size_t offsets_start = header_size + hashes_size(view_count);
+    const size_t blob_start = offsets_start + ((size_t)view_count + 1) * 8;
+    if (blob_start > view_size || blob_size != view_size - blob_start)
+        return false;
+
+    const uint32_t* view_hashes = reinterpret_cast<const uint32_t*>(view_data + header_size);
+    const uint64_t* view_offsets = reinterpret_cast<const uint64_t*>(view_data + offsets_start);
+    const char* view_blob = view_data + blob_start;
+    // every name must start inside the blob and be null terminated by the next one
+    if (view_offsets[view_count] != blob_size)
+        return false;
+    for (uint32_t i = 0; i < view_count; i++) {
+        if (view_offsets[i] >= view_offsets[i + 1] || view_blob[view_offsets[i + 1] - 1] != '\0')
+            return false;
+        if (i && view_hashes[i - 1] > view_hashes[i])
+            return false;
+    }
+
+    data = view_data;
+    data_size = view_size;
+    count = view_count;
+    hashes = view_hashes;
+    offsets = view_offsets;
+    blob = view_blob;
+    return true;
+}
+
+bool BinaryManifest::open(const std::string& path) {
+    close();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER file_size;
+    HANDLE file_mapping = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+        file_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file); // the mapping keeps the file open
+    if (!file_mapping)
+        return false;
+    const void* mapped = MapViewOfFile(file_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped) {
+        CloseHandle(file_mapping);
+        return false;
+    }
+    mapping = file_mapping;
+    const size_t mapped_size = (size_t)file_size.QuadPart;
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (mapped == MAP_FAILED)
+        return false;
+    mapping = mapped;
+    const size_t mapped_size = (size_t)st.st_size;
+#endif
+    data = static_cast<const char*>(mapped);
+    data_size = mapped_size;
+    if (!validate(data, data_size)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void BinaryManifest::close() {
+    if (mapping) {
+#if defined(_WIN32)
+        UnmapViewOfFile(data);
+        CloseHandle((HANDLE)mapping);
+#else
+        munmap(mapping, data_size);
+#endif
+    }
+    mapping = nullptr;
+    data = nullptr;
+    data_size = 0;
+    count = 0;
+    hashes = nullptr;
+    offsets = nullptr;
+    blob = nullptr;
+}
+
+const char* BinaryManifest::find(uint32_t hash) const {
+    const uint32_t* found = std::lower_bound(hashes, hashes + count, hash);
+    if (found == hashes + count || *found != hash)
+        return nullptr;
+    return name((uint32_t)(found - hashes));
+}
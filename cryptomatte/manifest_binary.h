@@ -0,0 +1,71 @@
+#pragma once
+/*
+Binary sidecar manifests, an alternative to JSON for very large manifests.
+
+All values are little endian. The file is laid out as:
+
+    char     magic[8]            "CRYPMANF"
+    uint32_t version             1
+    uint32_t count               number of entries
+    uint64_t blob_size           size of the string blob in bytes
+    uint32_t hashes[count]       sorted, padded with zeros to a multiple of 8 bytes
+    uint64_t offsets[count + 1]  start of each name in the blob, then blob_size
+    char     blob[blob_size]     names, each followed by a null
+
+so a memory mapped file can be searched for a hash in O(log n) without parsing anything.
+Entries with the same hash (collisions) are sorted by name.
+*/
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Recorded in the cryptomatte metadata as "cryptomatte/<id>/manif_format".
+#define CRYPTO_BINARY_MANIFEST_FORMAT "binary_v1"
+#define CRYPTO_BINARY_MANIFEST_EXTENSION ".cryptomanifest"
+
+struct ManifestEntry {
+    std::string name;
+    uint32_t hash; // bits of the float ID
+};
+
+// Encodes entries in the binary format. Entries are sorted in place.
+void encode_binary_manifest(std::vector<ManifestEntry>& entries, std::string& encoded);
+
+// JSON manifests, as embedded in EXR metadata: {"name":"hex hash",...}
+void encode_json_manifest(const std::vector<ManifestEntry>& entries, std::string& encoded);
+bool parse_json_manifest(const std::string& json, std::vector<ManifestEntry>& entries);
+
+bool is_binary_manifest(const char* data, size_t size);
+
+class BinaryManifest {
+public:
+    BinaryManifest() {}
+    ~BinaryManifest() { close(); }
+
+    // Maps a file, or views an 8 byte aligned buffer owned by the caller. Both validate the
+    // layout.
+    bool open(const std::string& path);
+    bool view(const char* data, size_t size);
+    void close();
+
+    uint32_t size() const { return count; }
+    uint32_t hash(uint32_t i) const { return hashes[i]; }
+    const char* name(uint32_t i) const { return blob + offsets[i]; }
+
+    // Name of the first entry with the hash, or nullptr.
+    const char* find(uint32_t hash) const;
+
+private:
+    BinaryManifest(const BinaryManifest&);
+    BinaryManifest& operator=(const BinaryManifest&);
+    bool validate(const char* view_data, size_t view_size);
+
+    const char* data = nullptr;
+    size_t data_size = 0;
+    void* mapping = nullptr; // platform mapping handle, when the data is a mapped file
+    uint32_t count = 0;
+    const uint32_t* hashes = nullptr;
+    const uint64_t* offsets = nullptr;
+    const char* blob = nullptr;
+};
@@ -0,0 +1,155 @@
+#include "manifest_cache.h"
+#include "MurmurHash3.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+///////////////////////////////////////////////
+//
+//      ManifestFingerprint
+//
+///////////////////////////////////////////////
+
+void ManifestFingerprint::add(const void* data, size_t len) {
+    uint64_t hash[2];
+    MurmurHash3_x64_128(data, (int)len, 0, hash);
+    // wrapping sums rather than xor, so that duplicates don't cancel each other out
+    h1 += hash[0];
+    h2 += hash[1];
+    count++;
+}
+
+void ManifestFingerprint::merge(const ManifestFingerprint& other) {
+    h1 += other.h1;
+    h2 += other.h2;
+    count += other.count;
+}
+
+std::string ManifestFingerprint::hex() const {
+    char hex_chars[49];
+    sprintf(hex_chars, "%016llx%016llx%016llx", (unsigned long long)h1, (unsigned long long)h2,
+            (unsigned long long)count);
+    return std::string(hex_chars);
+}
+
+///////////////////////////////////////////////
+//
+//      ManifestCacheLock
+//
+///////////////////////////////////////////////
+
+ManifestCacheLock::ManifestCacheLock(const std::string& lock_path) : handle(invalid_handle()) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(lock_path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return;
+    OVERLAPPED overlapped = {0};
+    if (!LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped)) {
+        CloseHandle(file);
+        return;
+    }
+    handle = (intptr_t)file;
+#else
+    int fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+        return;
+    int result;
+    do {
+        result = flock(fd, LOCK_EX);
+    } while (result != 0 && errno == EINTR);
+    if (result != 0) {
+        close(fd);
+        return;
+    }
+    handle = (intptr_t)fd;
+#endif
+}
+
+ManifestCacheLock::~ManifestCacheLock() {
+    if (!locked())
+        return;
+#if defined(_WIN32)
+    OVERLAPPED overlapped = {0};
+    UnlockFileEx((HANDLE)handle, 0, MAXDWORD, MAXDWORD, &overlapped);
+    CloseHandle((HANDLE)handle);
+#else
+    flock((int)handle, LOCK_UN);
+    close((int)handle);
+#endif
+}
+
+///////////////////////////////////////////////
+//
+//      ManifestCache
+//
+///////////////////////////////////////////////
+
+static void make_directory(const std::string& directory) {
+#if defined(_WIN32)
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0777);
+#endif
+}
+
+static bool rename_replacing(const std::string& from, const std::string& to) {
+#if defined(_WIN32)
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+ManifestCache::ManifestCache(const std::string& directory,
+                             const ManifestFingerprint& fingerprint) {
+    make_directory(directory); // fine if it exists already
+    prefix = directory;
+    if (!prefix.empty() && prefix[prefix.length() - 1] != '/' &&
+        prefix[prefix.length() - 1] != '\\')
+        prefix += "/";
+    prefix += fingerprint.hex() + ".";
+}
+
+bool ManifestCache::read(const std::string& manifest_key, std::string& manifest) const {
+    std::ifstream in((prefix + manifest_key).c_str(), std::ios::in | std::ios::binary);
+    if (!in)
+        return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    if (in.bad())
+        return false;
+    manifest = contents.str();
+    return true;
+}
+
+bool ManifestCache::write(const std::string& manifest_key, const std::string& manifest) const {
+    const std::string path = prefix + manifest_key;
+    std::ostringstream tmp_path;
+    tmp_path << path << ".tmp" << getpid();
+
+    std::ofstream out(tmp_path.str().c_str(), std::ios::out | std::ios::binary);
+    if (!out)
+        return false;
+    out << manifest;
+    out.close();
+    if (out.fail() || !rename_replacing(tmp_path.str(), path)) {
+        remove(tmp_path.str().c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+/*
+On-disk cache of encoded manifests, shared between render processes.
+
+Entries are keyed by a fingerprint of everything that goes into the manifests (shape names,
+shader names, relevant user data and naming options), so consecutive frames of a shot that
+contain the same names reuse the encoded manifests built by the first one. Keys include the
+file extension of the manifest format.
+
+Entries are written to a temporary file and renamed into place, so readers never see a partial
+entry and do not lock. Writers hold an exclusive lock on the fingerprint's lock file while they
+compile, so that concurrent renders of the same content compile it only once. Locking is local
+(flock, LockFileEx), so the cache directory should be on a local disk.
+*/
+
+#include <stdint.h>
+#include <string>
+
+struct ManifestFingerprint {
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    uint64_t count = 0;
+
+    // Order independent, so partial fingerprints can be built in parallel.
+    void add(const void* data, size_t len);
+    void merge(const ManifestFingerprint& other);
+    std::string hex() const;
+};
+
+class ManifestCacheLock {
+public:
+    ManifestCacheLock(const std::string& lock_path);
+    ~ManifestCacheLock();
+    bool locked() const { return handle != invalid_handle(); }
+
+private:
+    ManifestCacheLock(const ManifestCacheLock&);
+    ManifestCacheLock& operator=(const ManifestCacheLock&);
+    static intptr_t invalid_handle() { return -1; }
+    intptr_t handle;
+};
+
+class ManifestCache {
+public:
+    ManifestCache(const std::string& directory, const ManifestFingerprint& fingerprint);
+
+    bool read(const std::string& manifest_key, std::string& manifest) const;
+    bool write(const std::string& manifest_key, const std::string& manifest) const;
+
+    // Path of the lock file writers hold while compiling manifests for this fingerprint.
+    std::string lock_path() const { return prefix + "lock"; }
+
+private:
+    std::string prefix; // directory/fingerprint.
+};
@@ -0,0 +1,73 @@
+/*
+Converts sidecar manifests between JSON and the binary format (see manifest_binary.h).
+
+    cryptomatte_manifest_convert <input> <output>
+
+The direction is taken from the input, binary manifests become JSON and JSON becomes binary.
+*/
+
+#include "manifest_binary.h"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+static bool read_file(const char* path, std::string& contents) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    if (!in)
+        return false;
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    contents = buffer.str();
+    return !in.bad();
+}
+
+static bool write_file(const char* path, const std::string& contents) {
+    std::ofstream out(path, std::ios::out | std::ios::binary);
+    out.write(contents.data(), contents.size());
+    out.close();
+    return !out.fail();
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input> <output>\n"
+                        "Converts a cryptomatte manifest from JSON to binary, or binary to JSON.\n",
+                argv[0]);
+        return 2;
+    }
+
+    std::string contents;
+    if (!read_file(argv[1], contents)) {
+        fprintf(stderr, "could not read %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<ManifestEntry> entries;
+    std::string converted;
+    if (is_binary_manifest(contents.data(), contents.size())) {
+        BinaryManifest manifest;
+        if (!manifest.open(argv[1])) {
+            fprintf(stderr, "%s is not a valid binary manifest\n", argv[1]);
+            return 1;
+        }
+        entries.resize(manifest.size());
+        for (uint32_t i = 0; i < manifest.size(); i++) {
+            entries[i].name = manifest.name(i);
+            entries[i].hash = manifest.hash(i);
+        }
+        encode_json_manifest(entries, converted);
+    } else {
+        if (!parse_json_manifest(contents, entries)) {
+            fprintf(stderr, "%s is not a valid JSON manifest\n", argv[1]);
+            return 1;
+        }
+        encode_binary_manifest(entries, converted);
+    }
+
+    if (!write_file(argv[2], converted)) {
+        fprintf(stderr, "could not write %s\n", argv[2]);
+        return 1;
+    }
+    printf("%s: %lu entries\n", argv[2], (unsigned long)entries.size());
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "manifest_deflate.h"
+
+#ifdef CRYPTO_HAVE_ZLIB
+
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+#include <zlib.h>
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void base64_encode(const unsigned char* data, size_t len, std::string& out) {
+    out.clear();
+    out.reserve((len + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < len; i += 3) {
+        const uint32_t bits = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        out += base64_chars[(bits >> 18) & 63];
+        out += base64_chars[(bits >> 12) & 63];
+        out += base64_chars[(bits >> 6) & 63];
+        out += base64_chars[bits & 63];
+    }
+    if (i < len) {
+        const uint32_t bits = (data[i] << 16) | (i + 1 < len ? data[i + 1] << 8 : 0);
+        out += base64_chars[(bits >> 18) & 63];
+        out += base64_chars[(bits >> 12) & 63];
+        out += i + 1 < len ? base64_chars[(bits >> 6) & 63] : '=';
+        out += '=';
+    }
+}
+
+static bool base64_decode(const std::string& in, std::vector<unsigned char>& out) {
+    out.clear();
+    out.reserve(in.length() / 4 * 3);
+    uint32_t bits = 0;
+    int num_bits = 0;
+    for (const char c : in) {
+        if (c == '=')
+            break;
+        const char* found = c ? strchr(base64_chars, c) : nullptr;
+        if (!found)
+            return false;
+        bits = (bits << 6) | (uint32_t)(found - base64_chars);
+        num_bits += 6;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            out.push_back((unsigned char)((bits >> num_bits) & 0xFF));
+        }
+    }
+    return true;
+}
+
+bool manifest_deflate_available() { return true; }
+
+bool deflate_manifest(const std::string& manifest, std::string& encoded) {
+    uLongf compressed_size = compressBound((uLong)manifest.size());
+    std::vector<unsigned char> compressed(compressed_size);
+    if (compress2(compressed.data(), &compressed_size,
+                  reinterpret_cast<const Bytef*>(manifest.data()), (uLong)manifest.size(),
+                  Z_DEFAULT_COMPRESSION) != Z_OK)
+        return false;
+    base64_encode(compressed.data(), compressed_size, encoded);
+    return true;
+}
+
+bool inflate_manifest(const std::string& encoded, std::string& manifest) {
+    std::vector<unsigned char> compressed;
+    if (!base64_decode(encoded, compressed))
+        return false;
+
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    stream.next_in = compressed.data();
+    stream.avail_in = (uInt)compressed.size();
+    manifest.clear();
+    char buffer[16384];
+    int result = Z_OK;
+    while (result == Z_OK) {
+        stream.next_out = reinterpret_cast<Bytef*>(buffer);
+        stream.avail_out = sizeof(buffer);
+        result = inflate(&stream, Z_NO_FLUSH);
+        manifest.append(buffer, sizeof(buffer) - stream.avail_out);
+    }
+    inflateEnd(&stream);
+    return result == Z_STREAM_END;
+}
+
+#else
+
+bool manifest_deflate_available() { return false; }
+bool deflate_manifest(const std::string&, std::string&) { return false; }
+bool inflate_manifest(const std::string&, std::string&) { return false; }
+
+#endif
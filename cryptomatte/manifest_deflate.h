@@ -0,0 +1,16 @@
+#pragma once
+/*
+Compressed embedded manifests, stored as "cryptomatte/<id>/manifest_deflate". The value is the
+manifest JSON compressed as a zlib stream (RFC 1950), then base64 encoded so that it stays a
+valid EXR string attribute. In python: zlib.decompress(base64.b64decode(value)).
+
+Compression needs zlib at build time (CRYPTO_HAVE_ZLIB), without it manifests stay plain. So do
+manifests that compression doesn't make smaller, which is common for small scenes. Sizes and times
+are in cryptomatte_benchmark --filter manifest.
+*/
+
+#include <string>
+
+bool manifest_deflate_available();
+bool deflate_manifest(const std::string& manifest, std::string& encoded);
+bool inflate_manifest(const std::string& encoded, std::string& manifest);
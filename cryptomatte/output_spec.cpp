@@ -0,0 +1,178 @@
+#include "output_spec.h"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+static std::atomic<size_t> num_parses(0);
+
+std::string OutputSpec::str() const {
+    std::string output;
+    if (!camera.empty())
+        output += camera + " ";
+    output += aov + " " + type + " " + filter + " " + driver;
+    if (half)
+        output += " HALF";
+    if (!layer.empty())
+        output += " " + layer;
+    return output;
+}
+
+static bool is_output_type(const std::string& token) {
+    static const char* types[] = {"FLOAT", "RGB",    "RGBA", "VECTOR", "VECTOR2", "INT", "UINT",
+                                  "BOOL",  "BYTE",   "NODE", "MATRIX", "STRING",  "POINTER"};
+    for (const char* type : types)
+        if (token == type)
+            return true;
+    return false;
+}
+
+bool parse_output_spec(const char* output, OutputSpec& spec) {
+    num_parses++;
+    spec = OutputSpec();
+    if (!output)
+        return false;
+
+    std::string tokens[7];
+    int num_tokens = 0;
+    const char* c = output;
+    while (*c && num_tokens < 7) {
+        while (*c == ' ')
+            c++;
+        const char* token_start = c;
+        while (*c && *c != ' ')
+            c++;
+        if (c != token_start)
+            tokens[num_tokens++].assign(token_start, c - token_start);
+    }
+    if (num_tokens < 4)
+        return false;
+
+    // the type follows the AOV, which follows the camera if there is one. AOVs can be named like
+    // types (RGBA RGBA ...), filters can't be.
+    const bool has_camera = num_tokens >= 5 && is_output_type(tokens[2]);
+    const int first = has_camera ? 1 : 0;
+    if (first + 4 > num_tokens)
+        return false;
+    if (has_camera)
+        spec.camera = tokens[0];
+    spec.aov = tokens[first];
+    spec.type = tokens[first + 1];
+    spec.filter = tokens[first + 2];
+    spec.driver = tokens[first + 3];
+    int next = first + 4;
+    if (next < num_tokens && strncmp(tokens[next].c_str(), "HALF", 4) == 0) {
+        spec.half = true;
+        next++;
+    }
+    if (next < num_tokens)
+        spec.layer = tokens[next];
+    return true;
+}
+
+size_t output_spec_parses() { return num_parses; }
+
+std::string rank_aov_name(const std::string& aov, int rank) {
+    char rank_number[16];
+    sprintf(rank_number, "%02d", rank);
+    return aov + rank_number;
+}
+
+std::string rank_filter_name(const std::string& aov, int rank) {
+    return rank_aov_name(aov + "_filter", rank);
+}
+
+std::string id_aov_name(const std::string& aov) { return aov + "_id"; }
+
+std::string preview_filter_name(const std::string& aov) { return aov + "_preview_filter"; }
+
+bool is_preview_output(const OutputSpec& spec) {
+    return !spec.layer.empty() && spec.aov == id_aov_name(spec.layer) &&
+           spec.filter == preview_filter_name(spec.layer);
+}
+
+bool is_layer_output(const OutputSpec& spec) {
+    return !spec.layer.empty() && spec.aov == id_aov_name(spec.layer) &&
+           spec.filter != preview_filter_name(spec.layer);
+}
+
+OutputRewrite::OutputRewrite(const std::vector<std::string>& outputs,
+                             const std::string& manifest_output)
+    : existing(outputs), replaced(outputs.size()), dropped(outputs.size(), false),
+      halved(outputs.size(), false), manifest(manifest_output) {
+    for (size_t i = 0; i < existing.size(); i++) {
+        if (existing[i] == manifest) {
+            if (first_manifest < 0)
+                first_manifest = (int)i;
+            num_manifests++;
+        }
+        index.insert(existing[i]);
+        num_lookups++;
+    }
+}
+
+void OutputRewrite::replace(size_t i, const std::string& output) {
+    replaced[i] = output;
+    num_changed++;
+}
+
+void OutputRewrite::drop(size_t i) {
+    dropped[i] = true;
+    num_changed++;
+}
+
+void OutputRewrite::set_half(size_t i) {
+    if (!halved[i])
+        num_changed++;
+    halved[i] = true;
+}
+
+bool OutputRewrite::add(const std::string& output) {
+    num_lookups++;
+    if (!index.insert(output))
+        return false;
+    added.push_back(output);
+    return true;
+}
+
+size_t OutputRewrite::add_rank_outputs(const OutputSpec& spec, int depth) {
+    OutputSpec rank_spec;
+    rank_spec.camera = spec.camera;
+    rank_spec.aov = id_aov_name(spec.aov);
+    rank_spec.type = "FLOAT";
+    rank_spec.driver = spec.driver;
+    size_t num_added = 0;
+    for (int i = 0; i < depth; i++) {
+        rank_spec.layer = rank_aov_name(spec.aov, i);
+        rank_spec.filter = rank_filter_name(spec.aov, i);
+        if (add(rank_spec.str()))
+            num_added++;
+    }
+    return num_added;
+}
+
+bool OutputRewrite::changed() const {
+    // the manifest output moves to the front, and duplicates go
+    const bool move_manifest = has_manifest_output() && (first_manifest != 0 || num_manifests > 1);
+    return num_changed || !added.empty() || move_manifest;
+}
+
+std::vector<std::string> OutputRewrite::outputs() const {
+    std::vector<std::string> result;
+    result.reserve(1 + existing.size() + added.size());
+    if (has_manifest_output())
+        result.push_back(manifest);
+    OutputSpec spec;
+    for (size_t i = 0; i < existing.size(); i++) {
+        if (dropped[i] || is_manifest_output(i))
+            continue;
+        const std::string& output = replaced[i].empty() ? existing[i] : replaced[i];
+        if (halved[i] && parse_output_spec(output.c_str(), spec)) {
+            spec.half = true;
+            result.push_back(spec.str());
+        } else {
+            result.push_back(output);
+        }
+    }
+    result.insert(result.end(), added.begin(), added.end());
+    return result;
+}
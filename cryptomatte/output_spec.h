@@ -0,0 +1,120 @@
+#pragma once
+/*
+Parsing of Arnold output strings, options.outputs entries such as
+
+    [camera] aov type filter driver [HALF] [layer]
+
+Parsed once into OutputSpecs, with an OutputIndex of every output string for deduplication, so
+that setting up cryptomattes is linear in the number of outputs. OutputRewrite is the rewrite of
+options.outputs that setup makes, without the Arnold calls.
+*/
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct OutputSpec {
+    std::string camera; // empty unless given
+    std::string aov;
+    std::string type;
+    std::string filter;
+    std::string driver;
+    bool half = false;
+    std::string layer; // output name in the driver, empty for the AOV name
+
+    std::string str() const;
+};
+
+// False for strings with too few tokens to be an output.
+bool parse_output_spec(const char* output, OutputSpec& spec);
+// Calls of parse_output_spec so far, from all threads. Setup parses each output once.
+size_t output_spec_parses();
+
+// Names of the per rank layers and filters of a cryptomatte, e.g. crypto_object00 and
+// crypto_object_filter00. Every rank is an output of the cryptomatte's single ID AOV, e.g.
+// crypto_object_id, written to the driver under its rank layer name.
+std::string rank_aov_name(const std::string& aov, int rank);
+std::string rank_filter_name(const std::string& aov, int rank);
+std::string id_aov_name(const std::string& aov);
+
+// The legacy preview layer of a cryptomatte is its ID AOV through a preview filter, written under
+// the cryptomatte's own name.
+std::string preview_filter_name(const std::string& aov);
+bool is_preview_output(const OutputSpec& spec);
+
+// The cryptomatte_exr driver writes a cryptomatte whole from one output of its ID AOV, through
+// the cryptomatte's own filter, written under the cryptomatte's name.
+bool is_layer_output(const OutputSpec& spec);
+
+class OutputIndex {
+public:
+    // True if the output was not in the index yet.
+    bool insert(const std::string& output) { return outputs.insert(output).second; }
+    bool contains(const std::string& output) const { return outputs.count(output) != 0; }
+    size_t size() const { return outputs.size(); }
+
+private:
+    std::unordered_set<std::string> outputs;
+};
+
+class OutputRewrite {
+    // The outputs as setup leaves them: the manifest driver's output first and only once, then
+    // the existing outputs in order, replaced, dropped or set to HALF, then the new outputs.
+    // Every output is indexed once and every added output looked up once, which lookups() counts.
+public:
+    OutputRewrite(const std::vector<std::string>& outputs, const std::string& manifest_output);
+
+    size_t size() const { return existing.size(); }
+    const std::string& output(size_t i) const { return existing[i]; }
+    bool is_manifest_output(size_t i) const { return existing[i] == manifest; }
+
+    // Of the existing output i.
+    void replace(size_t i, const std::string& output);
+    void drop(size_t i);
+    void set_half(size_t i);
+
+    // Adds the manifest driver's output, if there is none.
+    void add_manifest_output() { manifest_wanted = true; }
+    // Adds the output after the existing ones, unless it's there already. True if it was added.
+    bool add(const std::string& output);
+    // Adds the rank outputs of a cryptomatte's ID AOV, returns how many were not there already.
+    size_t add_rank_outputs(const OutputSpec& spec, int depth);
+
+    // False if outputs() are the outputs given.
+    bool changed() const;
+    std::vector<std::string> outputs() const;
+
+    size_t lookups() const { return num_lookups; }
+
+private:
+    bool has_manifest_output() const { return manifest_wanted || first_manifest >= 0; }
+
+    std::vector<std::string> existing;
+    std::vector<std::string> replaced; // empty for outputs left as they are
+    std::vector<bool> dropped;
+    std::vector<bool> halved;
+    std::vector<std::string> added;
+    OutputIndex index;
+    std::string manifest;
+    int first_manifest = -1;
+    size_t num_manifests = 0;
+    bool manifest_wanted = false;
+    size_t num_changed = 0;
+    size_t num_lookups = 0;
+};
+
+// Parses each existing output of the rewrite once, other than the manifest driver's, and calls
+// visit(i, spec, is_preview, is_layer). Preview and layer outputs are given the name of the
+// cryptomatte they stand in for as their AOV.
+template <typename Visit> void visit_outputs(const OutputRewrite& rewrite, Visit visit) {
+    OutputSpec spec;
+    for (size_t i = 0; i < rewrite.size(); i++) {
+        if (rewrite.is_manifest_output(i) || !parse_output_spec(rewrite.output(i).c_str(), spec))
+            continue;
+        const bool is_preview = is_preview_output(spec);
+        const bool is_layer = is_layer_output(spec);
+        if (is_preview || is_layer)
+            spec.aov = spec.layer;
+        visit(i, spec, is_preview, is_layer);
+    }
+}
@@ -0,0 +1,166 @@
+#
+#
+#  Copyright (c) 2014, 2015, 2016, 2017 Psyop Media Company, LLC
+#  See license.txt
+#
+#
+"""
+Benchmarks reading one cryptomatte from a single-part EXR holding every AOV, against reading it
+from its own part of a multi-part EXR (cryptomatte_exr's multipart option).
+
+    python tests/benchmark_multipart_read.py [--layer crypto_object] [single.exr multi.exr]
+
+Given no files, writes a synthetic pair: a beauty and other AOVs, and asset, object and material
+cryptomattes, all in one part, or the AOVs in one part and each cryptomatte in its own. Reading
+a cryptomatte from the single part decompresses every channel of the file, which is what a comp
+keyer pays for today. Needs OpenImageIO and numpy.
+"""
+from __future__ import print_function
+
+import argparse
+import os
+import tempfile
+import timeit
+
+import numpy as np
+import OpenImageIO as oiio
+
+CRYPTOMATTES = ["crypto_asset", "crypto_object", "crypto_material"]
+
+
+def aov_channels(num_aovs):
+    channels = ["R", "G", "B", "A"]
+    for i in range(num_aovs):
+        channels += ["aov%d.%s" % (i, c) for c in "RGB"]
+    return channels
+
+
+def cryptomatte_channels(layer, depth):
+    return ["%s%02d.%s" % (layer, rank, c) for rank in range((depth + 1) // 2) for c in "RGBA"]
+
+
+def synthetic_aovs(width, height, num_channels, rng):
+    # smooth with noise, roughly how renders compress
+    y, x = np.mgrid[0:height, 0:width].astype(np.float32)
+    base = np.sin(x / 37.0)[..., None] * np.cos(y / 53.0)[..., None]
+    noise = rng.normal(0.0, 0.05, (height, width, num_channels)).astype(np.float32)
+    return base + noise
+
+
+def synthetic_cryptomatte(width, height, depth, num_ids, rng):
+    # blocks of IDs, with the coverage of the first rank falling off at their edges
+    ids = rng.random_sample(num_ids).astype(np.float32)
+    pixels = np.zeros((height, width, (depth + 1) // 2 * 4), np.float32)
+    y, x = np.mgrid[0:height, 0:width]
+    blocks = (x // 24 + (y // 24) * 97) % num_ids
+    edge = np.minimum(np.minimum(x % 24, 23 - x % 24), np.minimum(y % 24, 23 - y % 24))
+    coverage = np.clip(0.5 + edge / 4.0, 0.5, 1.0).astype(np.float32)
+    pixels[..., 0] = ids[blocks]
+    pixels[..., 1] = coverage
+    pixels[..., 2] = ids[(blocks + 1) % num_ids]
+    pixels[..., 3] = 1.0 - coverage
+    return pixels
+
+
+def part_spec(width, height, channels, name):
+    spec = oiio.ImageSpec(width, height, len(channels), oiio.FLOAT)
+    spec.channelnames = tuple(channels)
+    spec.attribute("compression", "zip")
+    spec.attribute("oiio:subimagename", name)
+    return spec
+
+
+def write_parts(path, parts):
+    """parts is a list of (name, channel names, pixels)."""
+    specs = tuple(part_spec(p[2].shape[1], p[2].shape[0], p[1], p[0]) for p in parts)
+    out = oiio.ImageOutput.create(path)
+    if len(specs) == 1:
+        out.open(path, specs[0])
+    else:
+        out.open(path, specs)
+    for i, (name, channels, pixels) in enumerate(parts):
+        if i:
+            out.open(path, specs[i], "AppendSubimage")
+        out.write_image(pixels)
+    out.close()
+
+
+def write_synthetic(directory, width, height, num_aovs, depth):
+    rng = np.random.RandomState(0)
+    names = aov_channels(num_aovs)
+    aovs = synthetic_aovs(width, height, len(names), rng)
+    cryptomattes = [(layer, cryptomatte_channels(layer, depth),
+                     synthetic_cryptomatte(width, height, depth, 500, rng))
+                    for layer in CRYPTOMATTES]
+
+    single = os.path.join(directory, "single.exr")
+    all_channels = names + sum([c[1] for c in cryptomattes], [])
+    all_pixels = np.concatenate([aovs] + [c[2] for c in cryptomattes], axis=2)
+    write_parts(single, [("rgba", all_channels, all_pixels)])
+
+    multi = os.path.join(directory, "multi.exr")
+    write_parts(multi, [("rgba", names, aovs)] + cryptomattes)
+    return single, multi
+
+
+def find_layer(path, layer):
+    """Returns (subimage, first channel, end channel) of the layer's rank channels."""
+    inp = oiio.ImageInput.open(path)
+    try:
+        subimage = 0
+        while inp.seek_subimage(subimage, 0):
+            names = inp.spec().channelnames
+            ranks = [i for i, n in enumerate(names)
+                     if n.startswith(layer) and n[len(layer):len(layer) + 2].isdigit()]
+            if ranks:
+                return subimage, ranks[0], ranks[-1] + 1
+            subimage += 1
+    finally:
+        inp.close()
+    raise RuntimeError("no %s ranks in %s" % (layer, path))
+
+
+def read_layer(path, subimage, chbegin, chend):
+    inp = oiio.ImageInput.open(path)
+    pixels = inp.read_image(subimage, 0, chbegin, chend, oiio.FLOAT)
+    inp.close()
+    return pixels
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1])
+    parser.add_argument("files", nargs="*", help="a single-part and a multi-part EXR")
+    parser.add_argument("--layer", default="crypto_object", help="cryptomatte to read")
+    parser.add_argument("--size", type=int, nargs=2, default=(1920, 1080),
+                        help="synthetic image size")
+    parser.add_argument("--aovs", type=int, default=12, help="synthetic RGB AOVs")
+    parser.add_argument("--depth", type=int, default=6, help="synthetic cryptomatte depth")
+    parser.add_argument("--repeat", type=int, default=5, help="timing repetitions")
+    args = parser.parse_args()
+
+    if args.files and len(args.files) != 2:
+        parser.error("give a single-part and a multi-part file, or none")
+    files = args.files
+    if not files:
+        directory = tempfile.mkdtemp()
+        files = write_synthetic(directory, args.size[0], args.size[1], args.aovs, args.depth)
+        print("synthetic files in %s" % directory)
+
+    row = "{:<12} {:>12} {:>10} {:>10} {:>12}"
+    print(row.format("layout", "file bytes", "subimage", "channels", "read ms"))
+    results = []
+    for layout, path in zip(["single", "multi"], files):
+        subimage, chbegin, chend = find_layer(path, args.layer)
+        read_time = min(timeit.repeat(lambda: read_layer(path, subimage, chbegin, chend),
+                                      number=1, repeat=args.repeat))
+        results.append(read_time)
+        print(row.format(layout, os.path.getsize(path), subimage, chend - chbegin,
+                         "%.1f" % (read_time * 1000)))
+
+    print()
+    print("multi-part reads %s in %.2fx the time of single-part" %
+          (args.layer, results[1] / max(results[0], 1e-9)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,153 @@
+#
+#
+#  Copyright (c) 2014, 2015, 2016, 2017 Psyop Media Company, LLC
+#  See license.txt
+#
+#
+"""
+Renders synthetic scenes of growing instance counts (generate_large_scene.py) with kick, and
+times cryptomatte setup, manifest compile, render and sidecar write, to find superlinear costs.
+
+    python tests/benchmark_scene_scaling.py [--sizes 1000 10000 100000 1000000] [--json out]
+        [scene options of generate_large_scene.py]
+
+Setup, manifest compile and sidecar write times come from cryptomatte's performance stats
+(performance_stats_json), which the scenes turn on, and render time from the Arnold log. Without
+the stats JSON, they fall back to the log: Arnold's node init, which includes the cryptomatte
+shader's setup, cryptomatte's "manifests created" time, and driver init/close, where the
+manifest driver writes sidecars (use --sidecars). Between sizes, each time is given as its
+growth exponent: 1 is linear in instances, 2 quadratic. Needs kick on the PATH, and the plugin
+in ../build or --plugin-path.
+"""
+from __future__ import print_function
+
+import argparse
+import json
+import math
+import os
+import re
+import subprocess
+import tempfile
+import time
+
+import generate_large_scene
+
+STAGES = ["generate", "setup", "manifest", "render", "sidecar", "kick"]
+
+# Arnold stats lines, for example "|   node init                 0:00.35"
+ARNOLD_TIMES = {
+    "setup": re.compile(r"\|\s+node init\s+([\d:.]+)"),
+    "render": re.compile(r"\|\s+rendering\s+([\d:.]+)"),
+    "sidecar": re.compile(r"\|\s+driver init/close\s+([\d:.]+)"),
+}
+MANIFEST_TIME = re.compile(r"Cryptomatte manifests created - ([\d.]+) seconds")
+# cryptomatte_stats.h times, more precise than the log
+STATS_TIMES = {"setup": "setup", "manifest": "manifest_compile", "sidecar": "sidecar_write"}
+
+
+def arnold_seconds(text):
+    """Seconds of an Arnold time, h:mm:ss.ss, mm:ss.ss or ss.ss."""
+    seconds = 0.0
+    for part in text.split(":"):
+        seconds = seconds * 60 + float(part)
+    return seconds
+
+
+def parse_log(path):
+    times = {}
+    with open(path) as f:
+        for line in f:
+            for stage, pattern in ARNOLD_TIMES.items():
+                match = pattern.search(line)
+                if match and stage not in times:
+                    times[stage] = arnold_seconds(match.group(1))
+            match = MANIFEST_TIME.search(line)
+            if match:
+                times["manifest"] = times.get("manifest", 0.0) + float(match.group(1))
+    return times
+
+
+def result_image(ass):
+    """The image of a generated scene, as generate_large_scene.write_options names it."""
+    scene_name = os.path.splitext(os.path.basename(ass))[0]
+    return os.path.join(os.path.dirname(ass), "%s_result" % scene_name, scene_name + ".exr")
+
+
+def render(ass, kick, plugin_path, threads):
+    directory = os.path.dirname(ass)
+    log = os.path.join(directory, os.path.splitext(os.path.basename(ass))[0] + ".log")
+    cmd = [kick, "-v", "2", "-t", str(threads), "-dp", "-dw", "-sl", "-nostdin", "-logfile", log,
+           "-i", os.path.basename(ass)]
+    env = os.environ.copy()
+    env["ARNOLD_PLUGIN_PATH"] = os.pathsep.join([plugin_path, env.get("ARNOLD_PLUGIN_PATH", "")])
+    start = time.time()
+    rc = subprocess.call(cmd, cwd=directory, env=env)
+    kick_seconds = time.time() - start
+    if rc != 0:
+        raise RuntimeError("kick failed with %d, see %s" % (rc, log))
+    times = parse_log(log)
+    times["kick"] = kick_seconds
+    stats_json = os.path.splitext(result_image(ass))[0] + ".cryptomatte_stats.json"
+    if os.path.isfile(stats_json):
+        with open(stats_json) as f:
+            stats = json.load(f)
+        times["cryptomatte_stats"] = stats
+        for stage, name in STATS_TIMES.items():
+            times[stage] = stats["times"][name]
+    return times
+
+
+def growth(previous, current, stage):
+    before, after = previous["times"].get(stage), current["times"].get(stage)
+    if not before or not after or before < 1e-3:
+        return ""
+    return "^%.2f" % (math.log(after / before) / math.log(
+        float(current["instances"]) / previous["instances"]))
+
+
+def main():
+    file_dir = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1])
+    parser.add_argument("--sizes", type=int, nargs="+", default=[1000, 10000, 100000, 1000000],
+                        help="instance counts")
+    parser.add_argument("--kick", default="kick")
+    parser.add_argument("--plugin-path", default=os.path.join(file_dir, "..", "build"))
+    parser.add_argument("--threads", type=int, default=0, help="render threads, 0 for all")
+    parser.add_argument("--dir", help="where scenes are written, default a temporary directory")
+    parser.add_argument("--json", help="also write the results to this file")
+    generate_large_scene.add_scene_arguments(parser)
+    args = parser.parse_args()
+    args.stats = True
+
+    directory = args.dir or tempfile.mkdtemp()
+    print("scenes in %s" % directory)
+    row = "{:>10}" + " {:>16}" * len(STAGES)
+    print(row.format("instances", *[s + " s" for s in STAGES]))
+
+    results = []
+    for instances in sorted(args.sizes):
+        ass = os.path.join(directory, "scaling_%d.ass" % instances)
+        start = time.time()
+        generate_large_scene.write_scene(ass, generate_large_scene.scene_params(args, instances))
+        generate_seconds = time.time() - start
+
+        times = render(ass, args.kick, os.path.abspath(args.plugin_path), args.threads)
+        times["generate"] = generate_seconds
+        result = {"instances": instances, "stats": times.pop("cryptomatte_stats", None),
+                  "times": times}
+        cells = []
+        for stage in STAGES:
+            cell = "%.3f" % times[stage] if stage in times else "-"
+            if results:
+                cell += growth(results[-1], result, stage).rjust(6)
+            cells.append(cell)
+        print(row.format(instances, *cells))
+        results.append(result)
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"scene": vars(args), "results": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,248 @@
+#
+#
+#  Copyright (c) 2014, 2015, 2016, 2017 Psyop Media Company, LLC
+#  See license.txt
+#
+#
+"""
+Writes synthetic .ass scenes of up to millions of instances, to scale test cryptomatte.
+
+    python tests/generate_large_scene.py scene.ass [--instances 100000] [--namespace-depth 3]
+        [--naming maya|houdini|plain] [--shaders-per-mesh 4] [--overrides 0.1] [--sidecars]
+
+Instances are ginstances of a few prototype meshes, in a grid in front of the camera, named in
+the style of MtoA (namespaces), HtoA (paths) or with plain names. Every prototype has
+shaders-per-mesh per face shaders (shidxs), from a shared pool of shaders. A fraction of the
+instances (overrides) carries per face crypto_object and crypto_material user data arrays, which
+cryptomatte adds to its manifests one element at a time. The image and cryptomattes are written
+next to the scene, to <scene>_result/, with cryptomatte's performance stats when asked.
+"""
+from __future__ import print_function
+
+import argparse
+import math
+import os
+import random
+
+NAMING_STYLES = ["maya", "houdini", "plain"]
+
+
+class SceneParams(object):
+    def __init__(self, instances=1000, namespace_depth=2, naming="maya", shaders_per_mesh=1,
+                 overrides=0.0, meshes=16, shaders=64, branching=10, resolution=(256, 256),
+                 aa_samples=3, sidecars=False, stats=False, seed=0):
+        self.instances = instances
+        self.namespace_depth = namespace_depth
+        self.naming = naming
+        self.shaders_per_mesh = shaders_per_mesh
+        self.overrides = overrides
+        self.meshes = meshes
+        self.shaders = shaders
+        self.branching = branching
+        self.resolution = resolution
+        self.aa_samples = aa_samples
+        self.sidecars = sidecars
+        self.stats = stats
+        self.seed = seed
+
+
+def namespaces(index, params):
+    """Namespace (or path) components of an instance, branching children per level."""
+    levels = []
+    for level in range(params.namespace_depth):
+        group = index // params.branching**(params.namespace_depth - level)
+        levels.append("grp%d_%d" % (level, group % params.branching**(level + 1)))
+    return levels
+
+
+def instance_name(index, params):
+    levels = namespaces(index, params)
+    if params.naming == "maya":
+        return "".join(l + ":" for l in levels) + "pCylinder%dShape" % index
+    elif params.naming == "houdini":
+        return "/obj/" + "".join(l + "/" for l in levels) + "geo:instances:%d" % index
+    return "object_%d" % index
+
+
+def shader_name(index, params):
+    if params.naming == "maya":
+        return "matlib:surface%dSG" % index
+    elif params.naming == "houdini":
+        return "/shop/mat%d/standard_surface1" % index
+    return "material_%d" % index
+
+
+def mesh_name(index, params):
+    if params.naming == "houdini":
+        return "/obj/proto%d:polygons:0" % index
+    return "proto%dShape" % index
+
+
+def num_faces(params):
+    return max(params.shaders_per_mesh, 6)
+
+
+def write_options(out, scene_name, params):
+    result = "%s_result" % scene_name
+    outputs = ["RGBA RGBA gaussian_filter crypto_driver"]
+    outputs += ["%s RGB gaussian_filter crypto_driver" % aov
+                for aov in ("crypto_asset", "crypto_object", "crypto_material")]
+    out.write("options\n{\n")
+    out.write(" AA_samples %d\n" % params.aa_samples)
+    out.write(" outputs %d 1 STRING\n" % len(outputs))
+    for output in outputs:
+        out.write('  "%s"\n' % output)
+    out.write(" xres %d\n yres %d\n" % params.resolution)
+    out.write(' camera "camera"\n')
+    out.write(' aov_shaders 1 1 NODE\n  "cryptomatte1"\n')
+    out.write(" GI_diffuse_depth 0\n GI_specular_depth 0\n GI_transmission_depth 0\n}\n\n")
+
+    out.write("cryptomatte\n{\n name cryptomatte1\n")
+    out.write(" sidecar_manifests %d\n" % (1 if params.sidecars else 0))
+    if params.stats:
+        out.write(" performance_stats 1\n performance_stats_json 1\n")
+    out.write("}\n\n")
+    out.write("gaussian_filter\n{\n name gaussian_filter\n width 2\n}\n\n")
+    out.write('driver_exr\n{\n name crypto_driver\n filename "%s/%s.exr"\n' % (result, scene_name))
+    out.write(' compression "zips"\n}\n\n')
+    out.write("skydome_light\n{\n name sky\n intensity 1\n}\n\n")
+
+
+def grid_size(params):
+    return int(math.ceil(math.sqrt(params.instances)))
+
+
+def write_camera(out, params):
+    # looks down -Z at the grid of instances, which is side units across
+    side = grid_size(params)
+    distance = side * 0.5 / math.tan(math.radians(27)) + 2.0
+    out.write("persp_camera\n{\n name camera\n fov 54\n")
+    out.write(" matrix\n 1 0 0 0\n 0 1 0 0\n 0 0 1 0\n %g %g %g 1\n" %
+              (side * 0.5, side * 0.5, distance))
+    out.write(" far_clip %g\n}\n\n" % (distance * 4))
+
+
+def write_shaders(out, params, rng):
+    for i in range(params.shaders):
+        out.write("standard_surface\n{\n name %s\n" % shader_name(i, params))
+        out.write(" base_color %.3f %.3f %.3f\n}\n\n" %
+                  (rng.random(), rng.random(), rng.random()))
+
+
+def write_prototypes(out, params):
+    """Open cylinders of num_faces quads, one shader per face in turn, hidden."""
+    faces = num_faces(params)
+    vlist = []
+    for y in (-0.5, 0.5):
+        for k in range(faces):
+            angle = 2 * math.pi * k / faces
+            vlist.append("%.5f %g %.5f" % (0.4 * math.cos(angle), y, 0.4 * math.sin(angle)))
+    vidxs = []
+    for k in range(faces):
+        vidxs += [k, (k + 1) % faces, faces + (k + 1) % faces, faces + k]
+    shidxs = [k % params.shaders_per_mesh for k in range(faces)]
+
+    for m in range(params.meshes):
+        shaders = [shader_name((m * params.shaders_per_mesh + s) % params.shaders, params)
+                   for s in range(params.shaders_per_mesh)]
+        out.write("polymesh\n{\n name %s\n visibility 0\n" % mesh_name(m, params))
+        out.write(" nsides %d 1 UINT\n%s\n" % (faces, " ".join(["4"] * faces)))
+        out.write(" vidxs %d 1 UINT\n%s\n" % (len(vidxs), " ".join(str(v) for v in vidxs)))
+        out.write(" vlist %d 1 VECTOR\n%s\n" % (len(vlist), " ".join(vlist)))
+        out.write(" shader %d 1 NODE\n%s\n" % (len(shaders), " ".join('"%s"' % s
+                                                                      for s in shaders)))
+        out.write(" shidxs %d 1 BYTE\n%s\n" % (faces, " ".join(str(s) for s in shidxs)))
+        if params.naming == "maya":
+            out.write(" declare mtoa_shading_groups constant ARRAY NODE\n")
+            out.write(" mtoa_shading_groups %d 1 NODE\n%s\n" %
+                      (len(shaders), " ".join('"%s"' % s for s in shaders)))
+        out.write("}\n\n")
+
+
+def write_instances(out, params, rng):
+    side = grid_size(params)
+    faces = num_faces(params)
+    override_every = int(round(1.0 / params.overrides)) if params.overrides > 0 else 0
+    for i in range(params.instances):
+        name = instance_name(i, params)
+        scale = 0.6 + 0.3 * rng.random()
+        out.write("ginstance\n{\n name %s\n node %s\n visibility 255\n inherit_xform off\n" %
+                  (name, mesh_name(i % params.meshes, params)))
+        # tilted towards the camera, so the faces of both ends are seen
+        out.write(" matrix\n %g 0 0 0\n 0 %g %g 0\n 0 %g %g 0\n %d %d 0 1\n" %
+                  (scale, scale * 0.866, -scale * 0.5, scale * 0.5, scale * 0.866, i % side,
+                   i // side))
+        if override_every and i % override_every == 0:
+            out.write(" declare crypto_object uniform STRING\n crypto_object %d 1 STRING\n%s\n" %
+                      (faces, " ".join('"%s_part%d"' % (name, f) for f in range(faces))))
+            out.write(" declare crypto_material uniform STRING\n crypto_material %d 1 STRING\n"
+                      "%s\n" % (faces, " ".join('"override_mat%d"' % (f % params.shaders)
+                                               for f in range(faces))))
+        out.write("}\n\n")
+
+
+def write_scene(path, params):
+    """Writes the scene, returns the path of its result directory."""
+    rng = random.Random(params.seed)
+    scene_dir = os.path.dirname(os.path.abspath(path))
+    scene_name = os.path.splitext(os.path.basename(path))[0]
+    result_dir = os.path.join(scene_dir, "%s_result" % scene_name)
+    if not os.path.isdir(result_dir):
+        os.makedirs(result_dir)
+
+    with open(path, "w") as out:
+        out.write("### synthetic cryptomatte scene: %d instances, %s naming, namespace depth %d, "
+                  "%d shaders per mesh, %g overrides\n\n" %
+                  (params.instances, params.naming, params.namespace_depth,
+                   params.shaders_per_mesh, params.overrides))
+        write_options(out, scene_name, params)
+        write_camera(out, params)
+        write_shaders(out, params, rng)
+        write_prototypes(out, params)
+        write_instances(out, params, rng)
+    return result_dir
+
+
+def add_scene_arguments(parser):
+    defaults = SceneParams()
+    parser.add_argument("--namespace-depth", type=int, default=defaults.namespace_depth,
+                        help="namespaces (or path levels) above each instance")
+    parser.add_argument("--naming", choices=NAMING_STYLES, default=defaults.naming)
+    parser.add_argument("--shaders-per-mesh", type=int, default=defaults.shaders_per_mesh,
+                        help="per face shaders of every mesh")
+    parser.add_argument("--overrides", type=float, default=defaults.overrides,
+                        help="fraction of instances with per face user data overrides")
+    parser.add_argument("--meshes", type=int, default=defaults.meshes, help="prototype meshes")
+    parser.add_argument("--shaders", type=int, default=defaults.shaders, help="shader pool size")
+    parser.add_argument("--branching", type=int, default=defaults.branching,
+                        help="children of every namespace")
+    parser.add_argument("--resolution", type=int, nargs=2, default=defaults.resolution)
+    parser.add_argument("--aa-samples", type=int, default=defaults.aa_samples)
+    parser.add_argument("--sidecars", action="store_true", help="write sidecar manifests")
+    parser.add_argument("--stats", action="store_true",
+                        help="turn on cryptomatte's performance stats, written to JSON")
+    parser.add_argument("--seed", type=int, default=defaults.seed)
+
+
+def scene_params(args, instances):
+    return SceneParams(instances=instances, namespace_depth=args.namespace_depth,
+                       naming=args.naming, shaders_per_mesh=args.shaders_per_mesh,
+                       overrides=args.overrides, meshes=args.meshes, shaders=args.shaders,
+                       branching=args.branching, resolution=tuple(args.resolution),
+                       aa_samples=args.aa_samples, sidecars=args.sidecars, stats=args.stats,
+                       seed=args.seed)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[1])
+    parser.add_argument("ass", help="scene to write")
+    parser.add_argument("--instances", type=int, default=SceneParams().instances)
+    add_scene_arguments(parser)
+    args = parser.parse_args()
+    if args.shaders_per_mesh < 1 or args.shaders_per_mesh > 255:
+        parser.error("shaders-per-mesh must be between 1 and 255")
+    write_scene(args.ass, scene_params(args, args.instances))
+
+
+if __name__ == "__main__":
+    main()